@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "buffer.h"
+#include "simd.h"
+
+/**
+ * A needle that also matches with up to a given number of its bytes
+ * different: the Hamming distance, so bytes can be substituted but not
+ * inserted or deleted, and every match is exactly as long as the needle.
+ * Each match says how many bytes differed.
+ *
+ * Searched with simd_search::find_approx, which counts mismatches for a
+ * vector of offsets at a time.
+ */
+class approx_needle : public needle
+{
+public:
+	/**
+	 * A @max_distance of zero makes an exact (if slower) search.
+	 */
+	approx_needle(const std::vector<uint8_t>& bytes, uint32_t max_distance) :
+		m_bytes(bytes),
+		m_max_distance(std::min<uint64_t>(max_distance, bytes.size()))
+	{}
+
+	approx_needle(const approx_needle& other) = delete;
+	approx_needle& operator=(const approx_needle& rhs) = delete;
+
+	virtual uint64_t length() const override { return m_bytes.size(); }
+
+	uint32_t max_distance() const { return m_max_distance; }
+
+	virtual uint64_t first_match(const buffer& haystack, uint64_t start = 0) const override
+	{
+		uint32_t distance;
+		return find(haystack, start, distance);
+	}
+
+	virtual bool for_each_match(const buffer& haystack, const match_visitor& visit, uint64_t start = 0) const override
+	{
+		uint32_t distance = 0;
+		return buffer::visit_each([&](uint64_t from) {
+			return find(haystack, from, distance);
+		}, [&](uint64_t offset) {
+			return visit({ offset, m_bytes.size(), 0, distance });
+		}, start);
+	}
+
+private:
+	uint64_t find(const buffer& haystack, uint64_t start, uint32_t& distance) const
+	{
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			return simd_search::find_approx(hay.data(), hay.size(), m_bytes.data(), m_bytes.size(),
+			                                m_max_distance, distance, start);
+		}
+		return find_bytewise(haystack, start, distance);
+	}
+
+	/**
+	 * For buffers that aren't contiguous.
+	 */
+	uint64_t find_bytewise(const buffer& haystack, uint64_t start, uint32_t& distance) const
+	{
+		const uint64_t len = haystack.length();
+		const uint64_t needle_len = m_bytes.size();
+		if (needle_len == 0 || needle_len > len) {
+			return UINT64_MAX;
+		}
+
+		for (uint64_t i = start; i <= len - needle_len; ++i) {
+			uint32_t mismatches = 0;
+			for (uint64_t j = 0; j < needle_len && mismatches <= m_max_distance; ++j) {
+				mismatches += haystack[i + j] != m_bytes[j];
+			}
+			if (mismatches <= m_max_distance) {
+				distance = mismatches;
+				return i;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+	const std::vector<uint8_t> m_bytes;
+	const uint32_t m_max_distance;
+};
@@ -1,28 +1,40 @@
 #include <benchmark/benchmark.h>
 
 #include "buffer.h"
+#include "index.h"
+#include "masked_needle.h"
+#include "multi_needle.h"
+#include "output.h"
+#include "parallel.h"
+#include "regex.h"
 
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <random>
 #include <stdint.h>
+#include <unistd.h>
 #include <vector>
 
-uint8_t* get_buf(uint32_t len)
+uint8_t* get_buf(uint64_t len)
 {
 	const char* seed_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 	uint8_t* buf = new uint8_t[len];
 
-	for (uint32_t i = 0; i < len; ++i) {
+	for (uint64_t i = 0; i < len; ++i) {
 		buf[i] = seed_chars[i % 52];
 	}
 
 	return buf;
 }
 
-std::vector<uint8_t> get_vec(uint32_t len)
+std::vector<uint8_t> get_vec(uint64_t len)
 {
 	const char* seed_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 	std::vector<uint8_t> vec(len);
 
-	for (uint32_t i = 0; i < len; ++i) {
+	for (uint64_t i = 0; i < len; ++i) {
 		vec[i] = seed_chars[i % 52];
 	}
 
@@ -31,7 +43,7 @@ std::vector<uint8_t> get_vec(uint32_t len)
 
 static void bm_create_arraybuf_from_byte_buffer(benchmark::State& state)
 {
-	const uint32_t len = 65536;
+	const uint64_t len = 65536;
 	uint8_t* test_buf = get_buf(len);
 
 	for (auto _ : state) {
@@ -46,7 +58,7 @@ BENCHMARK(bm_create_arraybuf_from_byte_buffer);
 
 static void bm_create_arraybuf_from_vector(benchmark::State& state)
 {
-	const uint32_t len = 65536;
+	const uint64_t len = 65536;
 	std::vector<uint8_t> vec = get_vec(len);
 
 	for (auto _ : state) {
@@ -57,10 +69,10 @@ BENCHMARK(bm_create_arraybuf_from_vector);
 
 static void bm_find_first_easy(benchmark::State& state)
 {
-	const uint32_t len = 256;
+	const uint64_t len = 256;
 	std::vector<uint8_t> vec = get_vec(len);
 	arraybuf ab(vec);
-	uint32_t result = 0;
+	uint64_t result = 0;
 
 	for (auto _ : state) {
 		result = ab.find_first(arraybuf{'Z', 'a', 'b'});
@@ -74,13 +86,13 @@ BENCHMARK(bm_find_first_easy);
 
 static void bm_find_first_hard(benchmark::State& state)
 {
-	const uint32_t len = state.range(0);
+	const uint64_t len = state.range(0);
 	std::vector<uint8_t> vec = get_vec(len);
 	vec[len - 5] = '1';
 	vec[len - 4] = '2';
 	vec[len - 3] = '3';
 	arraybuf ab(vec);
-	uint32_t result = 0;
+	uint64_t result = 0;
 
 	for (auto _ : state) {
 		result = ab.find_first(arraybuf{'1', '2', '3'});
@@ -89,18 +101,19 @@ static void bm_find_first_hard(benchmark::State& state)
 			break;
 		}
 	}
+	state.SetBytesProcessed(state.iterations() * len);
 }
 BENCHMARK(bm_find_first_hard)->Arg(65536)->Arg(67108864)->Arg(1073741824);
 
 static void bm_find_first_needle(benchmark::State& state)
 {
-	const uint32_t len = state.range(0);
+	const uint64_t len = state.range(0);
 	std::vector<uint8_t> vec = get_vec(len);
 	vec[len - 5] = '1';
 	vec[len - 4] = '2';
 	vec[len - 3] = '3';
 	arraybuf ab(vec);
-	uint32_t result = 0;
+	uint64_t result = 0;
 	buffer_needle bn({'1', '2', '3'});
 
 	for (auto _ : state) {
@@ -110,16 +123,17 @@ static void bm_find_first_needle(benchmark::State& state)
 			break;
 		}
 	}
+	state.SetBytesProcessed(state.iterations() * len);
 }
 BENCHMARK(bm_find_first_needle)->Arg(65536)->Arg(67108864)->Arg(1073741824);
 
 static void bm_find_all(benchmark::State& state)
 {
-	const uint32_t len = state.range(0);
+	const uint64_t len = state.range(0);
 	std::vector<uint8_t> vec = get_vec(len);
 	arraybuf ab(vec);
-	std::list<uint32_t> result;
-	uint32_t expected_length = len / 52;
+	std::list<uint64_t> result;
+	uint64_t expected_length = len / 52;
 
 	for (auto _ : state) {
 		result = ab.find_all(arraybuf{'Z', 'a', 'b'});
@@ -128,17 +142,18 @@ static void bm_find_all(benchmark::State& state)
 			break;
 		}
 	}
+	state.SetBytesProcessed(state.iterations() * len);
 }
 BENCHMARK(bm_find_all)->Arg(65536)->Arg(67108864)->Arg(1073741824);
 
 static void bm_find_all_needle_short(benchmark::State& state)
 {
-	const uint32_t len = state.range(0);
+	const uint64_t len = state.range(0);
 	std::vector<uint8_t> vec = get_vec(len);
 	arraybuf ab(vec);
-	std::list<uint32_t> result;
+	std::list<uint64_t> result;
 	buffer_needle bn({'Z', 'a', 'b'});
-	uint32_t expected_length = len / 52;
+	uint64_t expected_length = len / 52;
 
 	for (auto _ : state) {
 		result = bn.match(ab);
@@ -147,18 +162,19 @@ static void bm_find_all_needle_short(benchmark::State& state)
 			break;
 		}
 	}
+	state.SetBytesProcessed(state.iterations() * len);
 }
 BENCHMARK(bm_find_all_needle_short)->Arg(65536)->Arg(67108864)->Arg(1073741824);
 
 static void bm_find_all_needle_long(benchmark::State& state)
 {
-	const uint32_t len = state.range(0);
+	const uint64_t len = state.range(0);
 	std::vector<uint8_t> vec = get_vec(len);
 	arraybuf ab(vec);
-	std::list<uint32_t> result;
+	std::list<uint64_t> result;
 	buffer_needle bn({'Z', 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k',
 	                  'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w'});
-	uint32_t expected_length = len / 52;
+	uint64_t expected_length = len / 52;
 
 	for (auto _ : state) {
 		result = bn.match(ab);
@@ -167,7 +183,759 @@ static void bm_find_all_needle_long(benchmark::State& state)
 			break;
 		}
 	}
+	state.SetBytesProcessed(state.iterations() * len);
 }
 BENCHMARK(bm_find_all_needle_long)->Arg(65536)->Arg(67108864)->Arg(1073741824);
 
+/**
+ * Fill a buffer in place with the benchmark alphabet.
+ *
+ * The above benchmarks build a vector and then copy it, which needs twice the
+ * memory; at the sizes below we can't afford that.
+ */
+static void fill_buf(buffer& buf)
+{
+	const char* seed_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	const uint64_t len = buf.length();
+
+	for (uint64_t i = 0; i < len; ++i) {
+		buf[i] = seed_chars[i % 52];
+	}
+}
+
+static void bm_find_first_needle_over_4g(benchmark::State& state)
+{
+	const uint64_t len = state.range(0);
+	arraybuf ab(nullptr, len);
+	fill_buf(ab);
+	ab[len - 5] = '1';
+	ab[len - 4] = '2';
+	ab[len - 3] = '3';
+	uint64_t result = 0;
+	buffer_needle bn({'1', '2', '3'});
+
+	for (auto _ : state) {
+		result = bn.first_match(ab);
+		if (result != len - 5) {
+			state.SkipWithError("Could not match string");
+			break;
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_find_first_needle_over_4g)->Arg(4294967296 + 65536)->Arg(6442450944);
+
+static void bm_find_all_needle_over_4g(benchmark::State& state)
+{
+	const uint64_t len = state.range(0);
+	arraybuf ab(nullptr, len);
+	fill_buf(ab);
+	std::list<uint64_t> result;
+	buffer_needle bn({'Z', 'a', 'b'});
+	uint64_t expected_length = len / 52;
+
+	for (auto _ : state) {
+		result = bn.match(ab);
+		if (result.size() != expected_length) {
+			state.SkipWithError("Could not match string");
+			break;
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_find_all_needle_over_4g)->Arg(4294967296 + 65536)->Arg(6442450944);
+
+/**
+ * Text-like data: lots of repeated words, so the first byte of a needle
+ * (a space, a common letter) matches far more often than the whole needle.
+ */
+std::vector<uint8_t> get_text(uint64_t len)
+{
+	const char* words[] = { "the ", "quick ", "brown ", "fox ", "jumps ", "over ",
+	                        "lazy ", "dog ", "and ", "then ", "sleeps ", "there " };
+	std::vector<uint8_t> vec(len);
+	uint64_t seed = 1;
+
+	for (uint64_t i = 0; i < len;) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		for (const char* w = words[(seed >> 33) % 12]; *w && i < len; ++w) {
+			vec[i++] = *w;
+		}
+	}
+
+	return vec;
+}
+
+static void bm_simd_find_all_text(benchmark::State& state)
+{
+	const simd_search::level level = (simd_search::level)state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec = get_text(len);
+	const uint8_t needle[] = { ' ', 't', 'h', 'e', 'r', 'e', ' ' };
+	uint64_t count = 0;
+
+	if (!simd_search::supported(level)) {
+		state.SkipWithError("Instruction set not supported");
+		return;
+	}
+	state.SetLabel(simd_search::level_name(level));
+
+	for (auto _ : state) {
+		count = 0;
+		for (uint64_t i = simd_search::find(level, vec.data(), len, needle, sizeof(needle));
+		     i != UINT64_MAX;
+		     i = simd_search::find(level, vec.data(), len, needle, sizeof(needle), i + 1)) {
+			++count;
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_simd_find_all_text)->ArgsProduct({
+	{ simd_search::SCALAR, simd_search::SSE2, simd_search::AVX2, simd_search::AVX512 },
+	{ 65536, 67108864 }
+});
+
+/**
+ * Needles of each short length class (2, 4, 8 and 16 bytes, plus 3 and 12 to
+ * cover the overlapping compares) taken from text, so the first/last byte
+ * filter passes often and the cost of checking candidates shows.
+ */
+static void bm_engine_find_all_short(benchmark::State& state)
+{
+	const search_engine::kind kind = (search_engine::kind)state.range(0);
+	const uint64_t needle_len = state.range(1);
+	const uint64_t len = 16 * 1024 * 1024;
+	std::vector<uint8_t> vec = get_text(len);
+	const char* text = " there are the other three thing";
+	auto engine = search_engine::create((const uint8_t*)text, needle_len, kind);
+	uint64_t count = 0;
+
+	state.SetLabel(engine->name());
+	for (auto _ : state) {
+		count = 0;
+		for (uint64_t i = engine->find(vec.data(), len, 0); i != UINT64_MAX;
+		     i = engine->find(vec.data(), len, i + 1)) {
+			++count;
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_engine_find_all_short)->ArgsProduct({
+	{ search_engine::SHORT, search_engine::SIMD, search_engine::MEMMEM },
+	{ 2, 3, 4, 8, 12, 16 }
+});
+
+/**
+ * The byte-at-a-time loop the buffer search used before the SIMD kernel, for
+ * comparison with the above.
+ */
+static void bm_bytewise_find_all_text(benchmark::State& state)
+{
+	const uint64_t len = state.range(0);
+	std::vector<uint8_t> vec = get_text(len);
+	arraybuf ab(vec);
+	strbuf needle(" there ");
+	const buffer& hay = ab;
+	uint64_t count = 0;
+
+	for (auto _ : state) {
+		count = 0;
+		for (uint64_t i = 0; i <= len - needle.length(); ++i) {
+			if (needle[0] != hay[i]) continue;
+			if (hay.cmp(needle, i)) {
+				++count;
+			}
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_bytewise_find_all_text)->Arg(65536)->Arg(67108864);
+
+static void bm_engine_find_all_long(benchmark::State& state)
+{
+	const search_engine::kind kind = (search_engine::kind)state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec = get_vec(len);
+	arraybuf ab(vec);
+	buffer_needle bn({'Z', 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k',
+	                  'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w'});
+	bn.set_engine(kind);
+	std::list<uint64_t> result;
+	uint64_t expected_length = len / 52;
+
+	state.SetLabel(bn.engine().name());
+	for (auto _ : state) {
+		result = bn.match(ab);
+		if (result.size() != expected_length) {
+			state.SkipWithError("Could not match string");
+			break;
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_engine_find_all_long)->ArgsProduct({
+	{ search_engine::AUTO, search_engine::SIMD, search_engine::HORSPOOL,
+	  search_engine::TWO_WAY, search_engine::MEMMEM },
+	{ 65536, 67108864 }
+});
+
+/**
+ * The classic bad case: a haystack of 'a's and a needle of 'a's with a 'b'
+ * in the middle. Every position is a near-miss that only fails halfway
+ * through the needle, which makes naive search O(n*m).
+ */
+static void bm_engine_find_periodic(benchmark::State& state)
+{
+	const search_engine::kind kind = (search_engine::kind)state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec(len, 'a');
+	std::vector<uint8_t> needle(state.range(2), 'a');
+	needle[needle.size() / 2] = 'b';
+	buffer_needle bn(needle, kind);
+	arraybuf ab(vec);
+
+	state.SetLabel(bn.engine().name());
+	for (auto _ : state) {
+		if (bn.first_match(ab) != UINT64_MAX) {
+			state.SkipWithError("Unexpected match");
+			break;
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_engine_find_periodic)->ArgsProduct({
+	{ search_engine::AUTO, search_engine::SIMD, search_engine::HORSPOOL,
+	  search_engine::TWO_WAY, search_engine::MEMMEM },
+	{ 1048576 },
+	{ 16, 64, 1024 }
+});
+
+static void bm_multi_needle(benchmark::State& state)
+{
+	const uint64_t num_patterns = state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec = get_text(len);
+	arraybuf ab(vec);
+	std::vector<std::vector<uint8_t>> patterns;
+	uint64_t seed = 7;
+
+	// Random 8-byte lowercase signatures; few of them will ever match
+	for (uint64_t i = 0; i < num_patterns; ++i) {
+		patterns.emplace_back(8);
+		for (auto& c : patterns.back()) {
+			seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+			c = 'a' + (seed >> 33) % 26;
+		}
+	}
+	multi_needle mn(patterns);
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(mn.match_detail(ab));
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_multi_needle)->ArgsProduct({ { 1, 10, 500 }, { 67108864 } });
+
+static void bm_parallel_find_all(benchmark::State& state)
+{
+	const uint64_t threads = state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec = get_text(len);
+	arraybuf ab(vec);
+	buffer_needle bn({' ', 't', 'h', 'e', 'r', 'e', ' '});
+	thread_pool pool(threads);
+	parallel_search ps(pool);
+
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(ps.match_vector(bn, ab));
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_parallel_find_all)->ArgsProduct({ { 1, 2, 4, 8 }, { 268435456 } })->UseRealTime();
+
+/*
+ * Dense matches split across threads, gathered as offsets against just
+ * counted (-c) or just checked for (-l).
+ *
+ * 0 = match_vector, 1 = count, 2 = first_match
+ */
+static void bm_parallel_count(benchmark::State& state)
+{
+	const uint64_t mode = state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec(len, 0);
+	arraybuf ab(vec);
+	buffer_needle bn({0});
+	thread_pool pool(4);
+	parallel_search ps(pool);
+
+	for (auto _ : state) {
+		if (mode == 0) {
+			benchmark::DoNotOptimize(ps.match_vector(bn, ab).size());
+		} else if (mode == 1) {
+			benchmark::DoNotOptimize(ps.count(bn, ab));
+		} else {
+			benchmark::DoNotOptimize(ps.first_match(bn, ab));
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_parallel_count)->ArgsProduct({ { 0, 1, 2 }, { 67108864 } })->UseRealTime();
+
+/*
+ * Dense matches: a zero-filled buffer searched for a single zero byte
+ * matches at every offset, so this measures the cost of handing back
+ * results rather than of finding them.
+ *
+ * 0 = std::list, 1 = std::vector batch, 2 = visitor
+ */
+static void bm_dense_matches(benchmark::State& state)
+{
+	const uint64_t mode = state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec(len, 0);
+	arraybuf ab(vec);
+	buffer_needle bn({0});
+
+	for (auto _ : state) {
+		if (mode == 0) {
+			benchmark::DoNotOptimize(bn.match(ab));
+		} else if (mode == 1) {
+			benchmark::DoNotOptimize(bn.match_vector(ab));
+		} else {
+			uint64_t count = 0;
+			bn.for_each_match(ab, [&](const needle_match&) {
+				++count;
+				return true;
+			});
+			benchmark::DoNotOptimize(count);
+		}
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+	state.SetItemsProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_dense_matches)->ArgsProduct({ { 0, 1, 2 }, { 65536, 16777216 } });
+
+/*
+ * Print a million matches, with 16 bytes of context each, to /dev/null.
+ *
+ * 0 = iostreams with std::endl, the way the CLI used to; 1 = output_writer
+ */
+static void bm_print_matches(benchmark::State& state)
+{
+	const uint64_t mode = state.range(0);
+	const uint64_t matches = 1000000;
+	const uint64_t context = 8;
+	std::vector<uint8_t> vec = get_text(matches + 2 * context);
+	arraybuf ab(vec);
+
+	for (auto _ : state) {
+		if (mode == 0) {
+			std::ofstream out("/dev/null");
+			for (uint64_t offset = context; offset < context + matches; ++offset) {
+				out << std::hex << std::setw(8) << std::setfill(' ') << offset - context << ":  ";
+				for (uint64_t i = offset - context; i <= offset + context; ++i) {
+					out << std::hex << std::setw(2) << std::setfill('0') << (int)ab[i] << ' ';
+				}
+				out << "   | ";
+				for (uint64_t i = offset - context; i <= offset + context; ++i) {
+					out << std::setw(0) << (isprint(ab[i]) ? (char)ab[i] : '.');
+				}
+				out << " |" << std::endl;
+			}
+		} else {
+			int fd = open("/dev/null", O_WRONLY);
+			{
+				output_writer out(fd);
+				match_printer printer(context, context);
+				for (uint64_t offset = context; offset < context + matches; ++offset) {
+					printer.print(out, ab, offset, 1);
+				}
+			}
+			close(fd);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * matches);
+}
+BENCHMARK(bm_print_matches)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+/*
+ * A signature with gaps in it, against the same bytes searched literally.
+ *
+ * 0 = literal " there ", 1 = " t?ere " with a nibble wildcard,
+ * 2 = " t ?? ere " style byte wildcards
+ */
+static void bm_masked_needle(benchmark::State& state)
+{
+	const uint64_t mode = state.range(0);
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec = get_text(len);
+	arraybuf ab(vec);
+	std::vector<uint8_t> bytes = { ' ', 't', 'h', 'e', 'r', 'e', ' ' };
+	std::vector<uint8_t> mask(bytes.size(), 0xff);
+	if (mode == 1) {
+		mask[2] = 0xf0;
+	} else if (mode == 2) {
+		mask[2] = mask[3] = 0;
+	}
+
+	std::unique_ptr<needle> n;
+	if (mode == 0) {
+		n = std::make_unique<buffer_needle>(bytes);
+	} else {
+		n = std::make_unique<masked_needle>(bytes, mask);
+	}
+
+	for (auto _ : state) {
+		uint64_t count = 0;
+		n->for_each_match(ab, [&](const needle_match&) {
+			++count;
+			return true;
+		});
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_masked_needle)->ArgsProduct({ { 0, 1, 2 }, { 67108864 } });
+
+/*
+ * Repeated searches over a fixed file, scanning all of it against looking
+ * up the candidate blocks in an index first.
+ *
+ * 0 = full scan, 1 = indexed
+ */
+static void bm_indexed_search(benchmark::State& state)
+{
+	const bool indexed = state.range(0);
+	const uint64_t len = state.range(1);
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gb_index_bench";
+	std::filesystem::path index_path = path.string() + ".idx";
+	const std::string query = "the haystack needle";
+	{
+		// The text, with one rare phrase in the middle
+		std::vector<uint8_t> vec = get_text(len);
+		memcpy(vec.data() + len / 2, query.data(), query.size());
+		std::ofstream(path, std::ios::binary).write((const char*)vec.data(), vec.size());
+	}
+	ngram_index::builder builder;
+	builder.add(path);
+	builder.write(index_path);
+	std::unique_ptr<ngram_index> index = ngram_index::open(index_path);
+
+	mmapbuf buf(path);
+	buffer_needle n(std::vector<uint8_t>(query.begin(), query.end()));
+	std::vector<uint64_t> blocks;
+	for (auto _ : state) {
+		uint64_t count = 0;
+		auto visit = [&](const needle_match&) {
+			++count;
+			return true;
+		};
+		if (indexed) {
+			index->candidates((const uint8_t*)query.data(), query.size(), blocks);
+			index->for_each_match(n, 0, buf, blocks, visit);
+		} else {
+			n.for_each_match(buf, visit);
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+
+	std::filesystem::remove(path);
+	std::filesystem::remove(index_path);
+}
+BENCHMARK(bm_indexed_search)->ArgsProduct({ { 0, 1 }, { 67108864 } });
+
+/*
+ * Regexes over text: a literal, a pattern with a literal factor the
+ * prefilter can skip to, and one with no literal at all, so every byte goes
+ * through the DFA.
+ *
+ * 0 = " there ", 1 = " th(ere|en) [a-z]+ ", 2 = "[x-z][0-9]"
+ */
+static void bm_regex_needle(benchmark::State& state)
+{
+	const char* patterns[] = { " there ", " th(ere|en) [a-z]+ ", "[x-z][0-9]" };
+	const uint64_t len = state.range(1);
+	std::vector<uint8_t> vec = get_text(len);
+	arraybuf ab(vec);
+	std::string error;
+	std::unique_ptr<regex_needle> rn = regex_needle::compile(patterns[state.range(0)], error);
+	state.SetLabel(patterns[state.range(0)]);
+
+	for (auto _ : state) {
+		uint64_t count = 0;
+		rn->for_each_match(ab, [&](const needle_match&) {
+			++count;
+			return true;
+		});
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_regex_needle)->ArgsProduct({ { 0, 1, 2 }, { 67108864 } });
+
+/*
+ * Hamming-distance search over text, up to k bytes different, with the
+ * scalar loop against the widest SIMD kernel.
+ *
+ * Args are k, needle length and 0 = scalar, 1 = SIMD
+ */
+static void bm_approx_needle(benchmark::State& state)
+{
+	const uint32_t k = state.range(0);
+	const uint64_t needle_len = state.range(1);
+	const simd_search::level level = state.range(2) ? simd_search::best_level() : simd_search::SCALAR;
+	const uint64_t len = 67108864;
+	std::vector<uint8_t> vec = get_text(len);
+	std::vector<uint8_t> needle(vec.begin() + len / 2, vec.begin() + len / 2 + needle_len);
+	state.SetLabel(simd_search::level_name(level));
+
+	for (auto _ : state) {
+		uint64_t count = 0;
+		uint32_t distance;
+		for (uint64_t i = simd_search::find_approx(level, vec.data(), len, needle.data(), needle_len, k, distance);
+		     i != UINT64_MAX;
+		     i = simd_search::find_approx(level, vec.data(), len, needle.data(), needle_len, k, distance, i + 1)) {
+			++count;
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_approx_needle)->ArgsProduct({ { 0, 1, 2, 4 }, { 8, 16, 64 }, { 0, 1 } });
+
+/*
+ * Typed value ranges over random bytes, at any offset and at the type's
+ * own alignment, with the scalar loop against the widest SIMD kernel. The
+ * ranges are narrow, so matches are rare and the compares dominate.
+ *
+ * Args are 0 = u16, 1 = u32, 2 = u64, 3 = f32, 4 = f64; 0 = any offset,
+ * 1 = aligned; and 0 = scalar, 1 = SIMD
+ */
+template <class T>
+static uint64_t count_range(simd_search::level level, const std::vector<uint8_t>& vec, T lo, T hi, uint64_t align)
+{
+	simd_search::value_range<T> range = { lo, hi, false, align };
+	uint64_t count = 0;
+	for (uint64_t i = simd_search::find_range(level, vec.data(), vec.size(), range);
+	     i != UINT64_MAX;
+	     i = simd_search::find_range(level, vec.data(), vec.size(), range, i + 1)) {
+		++count;
+	}
+	return count;
+}
+
+static void bm_range_search(benchmark::State& state)
+{
+	static const char* types[] = { "u16", "u32", "u64", "f32", "f64" };
+	static const uint64_t sizes[] = { 2, 4, 8, 4, 8 };
+	const int type = state.range(0);
+	const uint64_t align = state.range(1) ? sizes[type] : 1;
+	const simd_search::level level = state.range(2) ? simd_search::best_level() : simd_search::SCALAR;
+	const uint64_t len = 67108864;
+	std::vector<uint8_t> vec(len);
+	std::mt19937 rng(42);
+	for (auto& c : vec) {
+		c = rng();
+	}
+	state.SetLabel(std::string(types[type]) + " " + simd_search::level_name(level));
+
+	for (auto _ : state) {
+		uint64_t count = 0;
+		switch (type) {
+		case 0: count = count_range<uint16_t>(level, vec, 0x1000, 0x1003, align); break;
+		case 1: count = count_range<uint32_t>(level, vec, 0x1000, 0x1fffff, align); break;
+		case 2: count = count_range<uint64_t>(level, vec, 0x7f0000000000, 0x7fffffffffff, align); break;
+		case 3: count = count_range<float>(level, vec, 3.14f, 3.15f, align); break;
+		case 4: count = count_range<double>(level, vec, 3.14, 3.15, align); break;
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_range_search)->ArgsProduct({ { 0, 1, 2, 3, 4 }, { 0, 1 }, { 0, 1 } });
+
+/*
+ * Corpora that look like what gets searched in practice, rather than one
+ * repeating alphabet:
+ *
+ *  - random:   uniformly random bytes; first/last byte filters rarely fire
+ *  - sparse:   a zero-filled image with a 32-byte random record every 4K,
+ *              like a flash dump or a disk image
+ *  - elf:      this benchmark binary, repeated
+ *  - text:     get_text()
+ *  - periodic: all 'a's, searched for "aaa...ab"; every position is a
+ *              near-miss, the worst case for naive verification
+ *
+ * Each is built once per length and shared between benchmarks.
+ */
+enum corpus_kind
+{
+	CORPUS_RANDOM,
+	CORPUS_SPARSE,
+	CORPUS_ELF,
+	CORPUS_TEXT,
+	CORPUS_PERIODIC,
+};
+
+static const char* corpus_name(uint64_t kind)
+{
+	switch (kind) {
+	case CORPUS_RANDOM: return "random";
+	case CORPUS_SPARSE: return "sparse";
+	case CORPUS_ELF: return "elf";
+	case CORPUS_TEXT: return "text";
+	case CORPUS_PERIODIC: return "periodic";
+	}
+	return "unknown";
+}
+
+static void fill_random(uint8_t* data, uint64_t len, uint64_t& seed)
+{
+	for (uint64_t i = 0; i < len; ++i) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		data[i] = seed >> 56;
+	}
+}
+
+static const std::vector<uint8_t>& get_corpus(uint64_t kind, uint64_t len)
+{
+	static std::map<std::pair<uint64_t, uint64_t>, std::vector<uint8_t>> cache;
+	auto it = cache.find({ kind, len });
+	if (it != cache.end()) {
+		return it->second;
+	}
+
+	std::vector<uint8_t> vec(len, 0);
+	uint64_t seed = 3;
+	switch (kind) {
+	case CORPUS_RANDOM:
+		fill_random(vec.data(), len, seed);
+		break;
+	case CORPUS_SPARSE:
+		for (uint64_t i = 0; i + 32 <= len; i += 4096) {
+			fill_random(vec.data() + i, 32, seed);
+		}
+		break;
+	case CORPUS_ELF: {
+		std::ifstream in("/proc/self/exe", std::ios::binary);
+		std::vector<uint8_t> exe((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		for (uint64_t i = 0; i < len && !exe.empty(); i += exe.size()) {
+			memcpy(vec.data() + i, exe.data(), std::min<uint64_t>(exe.size(), len - i));
+		}
+		break;
+	}
+	case CORPUS_TEXT:
+		vec = get_text(len);
+		break;
+	case CORPUS_PERIODIC:
+		std::fill(vec.begin(), vec.end(), 'a');
+		break;
+	}
+	return cache.emplace(std::make_pair(kind, len), std::move(vec)).first->second;
+}
+
+/**
+ * A needle of @needle_len bytes for @corpus that's known to occur in it: taken
+ * from the middle, moving along until it's not a run of a single byte value
+ * (which would match nearly everywhere in the sparse image). For the periodic
+ * corpus, "aaa...ab", which never matches.
+ */
+static std::vector<uint8_t> corpus_needle(uint64_t kind, const std::vector<uint8_t>& corpus, uint64_t needle_len)
+{
+	if (kind == CORPUS_PERIODIC) {
+		std::vector<uint8_t> needle(needle_len, 'a');
+		needle.back() = 'b';
+		return needle;
+	}
+
+	for (uint64_t i = corpus.size() / 2; i + needle_len <= corpus.size(); ++i) {
+		const uint8_t* p = corpus.data() + i;
+		if (std::any_of(p, p + needle_len, [&](uint8_t c) { return c != p[0]; })) {
+			return std::vector<uint8_t>(p, p + needle_len);
+		}
+	}
+	return std::vector<uint8_t>(corpus.begin(), corpus.begin() + needle_len);
+}
+
+static uint64_t count_all(const search_engine& engine, const std::vector<uint8_t>& hay)
+{
+	uint64_t count = 0;
+	for (uint64_t i = engine.find(hay.data(), hay.size(), 0); i != UINT64_MAX;
+	     i = engine.find(hay.data(), hay.size(), i + 1)) {
+		++count;
+	}
+	return count;
+}
+
+/*
+ * Every engine on every corpus, across needle lengths: find all matches of a
+ * needle taken from the corpus.
+ */
+static void bm_corpus_needle_sweep(benchmark::State& state)
+{
+	const uint64_t kind = state.range(0);
+	const search_engine::kind engine_kind = (search_engine::kind)state.range(1);
+	const uint64_t needle_len = state.range(2);
+	const std::vector<uint8_t>& corpus = get_corpus(kind, 8 * 1024 * 1024);
+	std::vector<uint8_t> needle = corpus_needle(kind, corpus, needle_len);
+	auto engine = search_engine::create(needle.data(), needle.size(), engine_kind);
+
+	state.SetLabel(std::string(corpus_name(kind)) + " " + engine->name());
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(count_all(*engine, corpus));
+	}
+	state.SetBytesProcessed(state.iterations() * corpus.size());
+}
+BENCHMARK(bm_corpus_needle_sweep)->ArgsProduct({
+	{ CORPUS_RANDOM, CORPUS_SPARSE, CORPUS_ELF, CORPUS_TEXT, CORPUS_PERIODIC },
+	{ search_engine::AUTO, search_engine::SIMD, search_engine::HORSPOOL,
+	  search_engine::TWO_WAY, search_engine::MEMMEM },
+	{ 2, 4, 8, 16, 32, 64, 256 }
+});
+
+/*
+ * Match density: an 8-byte needle planted in random data a given number of
+ * times per MiB, from none at all up to once every 16 bytes, searched both
+ * with the engine alone and through a needle that reports each match.
+ *
+ * 0 = engine find loop, 1 = buffer_needle::for_each_match
+ */
+static void bm_corpus_match_density(benchmark::State& state)
+{
+	const uint64_t mode = state.range(0);
+	const uint64_t per_mib = state.range(1);
+	const uint64_t len = 8 * 1024 * 1024;
+	std::vector<uint8_t> vec = get_corpus(CORPUS_RANDOM, len);
+	const std::vector<uint8_t> needle = { 0x7f, 'E', 'L', 'F', 0x02, 0x01, 0x01, 0x00 };
+	if (per_mib > 0) {
+		const uint64_t stride = 1024 * 1024 / per_mib;
+		for (uint64_t i = 0; i + needle.size() <= len; i += stride) {
+			memcpy(vec.data() + i, needle.data(), needle.size());
+		}
+	}
+	buffer_needle bn(needle);
+	arraybuf ab(vec.data(), vec.size());
+
+	state.SetLabel(mode == 0 ? bn.engine().name() : "for_each_match");
+	for (auto _ : state) {
+		uint64_t count = 0;
+		if (mode == 0) {
+			count = count_all(bn.engine(), vec);
+		} else {
+			bn.for_each_match(ab, [&](const needle_match&) {
+				++count;
+				return true;
+			});
+		}
+		benchmark::DoNotOptimize(count);
+	}
+	state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(bm_corpus_match_density)->ArgsProduct({ { 0, 1 }, { 0, 1, 64, 4096, 65536 } });
+
 BENCHMARK_MAIN();
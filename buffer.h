@@ -1,19 +1,30 @@
 #pragma once
 
+#include <cctype>
 #include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <initializer_list>
 #include <iostream>
 #include <iterator>
 #include <list>
 #include <memory>
+#include <span>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "simd.h"
+
 /**
  * Class defining a buffer interface.
  */
@@ -55,12 +66,26 @@ public:
 
 	virtual ~buffer() = default;
 
-	virtual uint32_t length() const = 0;
+	virtual uint64_t length() const = 0;
 
 	virtual iterator begin() = 0;
 	virtual iterator end() = 0;
-	virtual uint8_t& operator[](uint32_t idx) = 0;
-	virtual const uint8_t& operator[](uint32_t idx) const = 0;
+	virtual uint8_t& operator[](uint64_t idx) = 0;
+	virtual const uint8_t& operator[](uint64_t idx) const = 0;
+
+	/**
+	 * The buffer's bytes as one contiguous block, for the search routines to
+	 * run over directly.
+	 *
+	 * Buffers that don't keep their bytes contiguous return an empty span,
+	 * and get searched a byte at a time through operator[] instead.
+	 */
+	virtual std::span<const uint8_t> span() const { return {}; }
+
+	/**
+	 * Whether span() covers the whole buffer.
+	 */
+	bool contiguous() const { return span().size() == length(); }
 
 	/**
 	 * Compares this buffer to another.
@@ -79,40 +104,50 @@ public:
 	 * Returns true if the slice starting at @start and going @other.length bytes
 	 * is equal to other. False otherwise.
 	 */
-	virtual bool cmp(const buffer& other, uint32_t start) const
+	virtual bool cmp(const buffer& other, uint64_t start) const
 	{
-		if (other.length() > (length() - start)) {
+		const uint64_t other_len = other.length();
+		if (start > length() || other_len > (length() - start)) {
 			return false;
 		}
-		return memcmp(&other[0], &(*this)[start], other.length()) == 0;
+		if (other_len == 0) {
+			return true;
+		}
+
+		std::span<const uint8_t> ours = span();
+		std::span<const uint8_t> theirs = other.span();
+		if (ours.size() == length() && theirs.size() == other_len) {
+			return memcmp(theirs.data(), ours.data() + start, other_len) == 0;
+		}
+		for (uint64_t i = 0; i < other_len; ++i) {
+			if ((*this)[start + i] != other[i]) {
+				return false;
+			}
+		}
+		return true;
 	}
 
 	/**
 	 * Finds the first occurence of @needle in this buffer.
 	 *
-	 * Returns the offset, or UINT32_MAX if not found.
+	 * Returns the offset, or UINT64_MAX if not found.
 	 */
-	virtual uint32_t find_first(const buffer& needle,
-	                            uint32_t start_at = 0) const
+	virtual uint64_t find_first(const buffer& needle,
+	                            uint64_t start_at = 0) const
 	{
-		const uint32_t len = length();
-		const uint32_t needle_len = needle.length();
+		const uint64_t len = length();
+		const uint64_t needle_len = needle.length();
 
-		if (needle_len > len) {
-			return UINT32_MAX;
+		if (needle_len == 0 || needle_len > len) {
+			return UINT64_MAX;
 		}
 
-		uint32_t upto = len - needle_len;
-		uint8_t needle_start = needle[0];
-		for (uint32_t i = start_at; i <= upto; ++i) {
-			// Optimization: compare the first bytes to see if we should even
-			// bother calling cmp at all
-			if (needle_start != (*this)[i]) continue;
-			if (cmp(needle, i)) {
-				return i;
-			}
+		std::span<const uint8_t> hay = span();
+		std::span<const uint8_t> pat = needle.span();
+		if (hay.size() == len && pat.size() == needle_len) {
+			return simd_search::find(hay.data(), len, pat.data(), needle_len, start_at);
 		}
-		return UINT32_MAX;
+		return find_bytewise(*this, len, needle, needle_len, start_at);
 	}
 
 	/**
@@ -120,62 +155,120 @@ public:
 	 *
 	 * Returns a list of buffer offsets where the needle is found.
 	 */
-	virtual std::list<uint32_t> find_all(const buffer& needle,
-	                                     uint32_t start_at = 0) const
+	virtual std::list<uint64_t> find_all(const buffer& needle,
+	                                     uint64_t start_at = 0) const
 	{
-		std::list<uint32_t> ret;
-		const uint32_t len = length();
-		const uint32_t needle_len = needle.length();
+		std::list<uint64_t> ret;
+		find_all(needle, [&](uint64_t offset) {
+			ret.push_back(offset);
+			return true;
+		}, start_at);
+		return ret;
+	}
 
-		if (needle_len > len) {
-			return ret;
+	/**
+	 * Find all instances of @needle in this buffer, calling @visit with the
+	 * offset of each as it's found, without storing any of them.
+	 *
+	 * Stops early if @visit returns false. Returns false if it did.
+	 */
+	virtual bool find_all(const buffer& needle,
+	                      const std::function<bool(uint64_t)>& visit,
+	                      uint64_t start_at = 0) const
+	{
+		const uint64_t len = length();
+		const uint64_t needle_len = needle.length();
+
+		if (needle_len == 0 || needle_len > len) {
+			return true;
 		}
 
-		uint32_t upto = len - needle_len;
-		uint8_t needle_start = needle[0];
-		for (uint32_t i = start_at; i <= upto; ++i) {
-			// Optimization: compare the first bytes to see if we should even
-			// bother calling cmp at all
-			if (needle_start != (*this)[i]) continue;
-			if (cmp(needle, i)) {
-				ret.push_back(i);
-			}
+		std::span<const uint8_t> hay = span();
+		std::span<const uint8_t> pat = needle.span();
+		if (hay.size() == len && pat.size() == needle_len) {
+			return visit_each([&](uint64_t from) {
+				return simd_search::find(hay.data(), len, pat.data(), needle_len, from);
+			}, visit, start_at);
 		}
+		return visit_each([&](uint64_t from) {
+			return find_bytewise(*this, len, needle, needle_len, from);
+		}, visit, start_at);
+	}
 
-		return ret;
+	/**
+	 * Plain byte-at-a-time search, for buffers that aren't contiguous.
+	 * Works on anything that can be indexed, so the same code serves raw
+	 * pointers and buffers.
+	 *
+	 * Returns the offset of the first match at or after @start, or
+	 * UINT64_MAX if there isn't one.
+	 */
+	template<typename H, typename N>
+	static uint64_t find_bytewise(const H& haystack, uint64_t len,
+	                              const N& needle, uint64_t needle_len,
+	                              uint64_t start)
+	{
+		if (needle_len == 0 || needle_len > len) {
+			return UINT64_MAX;
+		}
+		for (uint64_t i = start; i <= len - needle_len; ++i) {
+			uint64_t j = 0;
+			while (j < needle_len && haystack[i + j] == needle[j]) {
+				++j;
+			}
+			if (j == needle_len) {
+				return i;
+			}
+		}
+		return UINT64_MAX;
 	}
 
+	/**
+	 * Call @visit with each offset @find returns, starting from @start and
+	 * moving one past each match, until there are no more or @visit returns
+	 * false.
+	 */
+	template<typename F, typename V>
+	static bool visit_each(F&& find, V&& visit, uint64_t start)
+	{
+		for (uint64_t i = find(start); i != UINT64_MAX; i = find(i + 1)) {
+			if (!visit(i)) {
+				return false;
+			}
+		}
+		return true;
+	}
 
 	/*************************************************************************
 	 * Read various types from the buffer
 	 *   Bounds checking not guaranteed.
 	 */
-	int16_t read_short(uint32_t offset) const
+	int16_t read_short(uint64_t offset) const
 	{
 		return *(int16_t*)(&(*this)[offset]);
 	}
 
-	uint16_t read_ushort(uint32_t offset) const
+	uint16_t read_ushort(uint64_t offset) const
 	{
 		return *(uint16_t*)(&(*this)[offset]);
 	}
 
-	int32_t read_int(uint32_t offset) const
+	int32_t read_int(uint64_t offset) const
 	{
 		return *(int32_t*)(&(*this)[offset]);
 	}
 
-	uint32_t read_uint(uint32_t offset) const
+	uint32_t read_uint(uint64_t offset) const
 	{
 		return *(uint32_t*)(&(*this)[offset]);
 	}
 
-	int64_t read_long(uint32_t offset) const
+	int64_t read_long(uint64_t offset) const
 	{
 		return *(int64_t*)(&(*this)[offset]);
 	}
 
-	uint64_t read_ulong(uint32_t offset) const
+	uint64_t read_ulong(uint64_t offset) const
 	{
 		return *(uint64_t*)(&(*this)[offset]);
 	}
@@ -213,7 +306,7 @@ public:
 	 * If the input buffer is null and length is zero, this constructor is
 	 * equivalent to the empty constructor.
 	 */
-	arraybuf(uint8_t* arr, uint32_t length) :
+	arraybuf(uint8_t* arr, uint64_t length) :
 		m_buf(arr),
 		m_len(length),
 		m_free(false)
@@ -298,31 +391,26 @@ public:
 		m_len(0),
 		m_free(false)
 	{
-		const uint32_t buf_len = 65536;
+		const uint64_t buf_len = 65536;
 		std::list<uint8_t*> buf_list;
 		uint8_t* buf = nullptr;
-		uint32_t total_len = 0;
+		uint64_t total_len = 0;
 
 		// Read the stream until EOF
-		while (stream && total_len < UINT32_MAX) {
+		while (stream) {
 			buf = new uint8_t[buf_len];
 			stream.read((char*)buf, buf_len);
-			if (stream.gcount() > UINT32_MAX - total_len) {
-				// Buffer too large
-				total_len = UINT32_MAX;
-			} else {
-				total_len += stream.gcount();
-			}
+			total_len += stream.gcount();
 			buf_list.push_back(buf);
 			buf = nullptr;
 		}
 
 		// Now construct the buffer from the individual chunks
-		uint32_t remaining_len = total_len;
-		uint32_t bufp = 0;
+		uint64_t remaining_len = total_len;
+		uint64_t bufp = 0;
 		m_buf = new uint8_t[total_len];
 		for (auto* b : buf_list) {
-			uint32_t to_copy = buf_len;
+			uint64_t to_copy = buf_len;
 			if (to_copy > remaining_len) {
 				to_copy = remaining_len;
 			}
@@ -353,7 +441,7 @@ public:
 	/**
 	 * Set the size of the backing array.
 	 */
-	void reserve(uint32_t length)
+	void reserve(uint64_t length)
 	{
 		if (m_free && m_buf) {
 			delete[] m_buf;
@@ -365,7 +453,7 @@ public:
 		m_free = true;
 	}
 
-	virtual uint32_t length() const override { return m_len; }
+	virtual uint64_t length() const override { return m_len; }
 
 	virtual iterator begin() override {
 		return iterator(m_buf);
@@ -375,20 +463,128 @@ public:
 		return iterator(&m_buf[m_len]);
 	}
 
-	virtual uint8_t& operator[](uint32_t idx) override {
+	virtual uint8_t& operator[](uint64_t idx) override {
 		return m_buf[idx];
 	}
 
-	virtual const uint8_t& operator[](uint32_t idx) const override {
+	virtual const uint8_t& operator[](uint64_t idx) const override {
 		return m_buf[idx];
 	}
 
+	virtual std::span<const uint8_t> span() const override {
+		return { m_buf, m_len };
+	}
+
 private:
 	uint8_t* m_buf;
-	uint32_t m_len;
+	uint64_t m_len;
 	bool m_free;
 };
 
+/**
+ * Buffer backed by a memory mapping of a file.
+ *
+ * By default the file is mapped privately, so the page cache is shared with
+ * any other process reading the same file and nothing is copied up front.
+ * Writes through operator[] are copy-on-write and never reach the file on
+ * disk.
+ *
+ * A shared mapping writes straight through to the file instead; only the
+ * pages that are written to get dirtied.
+ *
+ * If the file cannot be mapped (it doesn't exist, is empty, is not a
+ * regular file, or can't be written for a shared mapping) the buffer will
+ * have a length of 0.
+ */
+class mmapbuf : public buffer
+{
+public:
+	mmapbuf(const std::filesystem::path& file_path, bool shared = false) :
+		m_buf(nullptr),
+		m_len(0)
+	{
+		int fd = open(file_path.c_str(), shared ? O_RDWR : O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+			close(fd);
+			return;
+		}
+
+		void* addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+		// The mapping holds its own reference to the file
+		close(fd);
+		if (addr == MAP_FAILED) {
+			return;
+		}
+
+		// We scan front to back, so ask for aggressive readahead and have the
+		// kernel start paging the file in right away.
+		madvise(addr, st.st_size, MADV_SEQUENTIAL);
+		madvise(addr, st.st_size, MADV_WILLNEED);
+
+		m_buf = (uint8_t*)addr;
+		m_len = st.st_size;
+	}
+
+	~mmapbuf()
+	{
+		if (m_buf) {
+			munmap(m_buf, m_len);
+		}
+	}
+
+	mmapbuf(const mmapbuf& other) = delete;
+	mmapbuf& operator=(const mmapbuf& rhs) = delete;
+
+	virtual uint64_t length() const override { return m_len; }
+
+	virtual iterator begin() override {
+		return iterator(m_buf);
+	}
+
+	virtual iterator end() override {
+		return iterator(&m_buf[m_len]);
+	}
+
+	virtual uint8_t& operator[](uint64_t idx) override {
+		return m_buf[idx];
+	}
+
+	virtual const uint8_t& operator[](uint64_t idx) const override {
+		return m_buf[idx];
+	}
+
+	virtual std::span<const uint8_t> span() const override {
+		return { m_buf, m_len };
+	}
+
+	/**
+	 * Read every page in now, rather than as the search reaches it.
+	 */
+	void populate() const
+	{
+#ifdef MADV_POPULATE_READ
+		if (madvise(m_buf, m_len, MADV_POPULATE_READ) == 0) {
+			return;
+		}
+#endif
+		// Older kernels: touch a byte of each page
+		const volatile uint8_t* bytes = m_buf;
+		const uint64_t page = sysconf(_SC_PAGESIZE);
+		for (uint64_t i = 0; i < m_len; i += page) {
+			(void)bytes[i];
+		}
+	}
+
+private:
+	uint8_t* m_buf;
+	uint64_t m_len;
+};
+
 /**
  * Buffer backed by a std::string.
  *
@@ -401,7 +597,7 @@ public:
 		m_buf(str)
 	{}
 
-	virtual uint32_t length() const override { return m_buf.length(); }
+	virtual uint64_t length() const override { return m_buf.length(); }
 
 	virtual iterator begin() override {
 		return iterator((uint8_t*)&m_buf.c_str()[0]);
@@ -411,14 +607,18 @@ public:
 		return iterator((uint8_t*)&m_buf.c_str()[m_buf.length()]);
 	}
 
-	virtual uint8_t& operator[](uint32_t idx) override {
+	virtual uint8_t& operator[](uint64_t idx) override {
 		return ((uint8_t*)m_buf.c_str())[idx];
 	}
 
-	virtual const uint8_t& operator[](uint32_t idx) const override {
+	virtual const uint8_t& operator[](uint64_t idx) const override {
 		return ((uint8_t*)m_buf.c_str())[idx];
 	}
 
+	virtual std::span<const uint8_t> span() const override {
+		return { (const uint8_t*)m_buf.data(), m_buf.length() };
+	}
+
 private:
 	std::string m_buf;
 };
@@ -506,94 +706,297 @@ public:
 
 		// We now have a list of bytes in the correct endianness
 		auto ret = std::make_unique<arraybuf>(nullptr, num_list.size());
-		uint32_t idx = 0;
+		uint64_t idx = 0;
 		for (uint8_t i : num_list) {
 			(*ret)[idx++] = i;
 		}
 
 		return ret;
 	}
+
+	/**
+	 * Convert a string of hex bytes, in order, to a buffer.
+	 *
+	 * Whitespace between bytes is ignored, so "7f454c46" and "7f 45 4c 46"
+	 * are the same. Returns nullptr if the string isn't valid hex.
+	 */
+	static std::unique_ptr<buffer> hex_string_to_buffer(const std::string& str)
+	{
+		std::vector<uint8_t> bytes;
+		std::vector<uint8_t> mask;
+
+		if (!hex_string_to_masked(str, bytes, mask)) {
+			return nullptr;
+		}
+		for (uint8_t m : mask) {
+			if (m != 0xff) return nullptr;
+		}
+
+		return std::make_unique<arraybuf>(bytes);
+	}
+
+	/**
+	 * Like hex_string_to_buffer(), but '?' may stand in for any hex digit:
+	 * "7f ?? ?? 02" leaves the middle two bytes unknown, and "4?" only fixes
+	 * the high nibble. @mask gets the bits of each byte that have to match.
+	 *
+	 * Returns false if the string isn't valid.
+	 */
+	static bool hex_string_to_masked(const std::string& str,
+	                                 std::vector<uint8_t>& bytes,
+	                                 std::vector<uint8_t>& mask)
+	{
+		bool high = true;
+		bytes.clear();
+		mask.clear();
+
+		for (char c : str) {
+			if (isspace((unsigned char)c)) {
+				if (!high) return false; // Half a byte
+				continue;
+			}
+			uint8_t val = 0;
+			uint8_t bits = 0;
+			if (c != '?') {
+				val = hex_char_to_num(c);
+				if (val == 0xff) return false;
+				bits = 0xf;
+			}
+			if (high) {
+				bytes.push_back(val << 4);
+				mask.push_back(bits << 4);
+			} else {
+				bytes.back() |= val;
+				mask.back() |= bits;
+			}
+			high = !high;
+		}
+
+		return high && !bytes.empty();
+	}
+};
+
+/**
+ * A single match found by a needle.
+ */
+struct needle_match
+{
+	uint64_t offset;
+	uint64_t length;
+	uint32_t pattern; // Which pattern matched, for needles with more than one
+	uint32_t distance = 0; // Bytes that differ from the pattern, for approx_needle
+
+	bool operator==(const needle_match& rhs) const = default;
 };
 
+/**
+ * Called with each match as it's found. Return false to stop the search.
+ */
+using match_visitor = std::function<bool(const needle_match&)>;
+
 /**
  * A byte or series of bytes to search for.
  */
 class needle
 {
 public:
+	/**
+	 * What length() returns for needles whose matches can be any length.
+	 */
+	static const uint64_t unbounded = UINT64_MAX;
+
 	virtual ~needle() = default;
 
-	virtual uint32_t length() const = 0;
+	/**
+	 * The most bytes a single match can span, or unbounded. Searching a
+	 * buffer a piece at a time only finds every match if the pieces overlap
+	 * by this much, so a piece searched for an unbounded needle has to run
+	 * to the end of the buffer.
+	 */
+	virtual uint64_t length() const = 0;
+
+	/**
+	 * Whether matches never overlap: each search carries on from the end
+	 * of the last match, so where a search starts can change what's found
+	 * after it. Searching a piece at a time then has to pick up from the
+	 * end of the last match reported.
+	 */
+	virtual bool disjoint() const { return false; }
+
+	/**
+	 * Matches only start at multiples of this, counted from the start of
+	 * the buffer searched. Anything that searches a larger buffer a piece at
+	 * a time has to start each piece at a multiple of it.
+	 */
+	virtual uint64_t alignment() const { return 1; }
+
+	virtual uint64_t first_match(const buffer& buf, uint64_t start = 0) const = 0;
+
+	/**
+	 * Call @visit with every match at or after @start, in order of offset
+	 * (then pattern), as they're found.
+	 *
+	 * Stops early if @visit returns false. Returns false if it did.
+	 */
+	virtual bool for_each_match(const buffer& buf, const match_visitor& visit, uint64_t start = 0) const = 0;
+
+	/**
+	 * How many matches there are at or after @start, up to @limit.
+	 */
+	virtual uint64_t count(const buffer& buf, uint64_t limit, uint64_t start = 0) const
+	{
+		uint64_t ret = 0;
+		if (limit > 0) {
+			for_each_match(buf, [&](const needle_match&) { return ++ret < limit; }, start);
+		}
+		return ret;
+	}
+
+	/**
+	 * The offsets of all matches. Where more than one pattern matches at the
+	 * same offset, it's only listed once.
+	 */
+	std::list<uint64_t> match(const buffer& buf, uint64_t start = 0) const
+	{
+		std::list<uint64_t> ret;
+		for_each_match(buf, [&](const needle_match& m) {
+			if (ret.empty() || ret.back() != m.offset) {
+				ret.push_back(m.offset);
+			}
+			return true;
+		}, start);
+		return ret;
+	}
+
+	/**
+	 * Like match(), but says what matched as well as where.
+	 */
+	std::list<needle_match> match_detail(const buffer& buf, uint64_t start = 0) const
+	{
+		std::list<needle_match> ret;
+		for_each_match(buf, [&](const needle_match& m) {
+			ret.push_back(m);
+			return true;
+		}, start);
+		return ret;
+	}
 
-	virtual uint32_t first_match(const buffer& buf, uint32_t start = 0) const = 0;
-	virtual std::list<uint32_t> match(const buffer& buf, uint32_t start = 0) const = 0;
+	/**
+	 * All matches in one contiguous batch.
+	 */
+	std::vector<needle_match> match_vector(const buffer& buf, uint64_t start = 0) const
+	{
+		std::vector<needle_match> ret;
+		for_each_match(buf, [&](const needle_match& m) {
+			ret.push_back(m);
+			return true;
+		}, start);
+		return ret;
+	}
 };
 
 /**
- * A needle backed by a buffer. No wildcard support.
+ * A needle backed by a buffer. For wildcards, see masked_needle.
+ *
+ * The search itself is done by a search_engine, which by default is picked
+ * to suit the needle (see search_engine::select).
  */
 class buffer_needle : public needle
 {
 public:
-	buffer_needle(uint8_t* arr, uint32_t len) :
+	buffer_needle(uint8_t* arr, uint64_t len,
+	              search_engine::kind engine = search_engine::AUTO) :
 		m_buf(arr, len)
-	{}
+	{
+		set_engine(engine);
+	}
 
-	buffer_needle(const std::vector<uint8_t>& vec) :
+	buffer_needle(const std::vector<uint8_t>& vec,
+	              search_engine::kind engine = search_engine::AUTO) :
 		m_buf(vec)
-	{}
+	{
+		set_engine(engine);
+	}
 
 	buffer_needle(std::initializer_list<uint8_t>&& in_list) :
-		m_buf(in_list)
-	{}
+		m_buf(std::move(in_list))
+	{
+		set_engine(search_engine::AUTO);
+	}
+
+	/**
+	 * Create a needle from a copy of the contents of a buffer.
+	 */
+	buffer_needle(const buffer& buf,
+	              search_engine::kind engine = search_engine::AUTO) :
+		m_buf(copy_bytes(buf))
+	{
+		set_engine(engine);
+	}
 
-	virtual uint32_t length() const override { return m_buf.length(); }
+	virtual uint64_t length() const override { return m_buf.length(); }
 
-	virtual uint32_t first_match(const buffer& haystack, uint32_t start = 0) const
+	/**
+	 * Replace the search engine (AUTO picks one based on the needle).
+	 */
+	void set_engine(search_engine::kind engine)
 	{
-		const uint32_t needle_len = length();
-		const uint32_t buf_len = haystack.length();
+		m_engine = search_engine::create(&m_buf[0], m_buf.length(), engine);
+	}
 
-		if (needle_len > buf_len) {
-			return UINT32_MAX;
-		}
+	const search_engine& engine() const { return *m_engine; }
 
-		uint32_t upto = buf_len - needle_len;
-		uint8_t needle_start = m_buf[0];
-		for (uint32_t i = start; i <= upto; ++i) {
-			// Optimization: compare the first bytes to see if we should even
-			// bother calling cmp at all
-			if (needle_start != haystack[i]) continue;
-			if (haystack.cmp(m_buf, i)) {
-				return i;
-			}
+	virtual uint64_t first_match(const buffer& haystack, uint64_t start = 0) const override
+	{
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() != haystack.length()) {
+			return buffer::find_bytewise(haystack, haystack.length(), m_buf, m_buf.length(), start);
+		}
+		if (hay.empty()) {
+			return UINT64_MAX;
 		}
-		return UINT32_MAX;
+
+		return m_engine->find(hay.data(), hay.size(), start);
 	}
 
-	virtual std::list<uint32_t> match(const buffer& haystack, uint32_t start = 0) const
+	virtual bool for_each_match(const buffer& haystack, const match_visitor& visit, uint64_t start = 0) const override
 	{
-		std::list<uint32_t> ret;
-		const uint32_t haystack_len = haystack.length();
-		const uint32_t needle_len = length();
+		const uint64_t haystack_len = haystack.length();
+		const uint64_t needle_len = length();
 
-		if (needle_len > haystack_len) {
-			return ret;
+		if (haystack_len == 0) {
+			return true;
 		}
 
-		uint32_t upto = haystack_len - needle_len;
-		uint8_t needle_start = m_buf[0];
-		for (uint32_t i = start; i <= upto; ++i) {
-			// Optimization: compare the first bytes to see if we should even
-			// bother calling cmp at all
-			if (needle_start != haystack[i]) continue;
-			if (haystack.cmp(m_buf, i)) {
-				ret.push_back(i);
-			}
+		auto report = [&](uint64_t offset) {
+			return visit({ offset, needle_len, 0 });
+		};
+
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack_len) {
+			return buffer::visit_each([&](uint64_t from) {
+				return m_engine->find(hay.data(), haystack_len, from);
+			}, report, start);
 		}
+		return buffer::visit_each([&](uint64_t from) {
+			return buffer::find_bytewise(haystack, haystack_len, m_buf, needle_len, from);
+		}, report, start);
+	}
 
+private:
+	static std::vector<uint8_t> copy_bytes(const buffer& buf)
+	{
+		std::span<const uint8_t> bytes = buf.span();
+		if (bytes.size() == buf.length()) {
+			return std::vector<uint8_t>(bytes.begin(), bytes.end());
+		}
+		std::vector<uint8_t> ret(buf.length());
+		for (uint64_t i = 0; i < ret.size(); ++i) {
+			ret[i] = buf[i];
+		}
 		return ret;
 	}
-private:
+
 	const arraybuf m_buf;
+	std::unique_ptr<search_engine> m_engine;
 };
@@ -1,10 +1,28 @@
+#include "approx_needle.h"
 #include "buffer.h"
+#include "decompress.h"
+#include "index.h"
+#include "masked_needle.h"
+#include "multi_needle.h"
+#include "output.h"
+#include "parallel.h"
+#include "range_needle.h"
+#include "reader.h"
+#include "regex.h"
+#include "replace.h"
+#include "stats.h"
+#include "stream.h"
+#include "walk.h"
 
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <list>
+#include <random>
+#include <regex>
 #include <gtest/gtest.h>
 
 const char* seed_chars = "abcdefghijklmnopqrstuvwxyz";
@@ -21,6 +39,37 @@ void setup()
 	}
 }
 
+/**
+ * A buffer split over two separate allocations, to exercise the search
+ * paths for buffers that aren't contiguous.
+ */
+class splitbuf : public buffer
+{
+public:
+	splitbuf(const std::vector<uint8_t>& vec, uint64_t split) :
+		m_front(vec.begin(), vec.begin() + split),
+		m_back(vec.begin() + split, vec.end())
+	{}
+
+	virtual uint64_t length() const override { return m_front.size() + m_back.size(); }
+
+	// Not iterable
+	virtual iterator begin() override { return iterator(nullptr); }
+	virtual iterator end() override { return iterator(nullptr); }
+
+	virtual uint8_t& operator[](uint64_t idx) override {
+		return idx < m_front.size() ? m_front[idx] : m_back[idx - m_front.size()];
+	}
+
+	virtual const uint8_t& operator[](uint64_t idx) const override {
+		return idx < m_front.size() ? m_front[idx] : m_back[idx - m_front.size()];
+	}
+
+private:
+	std::vector<uint8_t> m_front;
+	std::vector<uint8_t> m_back;
+};
+
 TEST(buffer, arraybuf_test)
 {
 	arraybuf ab(test_buf, tb_size);
@@ -48,6 +97,72 @@ TEST(buffer, strbuf_test)
 	}
 }
 
+TEST(buffer, mmapbuf_test)
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gb_mmapbuf_test";
+	{
+		std::ofstream out(path, std::ios::out | std::ios::binary);
+		out.write((const char*)test_buf, tb_size);
+	}
+
+	{
+		mmapbuf mb(path);
+		ASSERT_EQ(tb_size, mb.length());
+		uint32_t iter = 0;
+		for (uint8_t val : mb) {
+			ASSERT_EQ(iter, val);
+			ASSERT_EQ(iter, mb[iter]);
+			++iter;
+		}
+
+		// Writes are private to the mapping
+		mb[0] = 0xff;
+		ASSERT_EQ((uint8_t)0xff, mb[0]);
+		arraybuf ab(path);
+		ASSERT_EQ((uint8_t)0, ab[0]);
+	}
+
+	std::filesystem::remove(path);
+
+	{
+		mmapbuf mb(path);
+		ASSERT_EQ((uint64_t)0, mb.length());
+	}
+}
+
+TEST(buffer, large_offset_test)
+{
+	// A sparse file just over 4 GiB with a marker past the 32-bit boundary
+	const uint64_t marker_offset = (1ull << 32) + 100;
+	const uint8_t marker[] = { 0xde, 0xad, 0xbe, 0xef };
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gb_large_offset_test";
+	{
+		std::ofstream out(path, std::ios::out | std::ios::binary);
+		out.seekp(marker_offset);
+		out.write((const char*)marker, sizeof(marker));
+		out.seekp(marker_offset + 4096);
+		out.put(0);
+	}
+
+	{
+		mmapbuf mb(path);
+		ASSERT_EQ(marker_offset + 4097, mb.length());
+		ASSERT_EQ((uint8_t)0xde, mb[marker_offset]);
+
+		arraybuf needle({0xde, 0xad, 0xbe, 0xef});
+		ASSERT_EQ(marker_offset, mb.find_first(needle, marker_offset - 4096));
+
+		auto res = mb.find_all(needle, marker_offset - 4096);
+		ASSERT_EQ((uint64_t)1, res.size());
+		ASSERT_EQ(marker_offset, res.front());
+
+		buffer_needle bn({0xde, 0xad, 0xbe, 0xef});
+		ASSERT_EQ(marker_offset, bn.first_match(mb, marker_offset - 4096));
+	}
+
+	std::filesystem::remove(path);
+}
+
 TEST(buffer, cmp_test)
 {
 	uint8_t needle_data[4] = { 5, 6, 7, 8 };
@@ -132,7 +247,7 @@ TEST(buffer, find_test)
 		arraybuf needle({0x73});
 		auto res = ab.find_all(needle);
 		ASSERT_EQ((uint32_t)2, res.size());
-		uint32_t val = res.front();
+		uint64_t val = res.front();
 		ASSERT_EQ((uint32_t)12, val);
 		res.pop_front();
 		val = res.front();
@@ -158,7 +273,7 @@ TEST(buffer, find_test_targeted)
 
 	{
 		arraybuf ab(vec);
-		uint32_t result = ab.find_first(arraybuf{'Z', 'a', 'b'});
+		uint64_t result = ab.find_first(arraybuf{'Z', 'a', 'b'});
 
 		ASSERT_EQ((uint32_t)25, result);
 	}
@@ -177,6 +292,38 @@ TEST(buffer, find_test_targeted)
 	}
 }
 
+TEST(buffer, noncontiguous)
+{
+	std::mt19937 rng(3);
+	std::vector<uint8_t> vec(3000);
+	for (auto& c : vec) {
+		c = 'a' + rng() % 3;
+	}
+	arraybuf ab(vec);
+	splitbuf sb(vec, 1001);
+	ASSERT_TRUE(ab.contiguous());
+	ASSERT_FALSE(sb.contiguous());
+
+	// Needles that straddle the split
+	arraybuf needle(&vec[998], 5);
+	splitbuf split_needle(std::vector<uint8_t>(&vec[998], &vec[1003]), 2);
+	ASSERT_TRUE(sb.cmp(needle, 998));
+	ASSERT_TRUE(ab.cmp(split_needle, 998));
+	ASSERT_FALSE(sb.cmp(needle, 997));
+	ASSERT_TRUE(sb.cmp(ab));
+
+	ASSERT_EQ(ab.find_all(needle), sb.find_all(needle));
+	ASSERT_EQ(ab.find_all(needle), ab.find_all(split_needle));
+	ASSERT_EQ(ab.find_first(needle, 999), sb.find_first(split_needle, 999));
+
+	buffer_needle bn(split_needle);
+	ASSERT_EQ(bn.match(ab), bn.match(sb));
+	ASSERT_EQ(bn.first_match(ab, 500), bn.first_match(sb, 500));
+
+	multi_needle mn({ { 'a', 'b', 'c' }, { 'c', 'c' } });
+	ASSERT_EQ(mn.match_vector(ab), mn.match_vector(sb));
+}
+
 TEST(buffer, num2buf_be_tests)
 {
 	std::unique_ptr<buffer> buf = nullptr;
@@ -275,22 +422,22 @@ TEST(buffer_needle, match_first)
 
 	{
 		buffer_needle bn({0x00, 0x01, 0x02});
-		uint32_t offset = bn.first_match(ab, 0);
-		ASSERT_EQ((uint32_t)UINT32_MAX, offset);
+		uint64_t offset = bn.first_match(ab, 0);
+		ASSERT_EQ(UINT64_MAX, offset);
 	}
 
 	{
 		buffer_needle bn({0x00, 0x01, 0x9f});
-		uint32_t offset = bn.first_match(ab, 0);
+		uint64_t offset = bn.first_match(ab, 0);
 		ASSERT_EQ((uint32_t)37, offset);
 
 		offset = bn.first_match(ab, 38);
-		ASSERT_EQ((uint32_t)UINT32_MAX, offset);
+		ASSERT_EQ(UINT64_MAX, offset);
 	}
 
 	{
 		buffer_needle bn({0x00, 0x00});
-		uint32_t offset = bn.first_match(ab, 0);
+		uint64_t offset = bn.first_match(ab, 0);
 		ASSERT_EQ((uint32_t)6, offset);
 
 		offset = bn.first_match(ab, 6);
@@ -347,6 +494,1347 @@ TEST(buffer_needle, match_all)
 	}
 }
 
+TEST(simd_search, matches_naive)
+{
+	// A small alphabet so that partial matches are common
+	std::mt19937 rng(1234);
+	std::vector<uint8_t> hay(4099);
+	for (auto& c : hay) {
+		c = "aab"[rng() % 3];
+	}
+
+	auto naive = [&](const std::vector<uint8_t>& needle, uint64_t start) -> uint64_t {
+		for (uint64_t i = start; i + needle.size() <= hay.size(); ++i) {
+			if (memcmp(&hay[i], needle.data(), needle.size()) == 0) return i;
+		}
+		return UINT64_MAX;
+	};
+
+	for (int l = simd_search::SCALAR; l <= simd_search::AVX512; ++l) {
+		simd_search::level level = (simd_search::level)l;
+		if (!simd_search::supported(level)) continue;
+
+		for (uint64_t needle_len : { 1, 2, 3, 5, 8, 17, 40, 70 }) {
+			// Take the needle from the end so there's always a match near it
+			std::vector<uint8_t> needle(hay.end() - needle_len, hay.end());
+			for (uint64_t start = 0; start < hay.size(); start += 97) {
+				ASSERT_EQ(naive(needle, start),
+				          simd_search::find(level, hay.data(), hay.size(), needle.data(), needle_len, start))
+					<< simd_search::level_name(level) << " len " << needle_len << " start " << start;
+			}
+			ASSERT_EQ(hay.size() - needle_len,
+			          simd_search::find(level, hay.data(), hay.size(), needle.data(), needle_len, hay.size() - needle_len));
+			ASSERT_EQ(UINT64_MAX,
+			          simd_search::find(level, hay.data(), hay.size(), needle.data(), needle_len, hay.size() - needle_len + 1));
+		}
+	}
+}
+
+TEST(simd_search, short_matches_naive)
+{
+	std::mt19937 rng(2468);
+	std::vector<uint8_t> hay(4099);
+	for (auto& c : hay) {
+		c = "aab"[rng() % 3];
+	}
+
+	auto check = [&]<uint64_t N>(simd_search::level level, uint64_t needle_len) {
+		std::vector<uint8_t> needle(hay.end() - needle_len, hay.end());
+		simd_search::short_pattern<N> pattern(needle.data(), needle_len);
+		for (uint64_t start = 0; start <= hay.size(); start += 31) {
+			ASSERT_EQ(simd_search::find(simd_search::SCALAR, hay.data(), hay.size(), needle.data(), needle_len, start),
+			          simd_search::find_short(level, hay.data(), hay.size(), pattern, start))
+				<< simd_search::level_name(level) << " len " << needle_len << " start " << start;
+		}
+		ASSERT_EQ(hay.size() - needle_len,
+		          simd_search::find_short(level, hay.data(), hay.size(), pattern, hay.size() - needle_len));
+	};
+
+	for (int l = simd_search::SCALAR; l <= simd_search::AVX512; ++l) {
+		simd_search::level level = (simd_search::level)l;
+		if (!simd_search::supported(level)) continue;
+
+		for (uint64_t needle_len = 2; needle_len < 32; ++needle_len) {
+			if (simd_search::short_pattern<2>::fits(needle_len)) check.operator()<2>(level, needle_len);
+			if (simd_search::short_pattern<4>::fits(needle_len)) check.operator()<4>(level, needle_len);
+			if (simd_search::short_pattern<8>::fits(needle_len)) check.operator()<8>(level, needle_len);
+			if (simd_search::short_pattern<16>::fits(needle_len)) check.operator()<16>(level, needle_len);
+		}
+	}
+}
+
+TEST(simd_search, masked_matches_naive)
+{
+	std::mt19937 rng(5678);
+	std::vector<uint8_t> hay(4099);
+	for (auto& c : hay) {
+		c = "aab\x41\x42"[rng() % 5];
+	}
+
+	for (int l = simd_search::SCALAR; l <= simd_search::AVX512; ++l) {
+		simd_search::level level = (simd_search::level)l;
+		if (!simd_search::supported(level)) continue;
+
+		for (uint64_t needle_len : { 1, 2, 3, 5, 8, 17, 40, 70 }) {
+			std::vector<uint8_t> bytes(hay.end() - needle_len, hay.end());
+			std::vector<uint8_t> mask(needle_len);
+			for (auto& m : mask) {
+				m = "\xff\xff\x00\xf0\xdf"[rng() % 5];
+			}
+			for (uint64_t i = 0; i < needle_len; ++i) {
+				bytes[i] &= mask[i];
+			}
+			simd_search::masked_pattern pattern(bytes.data(), mask.data(), needle_len);
+
+			auto naive = [&](uint64_t start) -> uint64_t {
+				for (uint64_t i = start; i + needle_len <= hay.size(); ++i) {
+					uint64_t j = 0;
+					while (j < needle_len && (hay[i + j] & mask[j]) == bytes[j]) ++j;
+					if (j == needle_len) return i;
+				}
+				return UINT64_MAX;
+			};
+
+			for (uint64_t start = 0; start < hay.size(); start += 97) {
+				ASSERT_EQ(naive(start), simd_search::find_masked(level, hay.data(), hay.size(), pattern, start))
+					<< simd_search::level_name(level) << " len " << needle_len << " start " << start;
+			}
+		}
+	}
+}
+
+TEST(masked_needle, wildcards)
+{
+	std::vector<uint8_t> bytes, mask;
+	ASSERT_TRUE(buffer_conversion::hex_string_to_masked("7f ?? ??4? 02", bytes, mask));
+	ASSERT_EQ((std::vector<uint8_t>{ 0x7f, 0x00, 0x00, 0x40, 0x02 }), bytes);
+	ASSERT_EQ((std::vector<uint8_t>{ 0xff, 0x00, 0x00, 0xf0, 0xff }), mask);
+	masked_needle mn(bytes, mask);
+
+	std::vector<uint8_t> bad_bytes, bad_mask;
+	ASSERT_FALSE(buffer_conversion::hex_string_to_masked("7f ?", bad_bytes, bad_mask));
+	ASSERT_EQ(nullptr, buffer_conversion::hex_string_to_buffer("7f ??"));
+
+	arraybuf ab({ 0x7f, 1, 2, 0x4a, 2, 0x7f, 0x7f, 0, 0x3f, 2, 0x7f, 9, 9, 0x4f, 2, 0x7f });
+	ASSERT_EQ((std::list<uint64_t>{ 0, 10 }), mn.match(ab));
+	ASSERT_EQ((uint64_t)10, mn.first_match(ab, 1));
+
+	splitbuf sb(std::vector<uint8_t>(&ab[0], &ab[0] + ab.length()), 12);
+	ASSERT_EQ(mn.match(ab), mn.match(sb));
+}
+
+TEST(simd_search, approx_matches_naive)
+{
+	std::mt19937 rng(1357);
+	std::vector<uint8_t> hay(4099);
+	for (auto& c : hay) {
+		c = "abcd"[rng() % 4];
+	}
+
+	for (int l = simd_search::SCALAR; l <= simd_search::AVX512; ++l) {
+		simd_search::level level = (simd_search::level)l;
+		if (!simd_search::supported(level)) continue;
+
+		for (uint64_t needle_len : { 1, 2, 5, 8, 9, 17, 40, 70, 300 }) {
+			std::vector<uint8_t> needle(hay.end() - needle_len, hay.end());
+			for (uint32_t k : { 0, 1, 2, 4, 9, 300 }) {
+				auto naive = [&](uint64_t start, uint32_t& distance) -> uint64_t {
+					for (uint64_t i = start; i + needle_len <= hay.size(); ++i) {
+						uint32_t d = 0;
+						for (uint64_t j = 0; j < needle_len && d <= k; ++j) d += hay[i + j] != needle[j];
+						if (d <= k) {
+							distance = d;
+							return i;
+						}
+					}
+					return UINT64_MAX;
+				};
+
+				for (uint64_t start = 0; start < hay.size(); start += 97) {
+					uint32_t expected_distance = UINT32_MAX, distance = UINT32_MAX;
+					ASSERT_EQ(naive(start, expected_distance),
+					          simd_search::find_approx(level, hay.data(), hay.size(), needle.data(), needle_len,
+					                                   k, distance, start))
+						<< simd_search::level_name(level) << " len " << needle_len << " k " << k << " start " << start;
+					ASSERT_EQ(expected_distance, distance);
+				}
+			}
+		}
+	}
+}
+
+TEST(approx_needle, reports_distance)
+{
+	std::string text("xxMAGICxxMAGXCxxNAGXCxxMAGIxxxx");
+	std::vector<uint8_t> bytes(text.begin(), text.end());
+	arraybuf ab(bytes);
+	splitbuf sb(bytes, 11);
+
+	approx_needle an({ 'M', 'A', 'G', 'I', 'C' }, 1);
+	std::vector<needle_match> expected = { { 2, 5, 0, 0 }, { 9, 5, 0, 1 }, { 23, 5, 0, 1 } };
+	ASSERT_EQ(expected, an.match_vector(ab));
+	ASSERT_EQ(expected, an.match_vector(sb));
+	ASSERT_EQ(9u, an.first_match(ab, 3));
+
+	approx_needle two({ 'M', 'A', 'G', 'I', 'C' }, 2);
+	expected = { { 2, 5, 0, 0 }, { 9, 5, 0, 1 }, { 16, 5, 0, 2 }, { 23, 5, 0, 1 } };
+	ASSERT_EQ(expected, two.match_vector(ab));
+	ASSERT_EQ(expected, two.match_vector(sb));
+
+	// More than the needle's length is the same as all of it
+	approx_needle all({ 'M', 'A' }, 10);
+	ASSERT_EQ(2u, all.max_distance());
+	ASSERT_EQ(bytes.size() - 1, all.match(ab).size());
+}
+
+template <class T>
+void check_range_matches_naive(const std::vector<uint8_t>& hay, T lo, T hi)
+{
+	for (int l = simd_search::SCALAR; l <= simd_search::AVX512; ++l) {
+		simd_search::level level = (simd_search::level)l;
+		if (!simd_search::supported(level)) continue;
+
+		for (bool big_endian : { false, true }) {
+			for (uint64_t align : { 1, 2, 4, 8, 16, 64 }) {
+				simd_search::value_range<T> range = { lo, hi, big_endian, align };
+				auto naive = [&](uint64_t start) -> uint64_t {
+					for (uint64_t i = start; i + sizeof(T) <= hay.size(); ++i) {
+						if (i % align == 0 && range.contains(range.load(&hay[i]))) {
+							return i;
+						}
+					}
+					return UINT64_MAX;
+				};
+
+				for (uint64_t start = 0; start < hay.size(); start += 37) {
+					ASSERT_EQ(naive(start), simd_search::find_range(level, hay.data(), hay.size(), range, start))
+						<< simd_search::level_name(level) << " size " << sizeof(T) << " align " << align
+						<< " big-endian " << big_endian << " start " << start;
+				}
+			}
+		}
+	}
+}
+
+TEST(simd_search, range_matches_naive)
+{
+	std::mt19937 rng(2468);
+	std::vector<uint8_t> hay(1031);
+	for (auto& c : hay) {
+		// Mostly small bytes, so narrow ranges still match now and then
+		c = rng() % 8 == 0 ? rng() : rng() % 4;
+	}
+
+	check_range_matches_naive<uint8_t>(hay, 2, 3);
+	check_range_matches_naive<int8_t>(hay, -100, 1);
+	check_range_matches_naive<uint16_t>(hay, 0x100, 0x2ff);
+	check_range_matches_naive<int16_t>(hay, -0x7000, 0x10);
+	check_range_matches_naive<uint32_t>(hay, 0x10000, 0x3ffffff);
+	check_range_matches_naive<int32_t>(hay, INT32_MIN, -0x1000000);
+	check_range_matches_naive<uint64_t>(hay, 0x100000000ull, 0xffffffffffull);
+	check_range_matches_naive<int64_t>(hay, -1, 0x10000);
+	check_range_matches_naive<float>(hay, 1e-40f, 1.0f);
+	check_range_matches_naive<double>(hay, -1e300, -1e-300);
+}
+
+TEST(range_needle, parse_and_match)
+{
+	range_needle::value_type type;
+	bool big_endian;
+	ASSERT_TRUE(range_needle::parse_type("u32", type, big_endian));
+	ASSERT_EQ(range_needle::U32, type);
+	ASSERT_FALSE(big_endian);
+	ASSERT_TRUE(range_needle::parse_type("i16be", type, big_endian));
+	ASSERT_EQ(range_needle::I16, type);
+	ASSERT_TRUE(big_endian);
+	ASSERT_TRUE(range_needle::parse_type("f64le", type, big_endian));
+	ASSERT_EQ(range_needle::F64, type);
+	ASSERT_FALSE(big_endian);
+	ASSERT_FALSE(range_needle::parse_type("u24", type, big_endian));
+	ASSERT_FALSE(range_needle::parse_type("be", type, big_endian));
+
+	std::string error;
+	for (const char* bad : { "", "..", "x", "1..y", "256", "-1", "0x10..0x1" }) {
+		ASSERT_FALSE(range_needle::create(range_needle::U8, false, bad, 1, error)) << bad;
+		ASSERT_FALSE(error.empty());
+	}
+	ASSERT_FALSE(range_needle::create(range_needle::U8, false, "1", 3, error));
+	ASSERT_TRUE(range_needle::create(range_needle::I8, false, "-128..-0x10", 1, error));
+	ASSERT_TRUE(range_needle::create(range_needle::U64, false, "0xffffffffffffffff", 1, error));
+	ASSERT_TRUE(range_needle::create(range_needle::F32, false, "..1.5e3", 1, error));
+
+	std::vector<uint8_t> bytes = { 0x00, 0x10, 0x00, 0x00, 0x34, 0x12, 0x00, 0x00,
+	                               0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00,
+	                               0x1f, 0x85, 0xeb, 0x51, 0xb8, 0x1e, 0x09, 0x40 };
+	arraybuf ab(bytes);
+	splitbuf sb(bytes, 5);
+
+	std::unique_ptr<range_needle> rn = range_needle::create(range_needle::U32, false, "0x1000..0x2000", 1, error);
+	std::vector<needle_match> expected = { { 0, 4, 0 }, { 4, 4, 0 }, { 9, 4, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(ab));
+	ASSERT_EQ(expected, rn->match_vector(sb));
+
+	// Only aligned values, and the first match at or after the start is aligned too
+	rn = range_needle::create(range_needle::U32, false, "0x1000..0x2000", 4, error);
+	expected = { { 0, 4, 0 }, { 4, 4, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(ab));
+	ASSERT_EQ(expected, rn->match_vector(sb));
+	ASSERT_EQ(4u, rn->first_match(ab, 1));
+	ASSERT_EQ(4u, rn->alignment());
+
+	rn = range_needle::create(range_needle::U16, true, "0x1000", 1, error);
+	expected = { { 1, 2, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(ab));
+
+	rn = range_needle::create(range_needle::F64, false, "3.14..3.15", 1, error);
+	expected = { { 16, 8, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(ab));
+	ASSERT_EQ(expected, rn->match_vector(sb));
+
+	// A stream fed in pieces that don't line up with the alignment still
+	// only finds aligned values
+	std::vector<uint8_t> hay(1000);
+	std::mt19937 rng(11);
+	for (auto& c : hay) {
+		c = rng() % 3;
+	}
+	arraybuf hay_ab(hay);
+	rn = range_needle::create(range_needle::U16, false, "0x100..0x1ff", 8, error);
+	for (uint64_t feed_len : { 1, 3, 13, 100 }) {
+		std::vector<uint64_t> found;
+		stream_search search(*rn, 3, 3, feed_len);
+		auto cb = [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+			found.push_back(window_offset + m.offset);
+		};
+		for (uint64_t i = 0; i < hay.size(); i += feed_len) {
+			search.feed(&hay[i], std::min<uint64_t>(feed_len, hay.size() - i), cb);
+		}
+		search.finish(cb);
+
+		std::vector<uint64_t> expected_offsets;
+		for (const needle_match& m : rn->match_vector(hay_ab)) {
+			expected_offsets.push_back(m.offset);
+		}
+		ASSERT_FALSE(expected_offsets.empty());
+		ASSERT_EQ(expected_offsets, found) << "feed " << feed_len;
+	}
+}
+
+TEST(regex_needle, matches_naive)
+{
+	// Leftmost-longest matches that don't overlap, checked with std::regex
+	std::mt19937 rng(99);
+	std::string hay(400, ' ');
+	for (auto& c : hay) {
+		c = "abc 0"[rng() % 5];
+	}
+	std::vector<uint8_t> hay_bytes(hay.begin(), hay.end());
+	arraybuf ab(hay_bytes);
+	splitbuf sb(hay_bytes, 150);
+
+	for (const char* pattern : { "ab", "abcd|c", "a+", "a[bc]{1,3}0?", "(ab|ba)+ ", "[^ ]{3}",
+	                             "0.*0", "c(a|b)?c", "(a|b)(c|0)a", "b{2,}", "a?b?c" }) {
+		std::string error;
+		std::unique_ptr<regex_needle> rn = regex_needle::compile(pattern, error);
+		ASSERT_TRUE(rn) << pattern << ": " << error;
+		std::regex re(pattern);
+
+		std::vector<needle_match> expected;
+		for (uint64_t i = 0; i < hay.size();) {
+			uint64_t len = std::min(rn->length(), hay.size() - i);
+			while (len > 0 && !std::regex_match(hay.begin() + i, hay.begin() + i + len, re)) {
+				--len;
+			}
+			if (len > 0) {
+				expected.push_back({ i, len, 0 });
+			}
+			i += std::max<uint64_t>(len, 1);
+		}
+		ASSERT_EQ(expected, rn->match_vector(ab)) << pattern;
+		ASSERT_EQ(expected, rn->match_vector(sb)) << pattern;
+		ASSERT_EQ(expected.size(), rn->count(ab, UINT64_MAX)) << pattern;
+		ASSERT_EQ(expected.size(), rn->count(sb, UINT64_MAX)) << pattern;
+		ASSERT_EQ(std::min<uint64_t>(expected.size(), 1), rn->count(ab, 1)) << pattern;
+		if (!expected.empty()) {
+			ASSERT_EQ(expected.back().offset, rn->first_match(ab, expected.back().offset));
+		}
+	}
+}
+
+TEST(regex_needle, syntax)
+{
+	std::string error;
+	for (const char* bad : { "(ab", "ab)", "*a", "a{2", "a{3,1}", "[z-a]", "[]", "\\q", "\\x4", "a*", "(|b?)" }) {
+		ASSERT_FALSE(regex_needle::compile(bad, error)) << bad;
+		ASSERT_FALSE(error.empty());
+	}
+
+	// Hex bytes, sets and escapes
+	auto rn = regex_needle::compile("\\x7fELF[\\x01\\x02]\\.\\d\\s", error);
+	ASSERT_TRUE(rn) << error;
+	arraybuf ab({ 0x7f, 'E', 'L', 'F', 2, '.', '7', '\t', 0x7f, 'E', 'L', 'F', 3, '.', '7', ' ' });
+	ASSERT_EQ((std::list<uint64_t>{ 0 }), rn->match(ab));
+	ASSERT_EQ((uint64_t)8, rn->length());
+	ASSERT_EQ((std::vector<uint8_t>{ 0x7f, 'E', 'L', 'F' }), rn->required());
+
+	// The literal factor can come from the middle of a pattern
+	rn = regex_needle::compile("[ab]{1,4}magic\\x00?", error);
+	ASSERT_TRUE(rn) << error;
+	ASSERT_EQ((std::vector<uint8_t>{ 'm', 'a', 'g', 'i', 'c' }), rn->required());
+	strbuf text("xx bbmagic abamagic");
+	ASSERT_EQ((std::list<uint64_t>{ 3, 11 }), rn->match(text));
+}
+
+TEST(regex_needle, unbounded_repeats)
+{
+	// Matches longer than any fixed cap, and longer than the ranges and
+	// stream chunks the search is split into
+	std::string error;
+	auto rn = regex_needle::compile("BEGINx+END", error);
+	ASSERT_TRUE(rn) << error;
+	ASSERT_EQ((uint64_t)needle::unbounded, rn->length());
+
+	std::string text = "..BEGIN" + std::string(300, 'x') + "END..BEGINEND";
+	strbuf short_text(text);
+	std::vector<needle_match> expected = { { 2, 308, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(short_text));
+
+	rn = regex_needle::compile("a{2,}", error);
+	ASSERT_TRUE(rn) << error;
+	strbuf run(std::string(1000, 'a'));
+	ASSERT_EQ(1000u, rn->match_vector(run).front().length);
+
+	const uint64_t len = parallel_search::min_range_len * 3;
+	std::vector<uint8_t> hay(len, 0);
+	const uint64_t begin = parallel_search::min_range_len / 2;
+	const uint64_t run_len = parallel_search::min_range_len * 2;
+	memcpy(&hay[begin], "BEGIN", 5);
+	memset(&hay[begin + 5], 'x', run_len);
+	memcpy(&hay[begin + 5 + run_len], "END", 3);
+	arraybuf ab(hay);
+	rn = regex_needle::compile("BEGINx+END", error);
+	expected = { { begin, run_len + 8, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(ab));
+
+	thread_pool pool(3);
+	parallel_search ps(pool);
+	ASSERT_EQ(expected, ps.match_vector(*rn, ab));
+	ASSERT_EQ(1u, ps.count(*rn, ab));
+
+	// A run of a as long as the haystack is read once, not once per offset
+	std::vector<uint8_t> as(len, 'a');
+	arraybuf as_ab(as);
+	rn = regex_needle::compile("a+", error);
+	ASSERT_TRUE(rn) << error;
+	expected = { { 0, len, 0 } };
+	ASSERT_EQ(expected, rn->match_vector(as_ab));
+	ASSERT_EQ(expected, ps.match_vector(*rn, as_ab));
+	ASSERT_EQ(1u, rn->count(as_ab, UINT64_MAX));
+}
+
+TEST(regex_needle, split_searches)
+{
+	// Matches that run from one range or chunk into the next have to be
+	// picked up from where they end, or the next one's own matches overlap
+	// them
+	std::mt19937 rng(5);
+	std::vector<uint8_t> hay(parallel_search::min_range_len * 3);
+	for (auto& c : hay) {
+		c = "ab"[rng() % 2];
+	}
+	arraybuf ab(hay);
+	thread_pool pool(3);
+	parallel_search ps(pool);
+
+	std::string error;
+	for (const char* pattern : { "ab+a", "ab{1,5}a", "a[ab]{0,40}b", "b+a{2,}" }) {
+		auto rn = regex_needle::compile(pattern, error);
+		ASSERT_TRUE(rn) << error;
+		std::vector<needle_match> expected = rn->match_vector(ab);
+		ASSERT_FALSE(expected.empty());
+		ASSERT_EQ(expected, ps.match_vector(*rn, ab)) << pattern;
+		ASSERT_EQ(expected.size(), ps.count(*rn, ab)) << pattern;
+		if (rn->length() == needle::unbounded) {
+			continue;
+		}
+
+		for (uint64_t feed_len : { 7, 4096 }) {
+			std::vector<needle_match> found;
+			stream_search search(*rn, 0, 0, feed_len);
+			auto cb = [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+				found.push_back({ window_offset + m.offset, m.length, m.pattern });
+			};
+			for (uint64_t i = 0; i < hay.size(); i += feed_len) {
+				search.feed(&hay[i], std::min<uint64_t>(feed_len, hay.size() - i), cb);
+			}
+			search.finish(cb);
+			ASSERT_EQ(expected, found) << pattern << " feed " << feed_len;
+		}
+	}
+}
+
+TEST(search_engine, matches_naive)
+{
+	std::mt19937 rng(4321);
+	for (const char* alphabet : { "ab", "abc", "abcdefghijklmnop" }) {
+		const uint64_t alpha_len = strlen(alphabet);
+		std::vector<uint8_t> hay(3000);
+		for (auto& c : hay) {
+			c = alphabet[rng() % alpha_len];
+		}
+
+		auto naive = [&](const std::vector<uint8_t>& needle, uint64_t start) -> uint64_t {
+			for (uint64_t i = start; i + needle.size() <= hay.size(); ++i) {
+				if (memcmp(&hay[i], needle.data(), needle.size()) == 0) return i;
+			}
+			return UINT64_MAX;
+		};
+
+		for (uint64_t needle_len : { 1, 2, 3, 4, 7, 8, 12, 16, 31, 33, 64 }) {
+			std::vector<std::vector<uint8_t>> needles;
+			// One that's known to be present, one random, and one periodic
+			needles.emplace_back(hay.begin() + 1500, hay.begin() + 1500 + needle_len);
+			needles.emplace_back(needle_len);
+			for (auto& c : needles.back()) {
+				c = alphabet[rng() % alpha_len];
+			}
+			needles.emplace_back(needle_len);
+			for (uint64_t i = 0; i < needle_len; ++i) {
+				needles.back()[i] = alphabet[i % 2];
+			}
+
+			for (const auto& needle : needles) {
+				for (auto kind : { search_engine::SIMD, search_engine::HORSPOOL,
+				                   search_engine::TWO_WAY, search_engine::MEMMEM, search_engine::SHORT }) {
+					auto engine = search_engine::create(needle.data(), needle.size(), kind);
+					const bool is_short = needle_len >= 2 && needle_len < 32;
+					ASSERT_EQ(kind == search_engine::SHORT && !is_short ? search_engine::SIMD : kind,
+					          engine->type());
+					uint64_t expected = naive(needle, 0);
+					uint64_t found = engine->find(hay.data(), hay.size(), 0);
+					while (expected != UINT64_MAX) {
+						ASSERT_EQ(expected, found) << engine->name() << " alphabet " << alphabet
+						                           << " len " << needle_len;
+						expected = naive(needle, expected + 1);
+						found = engine->find(hay.data(), hay.size(), found + 1);
+					}
+					ASSERT_EQ(UINT64_MAX, found) << engine->name();
+				}
+			}
+		}
+	}
+}
+
+TEST(search_engine, select)
+{
+	const uint8_t one[] = { 0x7f };
+	const uint8_t zeroes[40] = {};
+	const uint8_t magic[] = { 0x7f, 'E', 'L', 'F' };
+	const char* sig = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJ";
+
+	ASSERT_EQ(search_engine::MEMMEM, search_engine::select(one, sizeof(one)));
+	ASSERT_EQ(search_engine::TWO_WAY, search_engine::select(zeroes, sizeof(zeroes)));
+	ASSERT_EQ(search_engine::SHORT, search_engine::select(magic, sizeof(magic)));
+	ASSERT_EQ(search_engine::SHORT, search_engine::select(zeroes, 16));
+	ASSERT_EQ(search_engine::HORSPOOL, search_engine::select((const uint8_t*)sig, strlen(sig)));
+
+	// Horspool crawls through zero-filled regions when zeros end the needle
+	std::vector<uint8_t> record(sig, sig + 40);
+	record.resize(64, 0);
+	ASSERT_EQ(search_engine::SIMD, search_engine::select(record.data(), record.size()));
+	record.push_back('!');
+	ASSERT_EQ(search_engine::SIMD, search_engine::select(record.data(), record.size()));
+	// Spaces are common in text too
+	const char* sentence = "The quick brown fox jumps over the lazy dog";
+	ASSERT_EQ(search_engine::SIMD, search_engine::select((const uint8_t*)sentence, strlen(sentence)));
+
+	// Long needles with little variety are left to Two-Way's linear worst case
+	std::string periodic = std::string(60, 'a') + "bXa";
+	ASSERT_EQ(search_engine::TWO_WAY, search_engine::select((const uint8_t*)periodic.data(), periodic.size()));
+
+	search_engine::kind kind;
+	ASSERT_TRUE(search_engine::parse_kind("twoway", kind));
+	ASSERT_EQ(search_engine::TWO_WAY, kind);
+	ASSERT_FALSE(search_engine::parse_kind("grep", kind));
+
+	buffer_needle bn(std::vector<uint8_t>(magic, magic + sizeof(magic)), search_engine::HORSPOOL);
+	ASSERT_EQ(search_engine::HORSPOOL, bn.engine().type());
+}
+
+TEST(search_stats, counts_candidates)
+{
+	// Each "a..b" passes the first/last byte filter, but only one matches
+	strbuf hay("axxb ayyb azzb axyb");
+	buffer_needle bn({ 'a', 'x', 'y', 'b' }, search_engine::SIMD);
+	ASSERT_EQ((std::list<uint64_t>{ 15 }), bn.match(hay));
+
+	search_stats::enable();
+	search_stats* stats = search_stats::active();
+	ASSERT_NE(nullptr, stats);
+	const uint64_t candidates = stats->candidates;
+	const uint64_t verified = stats->verified;
+	{
+		search_stats::timer timer(&search_stats::search_ns);
+		ASSERT_EQ((std::list<uint64_t>{ 15 }), bn.match(hay));
+	}
+	ASSERT_EQ(candidates + 4, stats->candidates);
+	ASSERT_EQ(verified + 1, stats->verified);
+	ASSERT_GT(stats->search_ns, 0u);
+}
+
+TEST(stream_search, chunk_boundaries)
+{
+	uint8_t corpus[] = { 0x6f, 0x00, 0x1e, 0xef, 0x2b, 0x94, 0x00, 0x00,
+	                     0x00, 0x04, 0x6c, 0x69, 0x73, 0x74, 0x00, 0x00,
+						 0x07, 0x2b, 0x95, 0x00, 0x00, 0x00, 0x00, 0x49,
+						 0x6c, 0x6c, 0x69, 0x73, 0x61, 0x20, 0x4b, 0x65,
+						 0x70, 0x70, 0x65, 0x49, 0x61, 0x00, 0x01, 0x9f };
+	arraybuf ab(corpus, sizeof(corpus));
+
+	for (uint64_t feed_len : { 1, 2, 3, 7, 64 }) {
+		arraybuf needle({0x00, 0x00});
+		buffer_needle bn(needle);
+		std::list<uint64_t> found;
+		stream_search search(bn, 2, 3, feed_len);
+		auto cb = [&](const buffer& window, uint64_t window_offset, const needle_match& m) {
+			// The match and its context must be in the window
+			uint64_t offset = m.offset;
+			ASSERT_TRUE(window.cmp(needle, offset));
+			uint64_t abs = window_offset + offset;
+			ASSERT_TRUE(offset >= 2 || window_offset == 0);
+			ASSERT_TRUE(offset + 2 + 3 <= window.length() || abs + 2 + 3 > sizeof(corpus));
+			found.push_back(abs);
+		};
+		for (uint64_t i = 0; i < sizeof(corpus); i += feed_len) {
+			search.feed(&corpus[i], std::min<uint64_t>(feed_len, sizeof(corpus) - i), cb);
+		}
+		search.finish(cb);
+
+		ASSERT_EQ(ab.find_all(needle), found);
+		ASSERT_EQ(sizeof(corpus), search.bytes_seen());
+	}
+
+	{
+		// Match at the very end of the stream
+		buffer_needle needle({0x00, 0x01, 0x9f});
+		std::list<uint64_t> found;
+		stream_search search(needle, 4, 4, 5);
+		auto cb = [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+			found.push_back(window_offset + m.offset);
+		};
+		for (uint64_t i = 0; i < sizeof(corpus); i += 5) {
+			search.feed(&corpus[i], 5, cb);
+		}
+		ASSERT_TRUE(found.empty());
+		search.finish(cb);
+		ASSERT_EQ((uint64_t)1, found.size());
+		ASSERT_EQ((uint64_t)37, found.front());
+	}
+
+	{
+		// Stopping from the callback
+		buffer_needle needle({0x00});
+		std::list<uint64_t> found;
+		stream_search search(needle, 0, 0, 4);
+		auto cb = [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+			found.push_back(window_offset + m.offset);
+			if (found.size() == 2) {
+				search.stop();
+			}
+		};
+		for (uint64_t i = 0; i < sizeof(corpus); i += 4) {
+			search.feed(&corpus[i], 4, cb);
+		}
+		search.finish(cb);
+		ASSERT_EQ((std::list<uint64_t>{ 1, 6 }), found);
+	}
+}
+
+TEST(stream_search, multi_pattern_tail)
+{
+	// A short pattern right at the end of a stream shorter than the longest
+	std::string data("xxab");
+	multi_needle mn({ { 'a', 'b' }, { 'q', 'q', 'q', 'q', 'q', 'q' } });
+	std::list<uint64_t> found;
+	stream_search search(mn, 1, 1, 2);
+	auto cb = [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+		found.push_back(window_offset + m.offset);
+	};
+	search.feed((const uint8_t*)data.data(), data.size(), cb);
+	search.finish(cb);
+	ASSERT_EQ(std::list<uint64_t>{ 2 }, found);
+}
+
+TEST(chunk_reader, matches_file)
+{
+	// Not a whole number of chunks, with a match across every chunk boundary
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gb_chunk_reader_test";
+	std::vector<uint8_t> data(5 * 4096 + 100, 'x');
+	std::list<uint64_t> expected;
+	for (uint64_t i = 4096; i < data.size(); i += 4096) {
+		memcpy(&data[i - 2], "MAGIC", 5);
+		expected.push_back(i - 2);
+	}
+	{
+		std::ofstream out(path, std::ios::binary);
+		out.write((const char*)data.data(), data.size());
+	}
+
+	buffer_needle bn({ 'M', 'A', 'G', 'I', 'C' });
+	for (bool use_uring : { true, false }) {
+		int fd = open(path.c_str(), O_RDONLY);
+		ASSERT_GE(fd, 0);
+
+		std::vector<uint8_t> contents;
+		chunk_reader reader(fd, use_uring, 4096, 3);
+		ASSERT_EQ(data.size(), reader.run([&](const uint8_t* chunk, uint64_t len) {
+			EXPECT_LE(len, 4096u);
+			contents.insert(contents.end(), chunk, chunk + len);
+			return true;
+		}));
+		ASSERT_EQ(data, contents) << (reader.using_uring() ? "uring" : "pread");
+
+		std::list<uint64_t> found;
+		stream_search search(bn, 4, 4);
+		chunk_reader again(fd, use_uring, 4096, 3);
+		ASSERT_EQ(data.size(), search.run(again, [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+			found.push_back(window_offset + m.offset);
+		}));
+		ASSERT_EQ(expected, found);
+
+		// Stopping early leaves nothing in flight
+		uint64_t chunks = 0;
+		chunk_reader stopped(fd, use_uring, 4096, 3);
+		stopped.run([&](const uint8_t*, uint64_t) { return ++chunks < 2; });
+		ASSERT_EQ(2u, chunks);
+		close(fd);
+	}
+	std::filesystem::remove(path);
+}
+
+/**
+ * Compress @data in @format, the way gzip -c or xz -c would.
+ */
+std::vector<uint8_t> compress(const std::vector<uint8_t>& data, compression format)
+{
+	std::vector<uint8_t> out(data.size() + data.size() / 2 + 1024);
+#ifdef GB_ZSTD
+	if (format == COMPRESSION_ZSTD) {
+		size_t len = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), 1);
+		out.resize(ZSTD_isError(len) ? 0 : len);
+		return out;
+	}
+#endif
+	if (format == COMPRESSION_XZ) {
+		size_t len = 0;
+		lzma_ret ret = lzma_easy_buffer_encode(1, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(),
+		                                       out.data(), &len, out.size());
+		out.resize(ret == LZMA_OK ? len : 0);
+		return out;
+	}
+
+	z_stream z = {};
+	deflateInit2(&z, 1, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	z.next_in = (Bytef*)data.data();
+	z.avail_in = data.size();
+	z.next_out = out.data();
+	z.avail_out = out.size();
+	int ret = deflate(&z, Z_FINISH);
+	out.resize(ret == Z_STREAM_END ? z.total_out : 0);
+	deflateEnd(&z);
+	return out;
+}
+
+TEST(decompressing_reader, matches_decompressed)
+{
+	// Several output chunks' worth, with a match across every chunk boundary
+	std::vector<uint8_t> data(5 * 4096 + 100);
+	std::mt19937 rng(7);
+	for (uint8_t& b : data) {
+		b = 'a' + rng() % 4;
+	}
+	std::list<uint64_t> expected;
+	for (uint64_t i = 4096; i < data.size(); i += 4096) {
+		memcpy(&data[i - 2], "MAGIC", 5);
+		expected.push_back(i - 2);
+	}
+
+	const uint64_t match_count = expected.size();
+
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gb_decompress_test";
+	buffer_needle bn({ 'M', 'A', 'G', 'I', 'C' });
+	std::vector<compression> formats = { COMPRESSION_GZIP, COMPRESSION_XZ };
+#ifdef GB_ZSTD
+	formats.push_back(COMPRESSION_ZSTD);
+#endif
+	for (compression format : formats) {
+		std::vector<uint8_t> packed = compress(data, format);
+		ASSERT_FALSE(packed.empty());
+		ASSERT_EQ(format, decoder::detect(packed.data(), packed.size()));
+		if (format != COMPRESSION_XZ) {
+			// Concatenated gzip files and zstd frames decompress to the two
+			// joined together
+			packed.insert(packed.end(), packed.begin(), packed.end());
+			for (uint64_t i = 4096; i < data.size(); i += 4096) {
+				expected.push_back(data.size() + i - 2);
+			}
+		}
+		{
+			std::ofstream out(path, std::ios::binary);
+			out.write((const char*)packed.data(), packed.size());
+		}
+		const uint64_t unpacked_len = format != COMPRESSION_XZ ? 2 * data.size() : data.size();
+
+		// The header can come from the file or, as for a pipe, be read first
+		for (uint64_t header_len : { 0, 6 }) {
+			int fd = open(path.c_str(), O_RDONLY);
+			ASSERT_GE(fd, 0);
+			std::vector<uint8_t> header(header_len);
+			ASSERT_EQ((ssize_t)header_len, read(fd, header.data(), header_len));
+
+			std::vector<uint8_t> contents;
+			decompressing_reader reader(fd, format, header, 4096, 2);
+			ASSERT_EQ(unpacked_len, reader.run([&](const uint8_t* chunk, uint64_t len) {
+				EXPECT_LE(len, 4096u);
+				contents.insert(contents.end(), chunk, chunk + len);
+				return true;
+			}));
+			ASSERT_EQ(packed.size(), reader.compressed_bytes());
+			ASSERT_TRUE(std::equal(data.begin(), data.end(), contents.begin()));
+			close(fd);
+		}
+
+		int fd = open(path.c_str(), O_RDONLY);
+		std::list<uint64_t> found;
+		stream_search search(bn, 4, 4);
+		decompressing_reader reader(fd, format, {}, 4096, 2);
+		ASSERT_EQ(unpacked_len, search.run(reader, [&](const buffer&, uint64_t window_offset, const needle_match& m) {
+			found.push_back(window_offset + m.offset);
+		}));
+		ASSERT_EQ(expected, found);
+		expected.resize(match_count);
+
+		// Stopping early doesn't wait for the rest
+		uint64_t chunks = 0;
+		lseek(fd, 0, SEEK_SET);
+		decompressing_reader stopped(fd, format, {}, 4096, 2);
+		stopped.run([&](const uint8_t*, uint64_t) { return ++chunks < 2; });
+		ASSERT_EQ(2u, chunks);
+		close(fd);
+
+		// A truncated file is an error, not a short read
+		{
+			std::ofstream out(path, std::ios::binary);
+			out.write((const char*)packed.data(), packed.size() * 3 / 4);
+		}
+		fd = open(path.c_str(), O_RDONLY);
+		decompressing_reader truncated(fd, format, {}, 4096, 2);
+		ASSERT_EQ(UINT64_MAX, truncated.run([](const uint8_t*, uint64_t) { return true; }));
+		close(fd);
+	}
+	std::filesystem::remove(path);
+
+	const uint8_t plain[] = { 'a', 'b', 'c', 'd', 'e', 'f' };
+	ASSERT_EQ(COMPRESSION_NONE, decoder::detect(plain, sizeof(plain)));
+	ASSERT_EQ(COMPRESSION_NONE, decoder::detect(plain, 0));
+}
+
+TEST(multi_needle, match)
+{
+	std::string corpus("she sells sea shells; he said hers");
+	strbuf sb(corpus);
+
+	multi_needle mn({ { 'h', 'e' }, { 's', 'h', 'e' }, { 'h', 'i', 's' }, { 'h', 'e', 'r', 's' },
+	                  { 's', 'e', 'a', ' ' } });
+	ASSERT_EQ((uint64_t)4, mn.length());
+	ASSERT_EQ((uint32_t)5, mn.pattern_count());
+
+	auto detail = mn.match_detail(sb);
+	std::list<needle_match> expected = {
+		{ 0, 3, 1 },  // she
+		{ 1, 2, 0 },  // he
+		{ 10, 4, 4 }, // sea_
+		{ 14, 3, 1 }, // she(lls)
+		{ 15, 2, 0 }, // he(lls)
+		{ 22, 2, 0 }, // he
+		{ 30, 2, 0 }, // he(rs)
+		{ 30, 4, 3 }, // hers
+	};
+	ASSERT_EQ(expected, detail);
+
+	std::list<uint64_t> offsets = { 0, 1, 10, 14, 15, 22, 30 };
+	ASSERT_EQ(offsets, mn.match(sb));
+	ASSERT_EQ((uint64_t)14, mn.first_match(sb, 11));
+	ASSERT_EQ((uint64_t)30, mn.first_match(sb, 23));
+	ASSERT_EQ(UINT64_MAX, mn.first_match(sb, 31));
+
+	// A longer pattern that starts first but ends last
+	multi_needle overlap({ { 'b', 'c' }, { 'a', 'b', 'c', 'd' } });
+	strbuf abcd("abcd");
+	ASSERT_EQ((uint64_t)0, overlap.first_match(abcd));
+}
+
+TEST(multi_needle, matches_naive)
+{
+	std::mt19937 rng(99);
+	std::vector<uint8_t> hay(5000);
+	for (auto& c : hay) {
+		c = rng() % 4;
+	}
+
+	std::vector<std::vector<uint8_t>> patterns;
+	for (int i = 0; i < 50; ++i) {
+		patterns.emplace_back(1 + rng() % 7);
+		for (auto& c : patterns.back()) {
+			c = rng() % 4;
+		}
+	}
+	multi_needle mn(patterns);
+	arraybuf ab(hay);
+
+	std::list<needle_match> expected;
+	for (uint64_t i = 0; i < hay.size(); ++i) {
+		for (uint32_t p = 0; p < patterns.size(); ++p) {
+			if (i + patterns[p].size() <= hay.size()
+			    && memcmp(&hay[i], patterns[p].data(), patterns[p].size()) == 0) {
+				expected.push_back({ i, patterns[p].size(), p });
+			}
+		}
+	}
+	ASSERT_EQ(expected, mn.match_detail(ab));
+}
+
+TEST(needle, visitor)
+{
+	strbuf sb("abcabcabcabc");
+
+	// Visiting in order, and stopping when asked
+	buffer_needle bn({'b', 'c'});
+	std::vector<uint64_t> seen;
+	ASSERT_FALSE(bn.for_each_match(sb, [&](const needle_match& m) {
+		EXPECT_EQ((uint64_t)2, m.length);
+		seen.push_back(m.offset);
+		return m.offset < 7;
+	}, 2));
+	ASSERT_EQ((std::vector<uint64_t>{ 4, 7 }), seen);
+	ASSERT_TRUE(bn.for_each_match(sb, [](const needle_match&) { return true; }));
+
+	multi_needle mn({ { 'c', 'a' }, { 'a', 'b', 'c' } });
+	std::vector<needle_match> batch = mn.match_vector(sb);
+	std::vector<needle_match> expected = {
+		{ 0, 3, 1 }, { 2, 2, 0 }, { 3, 3, 1 }, { 5, 2, 0 }, { 6, 3, 1 }, { 8, 2, 0 }, { 9, 3, 1 },
+	};
+	ASSERT_EQ(expected, batch);
+
+	std::vector<needle_match> some;
+	ASSERT_FALSE(mn.for_each_match(sb, [&](const needle_match& m) {
+		some.push_back(m);
+		return some.size() < 3;
+	}));
+	ASSERT_EQ(std::vector<needle_match>(expected.begin(), expected.begin() + 3), some);
+
+	seen.clear();
+	ASSERT_FALSE(sb.find_all(strbuf("abc"), [&](uint64_t offset) {
+		seen.push_back(offset);
+		return seen.size() < 2;
+	}));
+	ASSERT_EQ((std::vector<uint64_t>{ 0, 3 }), seen);
+}
+
+TEST(thread_pool, nested_tasks)
+{
+	// More outer tasks than threads, each waiting on inner tasks, mustn't
+	// deadlock; the waiting threads run the inner tasks themselves.
+	thread_pool pool(2);
+	std::vector<std::future<uint64_t>> outer;
+	for (uint64_t i = 0; i < 8; ++i) {
+		outer.push_back(pool.submit([&pool, i] {
+			std::vector<std::future<uint64_t>> inner;
+			for (uint64_t j = 0; j < 8; ++j) {
+				inner.push_back(pool.submit([i, j] { return i * j; }));
+			}
+			uint64_t sum = 0;
+			for (auto& f : inner) {
+				sum += pool.wait(f);
+			}
+			return sum;
+		}));
+	}
+
+	for (uint64_t i = 0; i < 8; ++i) {
+		ASSERT_EQ(i * 28, pool.wait(outer[i]));
+	}
+}
+
+TEST(parallel_search, matches_serial)
+{
+	// Big enough to be split, with matches on and around the range boundaries
+	const uint64_t len = parallel_search::min_range_len * 5 + 123;
+	std::vector<uint8_t> hay(len, 0);
+	std::mt19937 rng(7);
+	for (int i = 0; i < 2000; ++i) {
+		hay[rng() % len] = 'x';
+	}
+	// With 3 threads this is split into 5 ranges
+	const uint64_t range_len = (len + 4) / 5;
+	for (uint64_t boundary = range_len; boundary < len; boundary += range_len) {
+		for (uint64_t i = boundary - std::min<uint64_t>(boundary, 3); i < std::min(len, boundary + 3); ++i) {
+			hay[i] = 'x';
+		}
+	}
+	arraybuf ab(hay);
+	thread_pool pool(3);
+	parallel_search ps(pool);
+
+	buffer_needle bn({'x', 'x'});
+	ASSERT_EQ(bn.match_vector(ab), ps.match_vector(bn, ab));
+
+	multi_needle mn({ { 'x' }, { 'x', 0, 'x' }, { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 'x' } });
+	ASSERT_EQ(mn.match_vector(ab), ps.match_vector(mn, ab));
+
+	// Distances make it through too
+	approx_needle an({ 'x', 0, 'x' }, 1);
+	ASSERT_EQ(an.match_vector(ab), ps.match_vector(an, ab));
+
+	// Aligned values stay aligned when the ranges are split
+	std::string error;
+	std::unique_ptr<range_needle> rn = range_needle::create(range_needle::U16, false, "0x78..0x7800", 8, error);
+	ASSERT_EQ(rn->match_vector(ab), ps.match_vector(*rn, ab));
+	ASSERT_FALSE(rn->match_vector(ab).empty());
+
+	// More matches than a range gathers ahead of time, with two patterns
+	// matching at each offset
+	std::vector<uint8_t> dense(len, 0);
+	for (uint64_t i = 0; i < len; i += 8) {
+		dense[i] = 'y';
+	}
+	arraybuf dense_ab(dense);
+	multi_needle pair({ { 'y' }, { 'y', 0 } });
+	std::vector<needle_match> dense_matches = pair.match_vector(dense_ab);
+	ASSERT_GT(dense_matches.size() / 5, (uint64_t)parallel_search::max_held_matches);
+	ASSERT_EQ(dense_matches, ps.match_vector(pair, dense_ab));
+
+	// Too small to split
+	arraybuf small({'x', 'x', 'x'});
+	ASSERT_EQ(bn.match_vector(small), ps.match_vector(bn, small));
+
+	// Stopping part way through gives a prefix of the full results
+	std::vector<needle_match> all = ps.match_vector(mn, ab);
+	std::vector<needle_match> some;
+	ASSERT_FALSE(ps.for_each_match(mn, ab, [&](const needle_match& m) {
+		some.push_back(m);
+		return some.size() < all.size() / 2;
+	}));
+	ASSERT_EQ(std::vector<needle_match>(all.begin(), all.begin() + all.size() / 2), some);
+
+	// Counting and finding the first match, without gathering offsets
+	const uint64_t total = bn.match_vector(ab).size();
+	ASSERT_EQ(total, ps.count(bn, ab));
+	ASSERT_EQ((uint64_t)10, ps.count(bn, ab, 10));
+	ASSERT_EQ(total, ps.count(bn, ab, total + 1));
+	ASSERT_EQ((uint64_t)0, ps.count(bn, ab, 0));
+	ASSERT_EQ(bn.first_match(ab), ps.first_match(bn, ab));
+	ASSERT_EQ(bn.first_match(small), ps.first_match(bn, small));
+
+	// A single match in the last range
+	std::vector<uint8_t> sparse(len, 0);
+	sparse[len - 2] = sparse[len - 1] = 'x';
+	arraybuf sparse_ab(sparse);
+	ASSERT_EQ(len - 2, ps.first_match(bn, sparse_ab));
+	ASSERT_EQ((uint64_t)1, ps.count(bn, sparse_ab));
+	buffer_needle absent({'y'});
+	ASSERT_EQ(UINT64_MAX, ps.first_match(absent, sparse_ab));
+}
+
+TEST(output, match_printer)
+{
+	strbuf sb(std::string("ab\x01" "cd\xff" "ef", 8));
+	output_writer out;
+	match_printer printer(2, 1);
+
+	printer.print(out, sb, 3, 2);
+	printer.print(out, sb, 0, 1, 0x100000000, "lbl");
+	ASSERT_EQ("       1:  62 01 \x1B[31m63 64 \033[0mff    | b.\x1B[31mcd\033[0m. |\n"
+	          "100000000:  \x1B[31m61 \033[0m62 01 63    | \x1B[31ma\033[0mb.c |  lbl\n",
+	          out.contents());
+}
+
+TEST(output, ordered_output)
+{
+	output_writer out;
+	ordered_output ordered(out, 10);
+	std::unique_ptr<output_writer> w0 = ordered.writer(0, "zero:");
+	std::unique_ptr<output_writer> w1 = ordered.writer(1, "one:", false);
+	std::unique_ptr<output_writer> w2 = ordered.writer(2);
+	std::unique_ptr<output_writer> w3 = ordered.writer(3, "three:");
+
+	// Held until their turns, unless they get too far ahead
+	w1->write("0123456789abcdef");
+	w1->flush();
+	w2->write("0123456789abcdef");
+	w2->flush();
+	ASSERT_FALSE(w1->failed());
+	ASSERT_TRUE(w2->failed());
+	ASSERT_EQ("", out.contents());
+
+	// The current one goes straight through
+	ordered.start(0);
+	w0->write("a");
+	w0->flush();
+	ASSERT_EQ("zero:a", out.contents());
+	w0.reset();
+	ASSERT_TRUE(ordered.end(0));
+
+	ordered.start(1);
+	ASSERT_EQ("zero:aone:0123456789abcdef", out.contents());
+	w1.reset();
+	ASSERT_TRUE(ordered.end(1));
+
+	// Dropped output has to be redone
+	ordered.start(2);
+	w2.reset();
+	ASSERT_FALSE(ordered.end(2));
+	ordered.start(2);
+	ordered.writer(2)->write("0123456789abcdef");
+	ASSERT_TRUE(ordered.end(2));
+
+	// No output, no header
+	ordered.start(3);
+	w3.reset();
+	ASSERT_TRUE(ordered.end(3));
+	ASSERT_EQ("zero:aone:0123456789abcdef0123456789abcdef", out.contents());
+}
+
+TEST(replacer, patch_and_rewrite)
+{
+	std::filesystem::path path = std::filesystem::temp_directory_path() / "gb_replacer_test";
+	auto write_file = [&](const std::string& contents) {
+		std::ofstream out(path, std::ios::out | std::ios::binary);
+		out << contents;
+	};
+	auto read_file = [&]() {
+		std::ifstream in(path, std::ios::in | std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	};
+	auto bytes = [](const std::string& str) {
+		return std::vector<uint8_t>(str.begin(), str.end());
+	};
+
+	buffer_needle aa({'a', 'a'});
+
+	// Same length: patched in place, without overlapping matches
+	write_file("aaaaa baa");
+	replacer same(aa, bytes("XY"), true);
+	ASSERT_TRUE(same.in_place());
+	ASSERT_EQ((uint64_t)3, same.run(path));
+	ASSERT_EQ("XYXYa bXY", read_file());
+
+	// Different length: rewritten, up to the limit
+	write_file("aaaaa baa");
+	replacer longer(aa, bytes("<aa>"), true, 2);
+	ASSERT_FALSE(longer.in_place());
+	std::vector<uint64_t> seen;
+	ASSERT_EQ((uint64_t)2, longer.run(path, [&](const buffer&, const needle_match& m) {
+		seen.push_back(m.offset);
+	}));
+	ASSERT_EQ((std::vector<uint64_t>{ 0, 2 }), seen);
+	ASSERT_EQ("<aa><aa>a baa", read_file());
+
+	replacer shorter(aa, {}, true);
+	ASSERT_EQ((uint64_t)3, shorter.run(path));
+	ASSERT_EQ("<><>a b", read_file());
+
+	// Several patterns of different lengths
+	multi_needle mn({ { '<', '>' }, { 'b' } });
+	replacer multi(mn, bytes("--"), false);
+	ASSERT_FALSE(multi.in_place());
+	ASSERT_EQ((uint64_t)3, multi.run(path));
+	ASSERT_EQ("----a --", read_file());
+
+	// Dry run
+	replacer dry(aa, bytes("zz"), true, UINT64_MAX, true);
+	write_file("aa");
+	ASSERT_EQ((uint64_t)1, dry.run(path));
+	ASSERT_EQ("aa", read_file());
+
+	// Through a symlink, the file it points to is rewritten and the link kept
+	std::filesystem::path link = path.string() + "_link";
+	std::filesystem::remove(link);
+	std::filesystem::create_symlink(path, link);
+	write_file("aa baa");
+	ASSERT_EQ((uint64_t)2, longer.run(link));
+	ASSERT_TRUE(std::filesystem::is_symlink(link));
+	ASSERT_EQ("<aa> b<aa>", read_file());
+	std::filesystem::remove(link);
+
+	// Rewriting would break hard links, so it's refused
+	std::filesystem::create_hard_link(path, link);
+	std::string error;
+	ASSERT_EQ(UINT64_MAX, shorter.run(link, nullptr, &error));
+	ASSERT_FALSE(error.empty());
+	ASSERT_EQ("<aa> b<aa>", read_file());
+	ASSERT_EQ((uint64_t)2, same.run(link));
+	ASSERT_EQ("<XY> b<XY>", read_file());
+	std::filesystem::remove(link);
+
+	std::filesystem::remove(path);
+	ASSERT_EQ(UINT64_MAX, same.run(path));
+}
+
+TEST(directory_walker, order_and_filters)
+{
+	namespace fs = std::filesystem;
+	fs::path root = fs::temp_directory_path() / "gb_walk_test";
+	fs::remove_all(root);
+	for (const char* dir : { "b/d", "a", "skip" }) {
+		fs::create_directories(root / dir);
+	}
+	for (const char* file : { "b/d/3.bin", "b/1.txt", "a/2.txt", "skip/4.txt", "5.bin" }) {
+		std::ofstream(root / file) << file;
+	}
+	std::ofstream(root / "big.txt") << std::string(4096, 'x');
+	fs::create_symlink(root / "a" / "2.txt", root / "b" / "link.txt");
+	fs::create_directory_symlink(root / "a", root / "b" / "dirlink");
+
+	auto walk = [&](const walk_filter& filter, thread_pool* pool) {
+		std::vector<std::string> seen;
+		directory_walker<std::string> walker(filter, pool);
+		uint64_t turns = 0;
+		walker.walk(root, [&](const fs::path& file, uint64_t) {
+			return file.lexically_relative(root).string();
+		}, [&](const fs::path&, uint64_t seq, std::string& name) {
+			EXPECT_EQ(seen.size(), seq);
+			seen.push_back(name);
+			return true;
+		}, [](const fs::path&, const std::error_code&) {}, [&](const fs::path&, uint64_t seq) {
+			EXPECT_EQ(turns++, seq);
+		});
+		return seen;
+	};
+
+	// Sorted depth first, and symlinked directories aren't followed
+	walk_filter all;
+	std::vector<std::string> expected = { "5.bin", "a/2.txt", "b/1.txt", "b/d/3.bin", "b/link.txt", "big.txt", "skip/4.txt" };
+	ASSERT_EQ(expected, walk(all, nullptr));
+	thread_pool pool(3);
+	ASSERT_EQ(expected, walk(all, &pool));
+
+	walk_filter some;
+	some.include = { "*.txt" };
+	some.exclude = { "skip" };
+	some.max_size = 1024;
+	some.skip_symlinks = true;
+	expected = { "a/2.txt", "b/1.txt" };
+	ASSERT_EQ(expected, walk(some, &pool));
+
+	fs::remove_all(root);
+}
+
+TEST(ngram_index, candidates_and_matches)
+{
+	namespace fs = std::filesystem;
+	fs::path root = fs::temp_directory_path() / "gb_index_test";
+	fs::remove_all(root);
+	fs::create_directories(root);
+
+	// Random bytes with the needle planted at the start, across block
+	// boundaries and at the very end of a file
+	const std::string text = "needle in a haystack";
+	std::mt19937 gen(11);
+	std::vector<std::vector<uint8_t>> contents;
+	for (uint64_t len : { 5000, 0, 777, 4096 }) {
+		std::vector<uint8_t> data(len);
+		for (auto& b : data) {
+			b = gen();
+		}
+		for (uint64_t at : { 0, 1020, 2040, 4076 }) {
+			if (at + text.size() <= len) {
+				memcpy(data.data() + at, text.data(), text.size());
+			}
+		}
+		contents.push_back(data);
+	}
+
+	ngram_index::builder builder(1024);
+	for (uint64_t i = 0; i < contents.size(); ++i) {
+		fs::path file = root / std::to_string(i);
+		std::ofstream(file, std::ios::binary).write((const char*)contents[i].data(), contents[i].size());
+		ASSERT_TRUE(builder.add(file));
+	}
+	ASSERT_FALSE(builder.add(root / "missing"));
+	ASSERT_TRUE(builder.write(root / "idx"));
+
+	std::unique_ptr<ngram_index> index = ngram_index::open(root / "idx");
+	ASSERT_TRUE(index);
+	ASSERT_EQ((uint64_t)4, index->files().size());
+	ASSERT_FALSE(ngram_index::open(root / "0"));
+
+	std::vector<uint64_t> blocks;
+	ASSERT_FALSE(index->candidates((const uint8_t*)"nee", 3, blocks));
+
+	for (const std::string& query : { text, std::string("a hay"), std::string("ck"), std::string("absent!") }) {
+		buffer_needle n(std::vector<uint8_t>(query.begin(), query.end()));
+		const bool narrowed = index->candidates((const uint8_t*)query.data(), query.size(), blocks);
+		ASSERT_EQ(query.size() >= ngram_index::gram_len, narrowed);
+		ASSERT_TRUE(std::is_sorted(blocks.begin(), blocks.end()));
+
+		for (uint64_t i = 0; i < contents.size(); ++i) {
+			arraybuf buf(contents[i]);
+			std::vector<needle_match> found;
+			auto collect = [&](const needle_match& m) {
+				found.push_back(m);
+				return true;
+			};
+			if (narrowed) {
+				index->for_each_match(n, i, buf, blocks, collect);
+			} else {
+				n.for_each_match(buf, collect);
+			}
+			ASSERT_EQ(n.match_vector(buf), found) << query << " in file " << i;
+		}
+	}
+
+	// Distances make it through for needles that match inexactly
+	index->candidates((const uint8_t*)text.data(), text.size(), blocks);
+	std::string near = text;
+	near.back() = '!';
+	approx_needle an(std::vector<uint8_t>(near.begin(), near.end()), 1);
+	for (uint64_t i = 0; i < contents.size(); ++i) {
+		arraybuf buf(contents[i]);
+		std::vector<needle_match> found;
+		index->for_each_match(an, i, buf, blocks, [&](const needle_match& m) {
+			found.push_back(m);
+			return true;
+		});
+		ASSERT_EQ(an.match_vector(buf), found) << "file " << i;
+	}
+
+	// Nothing is a candidate for bytes that aren't there
+	index->candidates((const uint8_t*)"absent!", 7, blocks);
+	ASSERT_TRUE(blocks.empty());
+
+	fs::remove_all(root);
+}
+
+TEST(buffer, hex2buf_tests)
+{
+	auto buf = buffer_conversion::hex_string_to_buffer("7f454C46");
+	ASSERT_NE(nullptr, buf);
+	ASSERT_EQ((uint64_t)4, buf->length());
+	ASSERT_EQ((uint8_t)0x7f, (*buf)[0]);
+	ASSERT_EQ((uint8_t)0x4c, (*buf)[2]);
+
+	buf = buffer_conversion::hex_string_to_buffer("7f 45 4c  46");
+	ASSERT_NE(nullptr, buf);
+	ASSERT_EQ((uint64_t)4, buf->length());
+	ASSERT_EQ((uint8_t)0x46, (*buf)[3]);
+
+	ASSERT_EQ(nullptr, buffer_conversion::hex_string_to_buffer("7f4"));
+	ASSERT_EQ(nullptr, buffer_conversion::hex_string_to_buffer("7 f"));
+	ASSERT_EQ(nullptr, buffer_conversion::hex_string_to_buffer("zz"));
+	ASSERT_EQ(nullptr, buffer_conversion::hex_string_to_buffer(""));
+}
+
 int main(int argc, char** argv)
 {
 	setup();
@@ -0,0 +1,415 @@
+/*
+ * End-to-end benchmarks: runs the gb binary on generated files the way it's
+ * run for real, so file loading, stream buffering and printing matches are
+ * all part of the time, unlike the in-memory benchmarks in bufbench.cpp.
+ *
+ * Each case is run on each file size as a file argument and through a pipe,
+ * with the file in the page cache (warm) or dropped from it first with
+ * posix_fadvise (cold). Results are written as JSON, one case per line, and
+ * can be compared against an earlier run to catch regressions.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+struct bench_options
+{
+	std::string gb = "build/gb";
+	std::string dir = "/tmp/gb-clibench";
+	std::vector<uint64_t> sizes = { 1ull << 20, 64ull << 20 };
+	uint64_t runs = 3;
+	std::string out;
+	std::string baseline;
+	double threshold = 10;
+	bool cold = true;
+};
+
+/**
+ * One way of running gb. "FILE" in @args is replaced with the input, or
+ * dropped when the input is piped in.
+ */
+struct bench_case
+{
+	const char* name;
+	std::vector<std::string> args;
+};
+
+static const std::vector<bench_case> cases = {
+	// A needle planted once per MiB: nearly all the time is reading
+	{ "rare", { "-x", "7f 45 4c 46 02 01 01", "FILE" } },
+	// A common word, every match printed with context
+	{ "print", { "-s", " there ", "FILE" } },
+	// The same word, only counted
+	{ "count", { "-c", "-s", " there ", "FILE" } },
+};
+
+struct result
+{
+	std::string name;
+	uint64_t size;
+	double seconds;
+	double user;
+	double sys;
+	long max_rss_kb;
+};
+
+static void usage()
+{
+	std::cerr << "Usage: clibench [options]\n"
+	          << "  --gb <path>          gb binary to run (default build/gb)\n"
+	          << "  --dir <dir>          Where to keep the generated files (default /tmp/gb-clibench)\n"
+	          << "  --sizes <list>       Comma separated file sizes, K, M and G suffixes allowed\n"
+	          << "                       (default 1M,64M)\n"
+	          << "  --runs <num>         Runs of each case; the fastest counts (default 3)\n"
+	          << "  --warm-only          Skip the cold cache runs\n"
+	          << "  --out <file>         Write the results to this JSON file\n"
+	          << "  --baseline <file>    Compare against results from an earlier --out\n"
+	          << "  --threshold <pct>    Slowdown over the baseline that counts as a regression\n"
+	          << "                       (default 10)\n";
+}
+
+static bool parse_size(const std::string& str, uint64_t& size)
+{
+	char* end;
+	size = strtoull(str.c_str(), &end, 10);
+	switch (*end) {
+	case 'K': case 'k': size <<= 10; ++end; break;
+	case 'M': case 'm': size <<= 20; ++end; break;
+	case 'G': case 'g': size <<= 30; ++end; break;
+	}
+	return end != str.c_str() && *end == '\0' && size > 0;
+}
+
+static std::string size_name(uint64_t size)
+{
+	if (size % (1ull << 30) == 0) return std::to_string(size >> 30) + "G";
+	if (size % (1ull << 20) == 0) return std::to_string(size >> 20) + "M";
+	if (size % (1ull << 10) == 0) return std::to_string(size >> 10) + "K";
+	return std::to_string(size);
+}
+
+static bool get_opts(int argc, char** argv, bench_options& opts)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--warm-only") {
+			opts.cold = false;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			return false;
+		}
+		std::string value = argv[++i];
+		if (arg == "--gb") {
+			opts.gb = value;
+		} else if (arg == "--dir") {
+			opts.dir = value;
+		} else if (arg == "--sizes") {
+			opts.sizes.clear();
+			std::stringstream ss(value);
+			for (std::string item; std::getline(ss, item, ',');) {
+				uint64_t size;
+				if (!parse_size(item, size)) {
+					return false;
+				}
+				opts.sizes.push_back(size);
+			}
+		} else if (arg == "--runs") {
+			opts.runs = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+		} else if (arg == "--out") {
+			opts.out = value;
+		} else if (arg == "--baseline") {
+			opts.baseline = value;
+		} else if (arg == "--threshold") {
+			opts.threshold = strtod(value.c_str(), nullptr);
+		} else {
+			return false;
+		}
+	}
+	return !opts.sizes.empty();
+}
+
+/**
+ * Make (or reuse) a file of @size bytes of text-like data: random words, with
+ * an ELF header planted at the start of every MiB. It's written a chunk at a
+ * time, so sizes far beyond memory are fine.
+ */
+static bool make_input(const std::string& path, uint64_t size)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == size) {
+		return true;
+	}
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		return false;
+	}
+
+	const char* words[] = { "the ", "quick ", "brown ", "fox ", "jumps ", "over ",
+	                        "lazy ", "dog ", "and ", "then ", "sleeps ", "there " };
+	const uint8_t magic[] = { 0x7f, 'E', 'L', 'F', 2, 1, 1, 0 };
+	const uint64_t chunk_len = 1 << 20;
+	std::vector<uint8_t> chunk(chunk_len);
+	uint64_t seed = 1;
+
+	for (uint64_t written = 0; written < size;) {
+		uint64_t i = 0;
+		while (i < chunk_len) {
+			seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+			for (const char* w = words[(seed >> 33) % 12]; *w && i < chunk_len; ++w) {
+				chunk[i++] = *w;
+			}
+		}
+		memcpy(chunk.data(), magic, sizeof(magic));
+
+		const uint64_t n = std::min(chunk_len, size - written);
+		out.write((const char*)chunk.data(), n);
+		written += n;
+	}
+	return (bool)out.flush();
+}
+
+/**
+ * Drop @path from the page cache. Only clean pages can be dropped, so flush
+ * it first.
+ */
+static bool drop_cache(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	fdatasync(fd);
+	int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	return err == 0;
+}
+
+static pid_t spawn(const std::vector<std::string>& args, int in_fd, int out_fd)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	}
+	posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+	std::vector<char*> argv;
+	for (const std::string& arg : args) {
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	pid_t pid;
+	int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	return err == 0 ? pid : -1;
+}
+
+/**
+ * Run gb once with @args, reading @input directly or, if @pipe, from cat
+ * through a pipe. Output goes to /dev/null.
+ *
+ * Returns false if gb couldn't be run or failed.
+ */
+static bool run_once(const bench_options& opts, const bench_case& c, const std::string& input,
+                     bool pipe, result& res)
+{
+	std::vector<std::string> args = { opts.gb };
+	for (const std::string& arg : c.args) {
+		if (arg != "FILE") {
+			args.push_back(arg);
+		} else if (!pipe) {
+			args.push_back(input);
+		}
+	}
+
+	int null_fd = open("/dev/null", O_WRONLY);
+	int fds[2] = { -1, -1 };
+	if (null_fd < 0 || (pipe && ::pipe(fds) < 0)) {
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	pid_t cat = -1;
+	if (pipe) {
+		cat = spawn({ "cat", input }, -1, fds[1]);
+		close(fds[1]);
+	}
+	pid_t gb = spawn(args, fds[0], null_fd);
+	if (fds[0] >= 0) {
+		close(fds[0]);
+	}
+	close(null_fd);
+
+	int status = -1;
+	struct rusage usage = {};
+	bool ok = gb > 0 && wait4(gb, &status, 0, &usage) == gb
+	       && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	if (cat > 0) {
+		int cat_status;
+		waitpid(cat, &cat_status, 0);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	res.seconds = std::chrono::duration<double>(end - start).count();
+	res.user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+	res.sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	res.max_rss_kb = usage.ru_maxrss;
+	return ok;
+}
+
+static void write_results(std::ostream& out, const bench_options& opts, const std::vector<result>& results)
+{
+	out << "{\n  \"gb\": \"" << opts.gb << "\",\n  \"results\": [\n";
+	for (uint64_t i = 0; i < results.size(); ++i) {
+		const result& r = results[i];
+		out << "    { \"name\": \"" << r.name << "\", \"size\": " << r.size
+		    << ", \"seconds\": " << r.seconds
+		    << ", \"mb_per_s\": " << r.size / r.seconds / (1 << 20)
+		    << ", \"user\": " << r.user << ", \"sys\": " << r.sys
+		    << ", \"max_rss_kb\": " << r.max_rss_kb << " }"
+		    << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n}\n";
+}
+
+/**
+ * Read the name and time of each result from a file written by
+ * write_results(), which puts one result on each line.
+ */
+static bool read_baseline(const std::string& path, std::map<std::string, double>& seconds)
+{
+	std::ifstream in(path);
+	if (!in) {
+		return false;
+	}
+	for (std::string line; std::getline(in, line);) {
+		size_t name = line.find("\"name\": \"");
+		size_t secs = line.find("\"seconds\": ");
+		if (name == std::string::npos || secs == std::string::npos) {
+			continue;
+		}
+		name += strlen("\"name\": \"");
+		size_t name_end = line.find('"', name);
+		seconds[line.substr(name, name_end - name)] = strtod(line.c_str() + secs + strlen("\"seconds\": "), nullptr);
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	bench_options opts;
+	if (!get_opts(argc, argv, opts)) {
+		usage();
+		return -1;
+	}
+	mkdir(opts.dir.c_str(), 0755);
+
+	std::vector<result> results;
+	for (uint64_t size : opts.sizes) {
+		const std::string input = opts.dir + "/input-" + size_name(size);
+		if (!make_input(input, size)) {
+			std::cerr << "Couldn't write " << input << '\n';
+			return -1;
+		}
+
+		for (const bench_case& c : cases) {
+			for (bool pipe : { false, true }) {
+				for (bool cold : { false, true }) {
+					if (cold && !opts.cold) {
+						continue;
+					}
+
+					result best = {};
+					best.name = size_name(size) + "/" + c.name + (pipe ? "/pipe" : "/file")
+					          + (cold ? "/cold" : "/warm");
+					best.size = size;
+					best.seconds = -1;
+
+					// An untimed run first, so warm really is warm
+					result r;
+					if (!cold && !run_once(opts, c, input, pipe, r)) {
+						std::cerr << "Running " << opts.gb << " failed\n";
+						return -1;
+					}
+					for (uint64_t run = 0; run < opts.runs; ++run) {
+						if (cold && !drop_cache(input)) {
+							std::cerr << "Couldn't drop " << input << " from the page cache\n";
+						}
+						if (!run_once(opts, c, input, pipe, r)) {
+							std::cerr << "Running " << opts.gb << " failed\n";
+							return -1;
+						}
+						if (best.seconds < 0 || r.seconds < best.seconds) {
+							r.name = best.name;
+							r.size = best.size;
+							best = r;
+						}
+					}
+
+					std::cout << best.name << ": " << best.seconds << " s, "
+					          << best.size / best.seconds / (1 << 20) << " MB/s, "
+					          << best.max_rss_kb << " KB max RSS\n";
+					results.push_back(best);
+				}
+			}
+		}
+	}
+
+	if (!opts.out.empty()) {
+		std::ofstream out(opts.out);
+		write_results(out, opts, results);
+		if (!out.flush()) {
+			std::cerr << "Couldn't write " << opts.out << '\n';
+			return -1;
+		}
+	}
+
+	if (opts.baseline.empty()) {
+		return 0;
+	}
+
+	std::map<std::string, double> baseline;
+	if (!read_baseline(opts.baseline, baseline)) {
+		std::cerr << "Couldn't read " << opts.baseline << '\n';
+		return -1;
+	}
+
+	uint64_t regressions = 0;
+	std::cout << "\nAgainst " << opts.baseline << " (threshold " << opts.threshold << "%):\n";
+	for (const result& r : results) {
+		auto it = baseline.find(r.name);
+		if (it == baseline.end() || it->second <= 0) {
+			continue;
+		}
+		const double change = (r.seconds / it->second - 1) * 100;
+		const bool regressed = change > opts.threshold;
+		regressions += regressed;
+		std::cout << "  " << r.name << ": " << (change >= 0 ? "+" : "") << std::fixed
+		          << std::setprecision(1) << change << "%"
+		          << (regressed ? "  REGRESSION" : "") << '\n';
+	}
+	std::cout << regressions << " regression" << (regressions == 1 ? "" : "s") << '\n';
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,459 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <lzma.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef GB_ZSTD
+#include <zstd.h>
+#endif
+
+#include "stats.h"
+
+/**
+ * Compressed formats that inputs are recognized in, by their magic bytes.
+ */
+enum compression
+{
+	COMPRESSION_NONE,
+	COMPRESSION_GZIP,
+	COMPRESSION_XZ,
+	COMPRESSION_ZSTD, // Only decompressed when built with ZSTD=1
+};
+
+/**
+ * Decompresses one format, a piece at a time.
+ */
+class decoder
+{
+public:
+	enum result
+	{
+		MORE,  // Made progress; call again with more input or output space
+		END,   // Reached the end of the compressed data
+		ERROR, // The data is corrupt, or ended too soon
+	};
+
+	virtual ~decoder() = default;
+
+	/**
+	 * Decompress as much of @in as will fit in @out, advancing both past what
+	 * was used. @last says no input follows what's in @in.
+	 */
+	virtual result decode(const uint8_t*& in, uint64_t& in_len, uint8_t*& out, uint64_t& out_len, bool last) = 0;
+
+	/**
+	 * Which format @data, the start of an input, is compressed in.
+	 */
+	static compression detect(const uint8_t* data, uint64_t len)
+	{
+		static const uint8_t gzip[] = { 0x1f, 0x8b };
+		static const uint8_t xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+		static const uint8_t zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+		auto starts_with = [&](const uint8_t* magic, uint64_t magic_len) {
+			return len >= magic_len && memcmp(data, magic, magic_len) == 0;
+		};
+		if (starts_with(gzip, sizeof(gzip))) return COMPRESSION_GZIP;
+		if (starts_with(xz, sizeof(xz))) return COMPRESSION_XZ;
+		if (starts_with(zstd, sizeof(zstd))) return COMPRESSION_ZSTD;
+		return COMPRESSION_NONE;
+	}
+
+	/**
+	 * Bytes of an input detect() needs to see.
+	 */
+	static const uint64_t magic_len = 6;
+
+	/**
+	 * Whether this build can decompress @format.
+	 */
+	static bool supported(compression format)
+	{
+#ifdef GB_ZSTD
+		return format != COMPRESSION_NONE;
+#else
+		return format == COMPRESSION_GZIP || format == COMPRESSION_XZ;
+#endif
+	}
+
+	/**
+	 * A decoder for @format, or nullptr if it isn't supported().
+	 */
+	static std::unique_ptr<decoder> create(compression format);
+};
+
+/**
+ * gzip through zlib. Files made by concatenating gzip files are one stream,
+ * as gunzip treats them, and zero padding after the last member is ignored.
+ */
+class gzip_decoder : public decoder
+{
+public:
+	gzip_decoder()
+	{
+		// 16 + MAX_WBITS: gzip headers only
+		m_ok = inflateInit2(&m_stream, 16 + MAX_WBITS) == Z_OK;
+	}
+
+	~gzip_decoder()
+	{
+		if (m_ok) {
+			inflateEnd(&m_stream);
+		}
+	}
+
+	virtual result decode(const uint8_t*& in, uint64_t& in_len, uint8_t*& out, uint64_t& out_len, bool last) override
+	{
+		if (!m_ok) {
+			return ERROR;
+		}
+		if (m_between_members) {
+			if (in_len == 0) {
+				return last ? END : MORE;
+			}
+			if (in[0] != 0x1f) {
+				// Trailing padding, which gunzip ignores too
+				in += in_len;
+				in_len = 0;
+				return MORE;
+			}
+			m_between_members = false;
+		}
+
+		// zlib counts in uInt, so hand it at most 1 GiB at a time
+		m_stream.next_in = (Bytef*)in;
+		m_stream.avail_in = std::min<uint64_t>(in_len, 1 << 30);
+		m_stream.next_out = out;
+		m_stream.avail_out = std::min<uint64_t>(out_len, 1 << 30);
+		const uInt avail_in = m_stream.avail_in;
+		const uInt avail_out = m_stream.avail_out;
+
+		int ret = inflate(&m_stream, Z_NO_FLUSH);
+
+		in += avail_in - m_stream.avail_in;
+		in_len -= avail_in - m_stream.avail_in;
+		out += avail_out - m_stream.avail_out;
+		out_len -= avail_out - m_stream.avail_out;
+
+		if (ret == Z_STREAM_END) {
+			m_between_members = true;
+			inflateReset(&m_stream);
+			return in_len == 0 && last ? END : MORE;
+		}
+		if (ret == Z_BUF_ERROR && !(last && in_len == 0)) {
+			// Just out of input or output for now
+			return MORE;
+		}
+		return ret == Z_OK ? MORE : ERROR;
+	}
+
+private:
+	z_stream m_stream = {};
+	bool m_ok;
+	bool m_between_members = false;
+};
+
+/**
+ * xz through liblzma, with concatenated streams allowed as xz -d does.
+ */
+class xz_decoder : public decoder
+{
+public:
+	xz_decoder()
+	{
+		m_ok = lzma_stream_decoder(&m_stream, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+	}
+
+	~xz_decoder() { lzma_end(&m_stream); }
+
+	virtual result decode(const uint8_t*& in, uint64_t& in_len, uint8_t*& out, uint64_t& out_len, bool last) override
+	{
+		if (!m_ok) {
+			return ERROR;
+		}
+
+		m_stream.next_in = in;
+		m_stream.avail_in = in_len;
+		m_stream.next_out = out;
+		m_stream.avail_out = out_len;
+
+		lzma_ret ret = lzma_code(&m_stream, last ? LZMA_FINISH : LZMA_RUN);
+
+		in_len -= m_stream.next_in - in;
+		in = m_stream.next_in;
+		out_len -= m_stream.next_out - out;
+		out = m_stream.next_out;
+
+		if (ret == LZMA_STREAM_END) {
+			return END;
+		}
+		return ret == LZMA_OK || (ret == LZMA_BUF_ERROR && !last) ? MORE : ERROR;
+	}
+
+private:
+	lzma_stream m_stream = LZMA_STREAM_INIT;
+	bool m_ok;
+};
+
+#ifdef GB_ZSTD
+/**
+ * zstd through libzstd. Concatenated frames are decompressed one after the
+ * other.
+ */
+class zstd_decoder : public decoder
+{
+public:
+	zstd_decoder() :
+		m_stream(ZSTD_createDStream())
+	{}
+
+	~zstd_decoder() { ZSTD_freeDStream(m_stream); }
+
+	virtual result decode(const uint8_t*& in, uint64_t& in_len, uint8_t*& out, uint64_t& out_len, bool last) override
+	{
+		if (!m_stream) {
+			return ERROR;
+		}
+
+		ZSTD_inBuffer input = { in, in_len, 0 };
+		ZSTD_outBuffer output = { out, out_len, 0 };
+		size_t ret = ZSTD_decompressStream(m_stream, &output, &input);
+		if (ZSTD_isError(ret)) {
+			return ERROR;
+		}
+
+		in += input.pos;
+		in_len -= input.pos;
+		out += output.pos;
+		out_len -= output.pos;
+
+		// 0 means a frame just ended. Anything else means the frame's still
+		// going, unless nothing was read or written: between frames, the
+		// return value is a hint for the next frame's header
+		if (ret == 0) {
+			m_in_frame = false;
+		} else if (input.pos > 0 || output.pos > 0) {
+			m_in_frame = true;
+		}
+		if (last && in_len == 0 && input.pos == 0 && output.pos == 0) {
+			return m_in_frame ? ERROR : END;
+		}
+		return MORE;
+	}
+
+private:
+	ZSTD_DStream* m_stream;
+	bool m_in_frame = false;
+};
+#endif
+
+inline std::unique_ptr<decoder> decoder::create(compression format)
+{
+	switch (format) {
+	case COMPRESSION_GZIP: return std::make_unique<gzip_decoder>();
+	case COMPRESSION_XZ: return std::make_unique<xz_decoder>();
+#ifdef GB_ZSTD
+	case COMPRESSION_ZSTD: return std::make_unique<zstd_decoder>();
+#endif
+	default: return nullptr;
+	}
+}
+
+/**
+ * Reads a compressed stream and decompresses it on a thread of its own,
+ * handing the decompressed data over a chunk at a time.
+ *
+ * Decompressing is usually slower than searching, so the two are overlapped:
+ * while one chunk is searched, the thread is filling the next ones, up to
+ * @depth chunks ahead. The chunk buffers are reused, so memory use is
+ * bounded whatever the size of the input.
+ */
+class decompressing_reader
+{
+public:
+	static const uint64_t default_chunk_len = 1024 * 1024;
+	static const uint32_t default_depth = 4;
+
+	/**
+	 * Called with each chunk, in order. Returning false stops the reading.
+	 */
+	using chunk_callback = std::function<bool(const uint8_t* data, uint64_t len)>;
+
+	/**
+	 * Decompress @fd, the rest of a stream that starts with @header (bytes
+	 * already read to find out its format).
+	 */
+	decompressing_reader(int fd, compression format, const std::vector<uint8_t>& header = {},
+	                     uint64_t chunk_len = default_chunk_len, uint32_t depth = default_depth) :
+		m_fd(fd),
+		m_decoder(decoder::create(format)),
+		m_header(header),
+		m_chunk_len(chunk_len),
+		m_depth(std::max<uint32_t>(depth, 1))
+	{}
+
+	/**
+	 * Decompress the whole stream, passing each chunk to @consume.
+	 *
+	 * Returns the number of decompressed bytes, or UINT64_MAX if the stream
+	 * couldn't be read or decompressed.
+	 */
+	uint64_t run(const chunk_callback& consume)
+	{
+		if (!m_decoder) {
+			return UINT64_MAX;
+		}
+		for (uint32_t i = 0; i < m_depth; ++i) {
+			m_free.push_back(std::make_unique<uint8_t[]>(m_chunk_len));
+		}
+
+		std::thread producer([this] { produce(); });
+
+		uint64_t total = 0;
+		bool stopped = false;
+		for (;;) {
+			chunk c;
+			{
+				search_stats::timer timer(&search_stats::read_ns);
+				std::unique_lock<std::mutex> lock(m_lock);
+				m_changed.wait(lock, [this] { return !m_full.empty() || m_done; });
+				if (m_full.empty()) {
+					break;
+				}
+				c = std::move(m_full.front());
+				m_full.pop_front();
+			}
+
+			total += c.len;
+			stopped = !consume(c.data.get(), c.len);
+
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_free.push_back(std::move(c.data));
+			if (stopped) {
+				m_stop = true;
+			}
+			m_changed.notify_all();
+			if (stopped) {
+				break;
+			}
+		}
+		producer.join();
+
+		return m_failed && !stopped ? UINT64_MAX : total;
+	}
+
+	/**
+	 * Bytes of compressed input read, including the header.
+	 */
+	uint64_t compressed_bytes() const { return m_compressed; }
+
+private:
+	struct chunk
+	{
+		std::unique_ptr<uint8_t[]> data;
+		uint64_t len = 0;
+	};
+
+	/**
+	 * The decompressing thread: read, decompress and queue chunks until the
+	 * stream ends, something goes wrong, or the reader's told to stop.
+	 */
+	void produce()
+	{
+		std::vector<uint8_t> input(m_chunk_len);
+		const uint8_t* in = m_header.data();
+		uint64_t in_len = m_header.size();
+		m_compressed = in_len;
+		bool eof = false;
+
+		chunk c;
+		bool ok = true;
+		for (;;) {
+			if (!c.data) {
+				std::unique_lock<std::mutex> lock(m_lock);
+				m_changed.wait(lock, [this] { return !m_free.empty() || m_stop; });
+				if (m_stop) {
+					break;
+				}
+				c.data = std::move(m_free.back());
+				m_free.pop_back();
+				c.len = 0;
+			}
+
+			if (in_len == 0 && !eof) {
+				ssize_t n = read(m_fd, input.data(), input.size());
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n < 0) {
+					ok = false;
+					break;
+				}
+				eof = n == 0;
+				in = input.data();
+				in_len = n;
+				m_compressed += n;
+			}
+
+			uint8_t* out = c.data.get() + c.len;
+			uint64_t out_len = m_chunk_len - c.len;
+			const uint64_t in_before = in_len;
+			const uint64_t out_before = out_len;
+			decoder::result r = m_decoder->decode(in, in_len, out, out_len, eof);
+			c.len = m_chunk_len - out_len;
+
+			const bool stuck = eof && in_len == in_before && out_len == out_before;
+			if (r == decoder::ERROR || (r == decoder::MORE && stuck)) {
+				// Corrupt, or cut off part way through
+				ok = false;
+				break;
+			}
+			if (r == decoder::END || c.len == m_chunk_len) {
+				std::lock_guard<std::mutex> lock(m_lock);
+				if (m_stop) {
+					break;
+				}
+				if (c.len > 0) {
+					m_full.push_back(std::move(c));
+					c = chunk();
+					m_changed.notify_all();
+				}
+				if (r == decoder::END) {
+					break;
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_failed = !ok;
+		m_done = true;
+		m_changed.notify_all();
+	}
+
+	const int m_fd;
+	const std::unique_ptr<decoder> m_decoder;
+	const std::vector<uint8_t> m_header;
+	const uint64_t m_chunk_len;
+	const uint32_t m_depth;
+
+	std::mutex m_lock;
+	std::condition_variable m_changed;
+	std::deque<chunk> m_full;                         // Decompressed, waiting to be consumed
+	std::vector<std::unique_ptr<uint8_t[]>> m_free;   // Buffers ready to be refilled
+	bool m_stop = false;                              // Set by the consumer
+	bool m_done = false;                              // Set by the producer, when it's finished
+	bool m_failed = false;
+	uint64_t m_compressed = 0;
+};
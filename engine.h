@@ -0,0 +1,409 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "simd.h"
+
+/**
+ * An algorithm for finding a fixed byte string in contiguous memory.
+ *
+ * Each engine keeps its own copy of the needle plus whatever tables it
+ * precomputes from it, so building one is the expensive part and each
+ * find() call is cheap.
+ */
+class search_engine
+{
+public:
+	enum kind
+	{
+		AUTO,     // Let create() decide based on the needle
+		SIMD,     // Vectorized first/last byte filter (simd.h)
+		HORSPOOL, // Boyer-Moore-Horspool
+		TWO_WAY,  // Crochemore-Perrin Two-Way
+		MEMMEM,   // libc memchr / memmem
+		SHORT,    // The SIMD filter, specialized for needles of 2 to 31 bytes
+	};
+
+	virtual ~search_engine() = default;
+
+	virtual kind type() const = 0;
+
+	/**
+	 * Find the first occurrence of the needle in @haystack at or after
+	 * @start.
+	 *
+	 * Returns the offset, or UINT64_MAX if not found.
+	 */
+	virtual uint64_t find(const uint8_t* haystack, uint64_t len, uint64_t start) const = 0;
+
+	uint64_t length() const { return m_needle.size(); }
+
+	const char* name() const { return kind_name(type()); }
+
+	static const char* kind_name(kind k)
+	{
+		switch (k) {
+		case AUTO: return "auto";
+		case SIMD: return "simd";
+		case HORSPOOL: return "horspool";
+		case TWO_WAY: return "twoway";
+		case MEMMEM: return "memmem";
+		case SHORT: return "short";
+		}
+		return "unknown";
+	}
+
+	/**
+	 * Look up an engine kind by the name kind_name() gives it.
+	 *
+	 * Returns false if there's no such engine.
+	 */
+	static bool parse_kind(const std::string& name, kind& k)
+	{
+		for (kind candidate : { AUTO, SIMD, HORSPOOL, TWO_WAY, MEMMEM, SHORT }) {
+			if (name == kind_name(candidate)) {
+				k = candidate;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Pick an engine for the needle.
+	 *
+	 *  - Single bytes go to memchr, which is about as fast as it gets.
+	 *  - Anything shorter than 32 bytes (magic numbers, -be/-le integers) gets
+	 *    the SIMD filter with a fixed-width compare. Checking a candidate
+	 *    takes constant time, so even periodic needles stay linear.
+	 *  - Long needles with plenty of distinct bytes let Horspool skip most of
+	 *    the haystack without looking at it, unless a byte that fills whole
+	 *    regions of binaries (0x00, 0xff) or text (space) ends the needle or
+	 *    sits near its end. Then Horspool shifts by a byte or two at a time
+	 *    through those regions, and the SIMD filter, which a varied needle's
+	 *    first byte keeps quiet, is far faster.
+	 *  - Other long needles repeat themselves enough that the first/last
+	 *    byte filter and Horspool's shifts can both degrade to O(n*m) on
+	 *    matching data, so use Two-Way, which is linear.
+	 */
+	static kind select(const uint8_t* needle, uint64_t len)
+	{
+		if (len <= 1) {
+			return MEMMEM;
+		}
+		if (len < horspool_min_len) {
+			return SHORT;
+		}
+
+		bool seen[256] = {};
+		uint32_t distinct = 0;
+		for (uint64_t i = 0; i < len; ++i) {
+			if (!seen[needle[i]]) {
+				seen[needle[i]] = true;
+				++distinct;
+			}
+		}
+
+		if (distinct < len / 2) {
+			return TWO_WAY;
+		}
+		for (uint8_t common : { 0x00, 0xff, 0x20 }) {
+			if (needle[len - 1] == common || horspool_shift(needle, len, common) < len / 2) {
+				return SIMD;
+			}
+		}
+		return HORSPOOL;
+	}
+	static std::unique_ptr<search_engine> create(const uint8_t* needle, uint64_t len, kind k = AUTO);
+
+	// Needles at least this long (and varied enough) are given to Horspool
+	static const uint64_t horspool_min_len = 32;
+
+protected:
+	/**
+	 * How far Horspool shifts when @c ends the window: its distance from the
+	 * end of the needle, not counting the last byte.
+	 */
+	static uint64_t horspool_shift(const uint8_t* needle, uint64_t len, uint8_t c)
+	{
+		for (uint64_t i = len - 1; i > 0; --i) {
+			if (needle[i - 1] == c) {
+				return len - i;
+			}
+		}
+		return len;
+	}
+
+	search_engine(const uint8_t* needle, uint64_t len) :
+		m_needle(needle, needle + len)
+	{}
+
+	const std::vector<uint8_t> m_needle;
+};
+
+/**
+ * The vectorized first/last byte candidate filter.
+ */
+class simd_engine : public search_engine
+{
+public:
+	simd_engine(const uint8_t* needle, uint64_t len) :
+		search_engine(needle, len)
+	{}
+
+	virtual kind type() const override { return SIMD; }
+
+	virtual uint64_t find(const uint8_t* haystack, uint64_t len, uint64_t start) const override
+	{
+		return simd_search::find(haystack, len, m_needle.data(), m_needle.size(), start);
+	}
+};
+
+/**
+ * The SIMD filter for a needle of N to 2N - 1 bytes, which checks candidates
+ * with a single compare of its first and last N bytes.
+ */
+template <uint64_t N>
+class short_engine : public search_engine
+{
+public:
+	short_engine(const uint8_t* needle, uint64_t len) :
+		search_engine(needle, len),
+		m_pattern(needle, len)
+	{}
+
+	virtual kind type() const override { return SHORT; }
+
+	virtual uint64_t find(const uint8_t* haystack, uint64_t len, uint64_t start) const override
+	{
+		return simd_search::find_short(haystack, len, m_pattern, start);
+	}
+
+private:
+	const simd_search::short_pattern<N> m_pattern;
+};
+
+/**
+ * Boyer-Moore-Horspool.
+ *
+ * Compares the last byte of the window first and, on a mismatch, shifts by
+ * how far that byte is from the end of the needle. With a long needle most
+ * shifts are close to the needle length, so most of the haystack is never
+ * read at all.
+ */
+class horspool_engine : public search_engine
+{
+public:
+	horspool_engine(const uint8_t* needle, uint64_t len) :
+		search_engine(needle, len)
+	{
+		for (uint64_t& shift : m_shift) {
+			shift = len;
+		}
+		for (uint64_t i = 0; i + 1 < len; ++i) {
+			m_shift[needle[i]] = len - 1 - i;
+		}
+	}
+
+	virtual kind type() const override { return HORSPOOL; }
+
+	virtual uint64_t find(const uint8_t* haystack, uint64_t len, uint64_t start) const override
+	{
+		const uint64_t needle_len = m_needle.size();
+		if (needle_len == 0 || needle_len > len) {
+			return UINT64_MAX;
+		}
+
+		const uint8_t* needle = m_needle.data();
+		const uint8_t last = needle[needle_len - 1];
+		const uint64_t upto = len - needle_len;
+
+		for (uint64_t i = start; i <= upto;) {
+			uint8_t c = haystack[i + needle_len - 1];
+			if (c == last && memcmp(haystack + i, needle, needle_len - 1) == 0) {
+				return i;
+			}
+			i += m_shift[c];
+		}
+		return UINT64_MAX;
+	}
+
+private:
+	uint64_t m_shift[256];
+};
+
+/**
+ * Crochemore-Perrin Two-Way.
+ *
+ * Splits the needle at a critical factorization and matches the right half
+ * left to right, then the left half right to left. Runs in linear time with
+ * constant extra space no matter how repetitive the needle and haystack are.
+ */
+class two_way_engine : public search_engine
+{
+public:
+	two_way_engine(const uint8_t* needle, uint64_t len) :
+		search_engine(needle, len),
+		m_ell(-1),
+		m_period(1),
+		m_periodic(false)
+	{
+		if (len == 0) {
+			return;
+		}
+
+		int64_t p, q;
+		int64_t i = max_suffix(needle, len, false, p);
+		int64_t j = max_suffix(needle, len, true, q);
+		if (i > j) {
+			m_ell = i;
+			m_period = p;
+		} else {
+			m_ell = j;
+			m_period = q;
+		}
+
+		// Is the needle's left half a suffix of its first period? If so the
+		// needle is periodic and we can remember how much of the previous
+		// window matched.
+		m_periodic = (uint64_t)(m_ell + 1 + m_period) <= len
+		          && memcmp(needle, needle + m_period, m_ell + 1) == 0;
+		if (!m_periodic) {
+			m_period = std::max<int64_t>(m_ell + 1, len - m_ell - 1) + 1;
+		}
+	}
+
+	virtual kind type() const override { return TWO_WAY; }
+
+	virtual uint64_t find(const uint8_t* haystack, uint64_t len, uint64_t start) const override
+	{
+		const int64_t m = m_needle.size();
+		if (m == 0 || (uint64_t)m > len) {
+			return UINT64_MAX;
+		}
+
+		const uint8_t* x = m_needle.data();
+		const int64_t upto = len - m;
+		int64_t memory = -1;
+
+		for (int64_t j = start; j <= upto;) {
+			// Right half, left to right
+			int64_t i = std::max(m_ell, memory) + 1;
+			while (i < m && x[i] == haystack[i + j]) {
+				++i;
+			}
+			if (i < m) {
+				j += i - m_ell;
+				memory = -1;
+				continue;
+			}
+
+			// Left half, right to left
+			const int64_t stop = m_periodic ? memory : -1;
+			i = m_ell;
+			while (i > stop && x[i] == haystack[i + j]) {
+				--i;
+			}
+			if (i <= stop) {
+				return j;
+			}
+			j += m_period;
+			memory = m_periodic ? m - m_period - 1 : -1;
+		}
+		return UINT64_MAX;
+	}
+
+private:
+	/**
+	 * Compute the maximal suffix of the needle under the byte ordering (or
+	 * its reverse), returning the position just before it and its period.
+	 */
+	static int64_t max_suffix(const uint8_t* x, int64_t m, bool reverse, int64_t& period)
+	{
+		int64_t ms = -1;
+		int64_t j = 0;
+		int64_t k = 1;
+		period = 1;
+
+		while (j + k < m) {
+			uint8_t a = x[j + k];
+			uint8_t b = x[ms + k];
+			if (reverse ? (a > b) : (a < b)) {
+				j += k;
+				k = 1;
+				period = j - ms;
+			} else if (a == b) {
+				if (k != period) {
+					++k;
+				} else {
+					j += period;
+					k = 1;
+				}
+			} else {
+				ms = j;
+				j = ms + 1;
+				k = period = 1;
+			}
+		}
+		return ms;
+	}
+
+	int64_t m_ell;    // Last position of the left half of the factorization
+	int64_t m_period; // Shift to use after a full match
+	bool m_periodic;
+};
+
+/**
+ * The C library's memchr (single bytes) or memmem.
+ */
+class memmem_engine : public search_engine
+{
+public:
+	memmem_engine(const uint8_t* needle, uint64_t len) :
+		search_engine(needle, len)
+	{}
+
+	virtual kind type() const override { return MEMMEM; }
+
+	virtual uint64_t find(const uint8_t* haystack, uint64_t len, uint64_t start) const override
+	{
+		const uint64_t needle_len = m_needle.size();
+		if (needle_len == 0 || needle_len > len || start > len - needle_len) {
+			return UINT64_MAX;
+		}
+
+		const void* p;
+		if (needle_len == 1) {
+			p = memchr(haystack + start, m_needle[0], len - start);
+		} else {
+			p = memmem(haystack + start, len - start, m_needle.data(), needle_len);
+		}
+		return p ? (const uint8_t*)p - haystack : UINT64_MAX;
+	}
+};
+
+inline std::unique_ptr<search_engine> search_engine::create(const uint8_t* needle, uint64_t len, kind k)
+{
+	if (k == AUTO) {
+		k = select(needle, len);
+	}
+
+	switch (k) {
+	case SHORT:
+		// Needles outside 2 to 31 bytes get the plain SIMD filter
+		if (simd_search::short_pattern<2>::fits(len)) return std::make_unique<short_engine<2>>(needle, len);
+		if (simd_search::short_pattern<4>::fits(len)) return std::make_unique<short_engine<4>>(needle, len);
+		if (simd_search::short_pattern<8>::fits(len)) return std::make_unique<short_engine<8>>(needle, len);
+		if (simd_search::short_pattern<16>::fits(len)) return std::make_unique<short_engine<16>>(needle, len);
+		return std::make_unique<simd_engine>(needle, len);
+	case HORSPOOL: return std::make_unique<horspool_engine>(needle, len);
+	case TWO_WAY: return std::make_unique<two_way_engine>(needle, len);
+	case MEMMEM: return std::make_unique<memmem_engine>(needle, len);
+	default: return std::make_unique<simd_engine>(needle, len);
+	}
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "buffer.h"
+
+/**
+ * A persistent n-gram index over a fixed set of files, for answering many
+ * different queries without reading every byte each time.
+ *
+ * The files are cut into fixed-size blocks, numbered across the whole set.
+ * For every 4-byte gram that starts in a block, the block's number is added
+ * to the posting list of the gram's hash bucket. A match of a needle that
+ * starts in block k contains needle gram 0 in block k, and every needle gram
+ * j < block length in block k or k + 1. So the blocks a match can start in
+ * are
+ *
+ *   P(gram 0)  ∩  for each j: (P(gram j) ∪ (P(gram j) - 1))
+ *
+ * and only those blocks need searching. Hash collisions only ever add
+ * candidates, never lose them.
+ *
+ * The index is a single file, mapped rather than read when it's opened:
+ *
+ *   header
+ *   files:    { size, mtime, first block, path length, path, padding }...
+ *   buckets:  uint64_t offset into postings, one per bucket plus an end
+ *   postings: per bucket, ascending block numbers as LEB128 varint deltas
+ */
+class ngram_index
+{
+public:
+	static const uint64_t gram_len = 4;
+	static const uint64_t default_block_len = 64 * 1024;
+	static const uint32_t bucket_bits = 20;
+	static const uint64_t num_buckets = 1ull << bucket_bits;
+
+	struct file_entry
+	{
+		std::string path;
+		uint64_t size;
+		int64_t mtime;
+		uint64_t first_block;
+	};
+
+	/**
+	 * Collects files and writes out an index of them.
+	 */
+	class builder
+	{
+	public:
+		builder(uint64_t block_len = default_block_len) :
+			m_block_len(block_len),
+			m_num_blocks(0),
+			m_postings(num_buckets),
+			m_last(num_buckets, 0)
+		{}
+
+		/**
+		 * Index a file. Returns false if it couldn't be read.
+		 */
+		bool add(const std::filesystem::path& path)
+		{
+			struct stat st;
+			if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+				return false;
+			}
+
+			file_entry entry{ path.string(), (uint64_t)st.st_size, st.st_mtim.tv_sec, m_num_blocks };
+			if (entry.size > 0) {
+				mmapbuf buf(path);
+				if (buf.length() != entry.size) {
+					return false;
+				}
+
+				std::span<const uint8_t> data = buf.span();
+				for (uint64_t start = 0; start < entry.size; start += m_block_len) {
+					add_block(data.data(), entry.size, start, m_num_blocks++);
+				}
+			}
+			m_files.push_back(std::move(entry));
+			return true;
+		}
+
+		uint64_t file_count() const { return m_files.size(); }
+
+		/**
+		 * Write the index to @path. Returns false on failure.
+		 */
+		bool write(const std::filesystem::path& path) const
+		{
+			std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+			if (!out) {
+				return false;
+			}
+
+			header h = {};
+			memcpy(h.magic, index_magic, sizeof(h.magic));
+			h.block_len = m_block_len;
+			h.gram_len = gram_len;
+			h.bucket_bits = bucket_bits;
+			h.num_files = m_files.size();
+			h.num_blocks = m_num_blocks;
+			out.write((const char*)&h, sizeof(h));
+
+			for (const file_entry& f : m_files) {
+				uint64_t fields[4] = { f.size, (uint64_t)f.mtime, f.first_block, f.path.size() };
+				out.write((const char*)fields, sizeof(fields));
+				out.write(f.path.data(), f.path.size());
+				static const char pad[8] = {};
+				out.write(pad, (8 - f.path.size() % 8) % 8);
+			}
+
+			uint64_t offset = 0;
+			for (const auto& list : m_postings) {
+				out.write((const char*)&offset, sizeof(offset));
+				offset += list.size();
+			}
+			out.write((const char*)&offset, sizeof(offset));
+
+			for (const auto& list : m_postings) {
+				out.write((const char*)list.data(), list.size());
+			}
+			return (bool)out.flush();
+		}
+
+	private:
+		void add_block(const uint8_t* data, uint64_t len, uint64_t start, uint64_t block)
+		{
+			const uint64_t end = std::min(start + m_block_len, len - std::min(len, gram_len - 1));
+			for (uint64_t i = start; i < end; ++i) {
+				uint32_t b = bucket(data + i);
+				// m_last holds the last block number added to each bucket,
+				// plus one, so each block goes in each list only once
+				if (m_last[b] == block + 1) {
+					continue;
+				}
+				put_varint(m_postings[b], block + 1 - m_last[b]);
+				m_last[b] = block + 1;
+			}
+		}
+
+		static void put_varint(std::vector<uint8_t>& out, uint64_t v)
+		{
+			while (v >= 0x80) {
+				out.push_back((v & 0x7f) | 0x80);
+				v >>= 7;
+			}
+			out.push_back(v);
+		}
+
+		const uint64_t m_block_len;
+		uint64_t m_num_blocks;
+		std::vector<file_entry> m_files;
+		std::vector<std::vector<uint8_t>> m_postings;
+		std::vector<uint64_t> m_last;
+	};
+
+	/**
+	 * Open an index written by builder::write().
+	 *
+	 * Returns nullptr if the file can't be read or isn't an index.
+	 */
+	static std::unique_ptr<ngram_index> open(const std::filesystem::path& path)
+	{
+		auto ret = std::unique_ptr<ngram_index>(new ngram_index(path));
+		return ret->load() ? std::move(ret) : nullptr;
+	}
+
+	const std::vector<file_entry>& files() const { return m_files; }
+
+	uint64_t block_len() const { return m_header.block_len; }
+
+	/**
+	 * Work out which blocks a match of @needle could start in.
+	 *
+	 * Fills @blocks with their numbers, in order, and returns true; or
+	 * returns false if the needle is too short for the index to narrow the
+	 * search down, in which case everything has to be searched.
+	 */
+	bool candidates(const uint8_t* needle, uint64_t len, std::vector<uint64_t>& blocks) const
+	{
+		if (len < gram_len) {
+			return false;
+		}
+
+		blocks = postings(bucket(needle));
+
+		// The rest of the grams, shortest posting list first so the set
+		// shrinks as fast as possible
+		std::vector<uint32_t> others;
+		const uint64_t grams = std::min(len - gram_len + 1, block_len());
+		for (uint64_t j = 1; j < grams; ++j) {
+			others.push_back(bucket(needle + j));
+		}
+		std::sort(others.begin(), others.end());
+		others.erase(std::unique(others.begin(), others.end()), others.end());
+		std::sort(others.begin(), others.end(), [&](uint32_t a, uint32_t b) {
+			return list_len(a) < list_len(b);
+		});
+
+		for (uint32_t b : others) {
+			if (blocks.empty()) {
+				break;
+			}
+			std::vector<uint64_t> list = postings(b);
+
+			// Keep block k if gram j is in k or k + 1
+			uint64_t kept = 0;
+			auto it = list.begin();
+			for (uint64_t k : blocks) {
+				it = std::lower_bound(it, list.end(), k);
+				if (it != list.end() && (*it == k || *it == k + 1)) {
+					blocks[kept++] = k;
+				}
+			}
+			blocks.resize(kept);
+		}
+		return true;
+	}
+
+	/**
+	 * Search @haystack, the contents of files()[@file], for matches of @n
+	 * starting in the blocks listed in @blocks (from candidates()). Blocks
+	 * belonging to other files are ignored. A block searched for a needle
+	 * with no longest match runs on to the end of @haystack, and one
+	 * searched for a disjoint needle starts where the last match ended, if
+	 * that's inside it.
+	 *
+	 * Returns false if @visit stopped the search.
+	 */
+	bool for_each_match(const needle& n, uint64_t file, const buffer& haystack,
+	                    const std::vector<uint64_t>& blocks, const match_visitor& visit) const
+	{
+		const file_entry& entry = m_files[file];
+		const uint64_t len = haystack.length();
+		uint64_t overlap = n.length() > 0 ? n.length() - 1 : 0;
+		if (n.length() == needle::unbounded) {
+			overlap = len;
+		}
+		const uint64_t end_block = entry.first_block + (entry.size + block_len() - 1) / block_len();
+		if (!haystack.contiguous()) {
+			return n.for_each_match(haystack, visit);
+		}
+		uint8_t* data = const_cast<uint8_t*>(haystack.span().data());
+
+		uint64_t next = 0; // Where the last match ended
+		auto it = std::lower_bound(blocks.begin(), blocks.end(), entry.first_block);
+		for (; it != blocks.end() && *it < end_block; ++it) {
+			const uint64_t start = (*it - entry.first_block) * block_len();
+			if (start >= len) {
+				break;
+			}
+			const uint64_t end = std::min(start + block_len(), len);
+			const uint64_t from = n.disjoint() && next > start ? next - start : 0;
+			if (from >= end - start) {
+				continue;
+			}
+
+			// Leave matches starting in the next block to it
+			bool stopped = false;
+			arraybuf view(data + start, std::min(end + overlap, len) - start);
+			n.for_each_match(view, [&](const needle_match& m) {
+				if (m.offset >= end - start) {
+					return false;
+				}
+				needle_match adj = m;
+				adj.offset += start;
+				next = adj.offset + adj.length;
+				stopped = !visit(adj);
+				return !stopped;
+			}, from);
+			if (stopped) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	static constexpr char index_magic[8] = { 'G', 'B', 'N', 'G', 'R', 'A', 'M', '1' };
+
+	struct header
+	{
+		char magic[8];
+		uint64_t block_len;
+		uint64_t gram_len;
+		uint64_t bucket_bits;
+		uint64_t num_files;
+		uint64_t num_blocks;
+	};
+
+	ngram_index(const std::filesystem::path& path) :
+		m_map(path)
+	{}
+
+	static uint32_t bucket(const uint8_t* gram)
+	{
+		uint32_t g;
+		memcpy(&g, gram, sizeof(g));
+		return (g * 0x9e3779b1u) >> (32 - bucket_bits);
+	}
+
+	bool load()
+	{
+		std::span<const uint8_t> data = m_map.span();
+		if (data.size() < sizeof(header)) {
+			return false;
+		}
+		memcpy(&m_header, data.data(), sizeof(header));
+		if (memcmp(m_header.magic, index_magic, sizeof(index_magic)) != 0
+		    || m_header.gram_len != gram_len || m_header.bucket_bits != bucket_bits
+		    || m_header.block_len == 0) {
+			return false;
+		}
+
+		uint64_t pos = sizeof(header);
+		for (uint64_t i = 0; i < m_header.num_files; ++i) {
+			uint64_t fields[4];
+			if (pos + sizeof(fields) > data.size()) {
+				return false;
+			}
+			memcpy(fields, data.data() + pos, sizeof(fields));
+			pos += sizeof(fields);
+			if (fields[3] > data.size() - pos) {
+				return false;
+			}
+			m_files.push_back({ std::string((const char*)data.data() + pos, fields[3]),
+			                    fields[0], (int64_t)fields[1], fields[2] });
+			pos += (fields[3] + 7) / 8 * 8;
+		}
+
+		if (pos + (num_buckets + 1) * sizeof(uint64_t) > data.size()) {
+			return false;
+		}
+		m_buckets = (const uint64_t*)(data.data() + pos);
+		m_postings = data.data() + pos + (num_buckets + 1) * sizeof(uint64_t);
+		return m_buckets[num_buckets] <= (uint64_t)(data.data() + data.size() - m_postings);
+	}
+
+	uint64_t list_len(uint32_t b) const
+	{
+		return m_buckets[b + 1] - m_buckets[b];
+	}
+
+	std::vector<uint64_t> postings(uint32_t b) const
+	{
+		std::vector<uint64_t> ret;
+		const uint8_t* p = m_postings + m_buckets[b];
+		const uint8_t* end = m_postings + m_buckets[b + 1];
+		uint64_t prev = 0;
+		while (p < end) {
+			uint64_t v = 0;
+			for (int shift = 0; p < end; shift += 7) {
+				uint8_t byte = *p++;
+				v |= (uint64_t)(byte & 0x7f) << shift;
+				if (!(byte & 0x80)) break;
+			}
+			prev += v;
+			ret.push_back(prev - 1);
+		}
+		return ret;
+	}
+
+	mmapbuf m_map;
+	header m_header;
+	std::vector<file_entry> m_files;
+	const uint64_t* m_buckets = nullptr;
+	const uint8_t* m_postings = nullptr;
+};
@@ -1,10 +1,11 @@
 #include <algorithm>
+#include <chrono>
 #include <climits>
 #include <cstdint>
 #include <cstring>
+#include <deque>
 #include <ctype.h>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
 #include <list>
 #include <memory>
@@ -14,38 +15,222 @@
 #include <vector>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 
 #include "buffer.h"
+#include "approx_needle.h"
+#include "index.h"
+#include "masked_needle.h"
+#include "multi_needle.h"
+#include "output.h"
+#include "parallel.h"
+#include "range_needle.h"
+#include "regex.h"
+#include "replace.h"
+#include "stats.h"
+#include "stream.h"
+#include "walk.h"
+
+/*
+ * Count allocations for --stats. Replacing operator new is the only way to
+ * see every one; with stats off it costs a test of a null pointer.
+ */
+void* operator new(std::size_t size)
+{
+	if (search_stats* stats = search_stats::active()) {
+		++stats->allocations;
+	}
+	if (void* p = malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+// GCC can't tell these are the other half of the operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, std::size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
+
+/**
+ * What to print for each input.
+ */
+enum report_mode
+{
+	REPORT_MATCHES,       // Each match, with context
+	REPORT_COUNT,         // -c: how many matches there are
+	REPORT_FILES_WITH,    // -l: the name, if there are any matches
+	REPORT_FILES_WITHOUT, // -L: the name, if there aren't
+};
+
+/**
+ * How regular files are read (--io).
+ */
+enum io_mode
+{
+	IO_MMAP,   // Map the whole file
+	IO_URING,  // Chunks through io_uring, searched as they arrive
+	IO_DIRECT, // The same, with O_DIRECT to bypass the page cache
+	IO_PREAD,  // Chunks through pread
+};
+
+/**
+ * Whether, and how, to write search_stats to stderr at the end.
+ */
+enum stats_mode
+{
+	STATS_OFF,
+	STATS_TEXT, // --stats
+	STATS_JSON, // --stats=json
+};
 
 struct options
 {
 	std::string search_string;
 	std::unique_ptr<buffer> search_bytes;
+	std::vector<uint8_t> search_mask;           // Bits of each byte that must match; empty if all
+	std::string search_regex;                   // From -E
+	std::unique_ptr<needle> search_needle;
+	search_engine::kind engine;
+	std::vector<std::vector<uint8_t>> patterns; // From -f
+	std::vector<std::string> pattern_labels;
+	uint32_t max_distance;                      // From -k
+	std::vector<std::string> distance_labels;   // What to print after each -k match
+	std::string range_type;                     // From --u32le and so on, without the dashes
+	std::string range_spec;                     // Its lo..hi
+	uint64_t align;                             // From --align
 	std::list<std::string> input_files;
+	std::vector<std::string> recurse_roots;     // From -R
+	std::string index_path;                     // From --index
+	walk_filter filter;
 	int16_t context_before;
 	int16_t context_after;
+	uint32_t threads;
+	std::unique_ptr<std::vector<uint8_t>> replacement; // From -r; null when just searching
+	uint64_t max_count;                         // From -m
+	bool dry_run;
+	bool decompress;                            // Search inside gzip/xz/zstd inputs
+	report_mode report;
+	stats_mode stats;
+	io_mode io;
 };
 
-void save_file(const std::string& filename, const buffer& buf)
+void usage()
 {
-	std::ofstream outfile(filename, std::ios::out | std::ios::binary);
+	std::cerr << "Usage: gb [-s] <string> [<filename> <filename> ...] \n"
+			  << "   or: gb -b <byte#> <byte> [-b ...] [<filename> <filename> ...]\n"
+			  << "   or: gb -be <big-endian value> [<filename> <filename> ...]\n"
+			  << "   or: gb -le <little-endian value> [<filename> <filename> ...]\n"
+			  << "   or: gb -x <hex bytes> [<filename> <filename> ...]\n"
+			  << "   or: gb -f <pattern file> [<filename> <filename> ...]\n"
+			  << "   or: gb -E <regex> [<filename> <filename> ...]\n"
+			  << "   or: gb --<type> <lo>..<hi> [--align <num>] [<filename> <filename> ...]\n"
+			  << "   or: gb <search options> -R <directory> [-R ...]\n"
+			  << "   or: gb <search options> -r <string> | -rx <hex bytes> <filename> [<filename> ...]\n"
+			  << "   or: gb <search options> --index <index file>\n"
+			  << "   or: gb index build [-o <index file>] [--block-size <size>] <file or directory> ...\n"
+			  << "\n"
+			  << "In -x and -b bytes, ? matches any hex digit: -x \"7f ?? ?? 02\", -b 3 4?\n"
+			  << "-E takes bytes as \\xHH, sets like [\\x00-\\x1f], . for any byte, a|b, (...), * + ? and {n,m}\n"
+			  << "--<type> is u8, i8, u16, i16, u32, i32, u64, i64, f32 or f64, little-endian unless\n"
+			  << "followed by be: --u32be 0x1000..0x2000, --f64 3.14..3.15, --i16 -5..5, --u64 0x7f00..\n"
+			  << "\n"
+			  << "Options:\n"
+			  << "  -A <num>           Bytes of context to print after each match\n"
+			  << "  -B <num>           Bytes of context to print before each match\n"
+			  << "  -c                 Print how many matches each file has instead of the matches\n"
+			  << "  -l                 Print just the names of files with matches\n"
+			  << "  -L                 Print just the names of files without matches\n"
+			  << "  -k <num>           Also match with up to this many bytes different, printing how\n"
+			  << "                     many differ\n"
+			  << "  -m <num>           Stop after this many matches in each file (with -r, replace at most this many)\n"
+			  << "  --align <num>      With --<type>, only match values at multiples of this offset\n"
+			  << "  --dry-run          With -r, show what would be replaced without changing anything\n"
+			  << "  --include <glob>   With -R, only search files whose names match (may be repeated)\n"
+			  << "  --exclude <glob>   With -R, skip files and directories whose names match\n"
+			  << "  --min-size <size>  With -R, skip files smaller than this (K, M and G suffixes allowed)\n"
+			  << "  --max-size <size>  With -R, skip files larger than this\n"
+			  << "  --skip-symlinks    With -R, skip symlinks to files (symlinked directories are never followed)\n"
+			  << "  --skip-special     With -R, skip FIFOs, sockets and devices\n"
+			  << "  --index <file>     Search the files in an index built by gb index build, using it\n"
+			  << "                     to skip the parts that can't match\n"
+			  << "  -j <num>           Number of threads to search with (0 = one per core)\n"
+			  << "  --engine <name>    Search algorithm: auto, simd, short, horspool, twoway,\n"
+			  << "                     memmem\n"
+			  << "  --io <mode>        How to read files: mmap (the default), or in chunks searched as\n"
+			  << "                     they arrive, through uring, direct (O_DIRECT) or pread\n"
+			  << "  --no-decompress    Search gzip, xz and zstd files as they are, rather than what\n"
+			  << "                     they decompress to\n"
+			  << "  --stats[=json]     Write timings and counters for the search to stderr\n";
+}
 
-	if (!outfile) {
-		std::cerr << "Could not save file " << filename << "!\n";
-		return;
+/**
+ * Parse one line of a -f pattern file into the bytes to search for.
+ *
+ * Each line is written the way the pattern would be given on the command
+ * line: "-s <string>", "-be <value>", "-le <value>" or "-x <hex bytes>".
+ * Anything else is taken as a literal string.
+ */
+bool parse_pattern_line(const std::string& line, std::vector<uint8_t>& bytes)
+{
+	std::unique_ptr<buffer> buf;
+	if (line.starts_with("-s ")) {
+		buf = std::make_unique<strbuf>(line.substr(3));
+	} else if (line.starts_with("-be ")) {
+		buf = buffer_conversion::number_string_to_buffer(line.substr(4), true, true);
+	} else if (line.starts_with("-le ")) {
+		buf = buffer_conversion::number_string_to_buffer(line.substr(4), false, true);
+	} else if (line.starts_with("-x ")) {
+		buf = buffer_conversion::hex_string_to_buffer(line.substr(3));
+	} else {
+		buf = std::make_unique<strbuf>(line);
 	}
 
-	outfile.write((char*)&buf[0], buf.length());
-	outfile.close();
+	if (!buf || buf->length() == 0) {
+		return false;
+	}
+	bytes.assign(&(*buf)[0], &(*buf)[0] + buf->length());
+	return true;
 }
 
-void usage()
+/**
+ * Read a -f pattern file. Blank lines and lines starting with # are skipped.
+ */
+bool read_pattern_file(const std::string& filename, options& opts)
 {
-	std::cerr << "Usage: gb [-s] <string> [<filename> <filename> ...] \n"
-			  << "   or: gb -b <byte#> <byte> [-b ...] [<filename> <filename> ...]\n"
-			  << "   or: gb -be <big-endian value> [<filename> <filename> ...]\n"
-			  << "   or: gb -le <little-endian value> [<filename> <filename> ...]\n";
+	std::ifstream infile(filename);
+	if (!infile) {
+		std::cerr << "Could not read pattern file " << filename << '\n';
+		return false;
+	}
+
+	std::string line;
+	uint32_t lineno = 0;
+	while (std::getline(infile, line)) {
+		++lineno;
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		std::vector<uint8_t> bytes;
+		if (!parse_pattern_line(line, bytes)) {
+			std::cerr << filename << ':' << lineno << ": invalid pattern \"" << line << "\"\n";
+			return false;
+		}
+		opts.patterns.push_back(std::move(bytes));
+		opts.pattern_labels.push_back(line);
+	}
+
+	if (opts.patterns.empty()) {
+		std::cerr << "No patterns in " << filename << '\n';
+		return false;
+	}
+	return true;
 }
 
 bool get_window_dimensions(uint32_t& rows, uint32_t& cols)
@@ -60,7 +245,7 @@ bool get_window_dimensions(uint32_t& rows, uint32_t& cols)
 	return true;
 }
 
-uint32_t get_default_context_len(uint32_t needle_len)
+uint32_t get_default_context_len(uint64_t needle_len)
 {
 	uint32_t rows, cols;
 	if (!get_window_dimensions(rows, cols)) {
@@ -71,16 +256,77 @@ uint32_t get_default_context_len(uint32_t needle_len)
 	// There's two contexts (before and after) for an additional /2
 	// 17 characters of "slush"
 	// Extra -1 in there because sometimes the numbers don't divide evenly
+	// Needles too long for the line, or with no longest match, get none
+	if (needle_len > cols || 17 + 4 + needle_len * 4 > cols) {
+		return 0;
+	}
 	return ((((cols - 17 - (needle_len * 4)) / 4) - 1) / 2);
 }
 
+bool has_wildcards(const std::vector<uint8_t>& mask)
+{
+	return std::any_of(mask.begin(), mask.end(), [](uint8_t m) { return m != 0xff; });
+}
+
+/**
+ * Parse the byte given to -b: one or two hex digits, optionally prefixed by
+ * 0x, where '?' is a wildcard digit.
+ */
+bool parse_hex_byte(std::string str, std::vector<uint8_t>& byte, std::vector<uint8_t>& mask)
+{
+	if (str.starts_with("0x") || str.starts_with("0X")) {
+		str = str.substr(2);
+	}
+	if (str.length() == 1) {
+		str = (str == "?" ? "?" : "0") + str;
+	}
+	return str.length() == 2 && buffer_conversion::hex_string_to_masked(str, byte, mask);
+}
+
+/**
+ * Parse a size in bytes, optionally followed by K, M or G.
+ */
+bool parse_size(const std::string& str, uint64_t& size)
+{
+	std::stringstream ss(str);
+	ss >> std::dec >> size;
+	if (!ss) {
+		return false;
+	}
+
+	char suffix;
+	if (!(ss >> suffix)) {
+		return true;
+	}
+	switch (toupper(suffix)) {
+	case 'K': size <<= 10; break;
+	case 'M': size <<= 20; break;
+	case 'G': size <<= 30; break;
+	default: return false;
+	}
+	return ss.peek() == EOF;
+}
+
 bool get_opts(int argc, char** argv, options& opts)
 {
 	bool got_needle = false;
 	opts.context_before = -1;
 	opts.context_after = -1;
+	opts.engine = search_engine::AUTO;
+	opts.threads = 1;
+	opts.max_count = UINT64_MAX;
+	opts.max_distance = 0;
+	opts.align = 1;
+	opts.dry_run = false;
+	opts.decompress = true;
+	opts.report = REPORT_MATCHES;
+	opts.stats = STATS_OFF;
+	opts.io = IO_MMAP;
 	std::vector<uint8_t> needle_bytes;
+	std::vector<uint8_t> needle_mask;
 	std::string needle_string;
+	range_needle::value_type range_type;
+	bool range_big_endian;
 
 	for (int i = 1; i < argc; ++i) {
 		if (argv[i][0] == '-') {
@@ -100,14 +346,18 @@ bool get_opts(int argc, char** argv, options& opts)
 					if (++i == argc) {
 						return false;
 					}
-					ss.str(argv[i]);
-					ss.clear();
-					uint32_t byte;
-					ss >> std::hex >> byte;
+					std::vector<uint8_t> byte, mask;
+					if (!parse_hex_byte(argv[i], byte, mask)) {
+						std::cerr << "Invalid byte " << argv[i] << '\n';
+						return false;
+					}
+					// Bytes that aren't given are wildcards
 					if (needle_bytes.size() < (idx + 1)) {
 						needle_bytes.resize(idx + 1);
+						needle_mask.resize(idx + 1);
 					}
-					needle_bytes[idx] = byte;
+					needle_bytes[idx] = byte[0];
+					needle_mask[idx] = mask[0];
 					got_needle = true;
 				} else if (argv[i][2] == 'e' && argv[i][3] == '\0') { // -be
 					if (++i == argc) {
@@ -128,7 +378,9 @@ bool get_opts(int argc, char** argv, options& opts)
 				}
 			break;
 			case 'l':
-				if (argv[i][2] == 'e' && argv[i][3] == '\0') {
+				if (argv[i][2] == '\0') { // -l
+					opts.report = REPORT_FILES_WITH;
+				} else if (argv[i][2] == 'e' && argv[i][3] == '\0') {
 					if (++i == argc) {
 						std::cerr << "-be requires an argument\n";
 						return false;
@@ -146,6 +398,67 @@ bool get_opts(int argc, char** argv, options& opts)
 					return false;
 				}
 			break;
+			case 'x':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-x requires an argument\n";
+						return false;
+					}
+					if (got_needle) {
+						std::cerr << "Only one search pattern can be specified\n";
+						return false;
+					}
+					std::vector<uint8_t> bytes, mask;
+					if (!buffer_conversion::hex_string_to_masked(argv[i], bytes, mask)) {
+						std::cerr << "Invalid hex string " << argv[i] << '\n';
+						return false;
+					}
+					opts.search_bytes = std::make_unique<arraybuf>(bytes);
+					if (has_wildcards(mask)) {
+						opts.search_mask = mask;
+					}
+					got_needle = true;
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			case 'E':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-E requires an argument\n";
+						return false;
+					}
+					if (got_needle) {
+						std::cerr << "Only one search pattern can be specified\n";
+						return false;
+					}
+					opts.search_regex = argv[i];
+					got_needle = true;
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			case 'f':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-f requires an argument\n";
+						return false;
+					}
+					if (got_needle) {
+						std::cerr << "Only one search pattern can be specified\n";
+						return false;
+					}
+					if (!read_pattern_file(argv[i], opts)) {
+						return false;
+					}
+					got_needle = true;
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
 			case 's':
 				if (argv[i][2] == '\0') {
 					if (++i == argc || needle_bytes.size() > 0 || !needle_string.empty()) {
@@ -159,8 +472,205 @@ bool get_opts(int argc, char** argv, options& opts)
 				got_needle = true;
 			break;
 			//
+			// Replacing
+			//
+			case 'r':
+				if (argv[i][2] == '\0' || (argv[i][2] == 'x' && argv[i][3] == '\0')) { // -r, -rx
+					bool hex = argv[i][2] == 'x';
+					if (++i == argc) {
+						std::cerr << argv[i - 1] << " requires an argument\n";
+						return false;
+					}
+					if (hex) {
+						std::unique_ptr<buffer> buf = buffer_conversion::hex_string_to_buffer(argv[i]);
+						if (!buf) {
+							std::cerr << "Invalid hex string " << argv[i] << '\n';
+							return false;
+						}
+						std::span<const uint8_t> bytes = buf->span();
+						opts.replacement = std::make_unique<std::vector<uint8_t>>(bytes.begin(), bytes.end());
+					} else {
+						opts.replacement = std::make_unique<std::vector<uint8_t>>(argv[i], argv[i] + strlen(argv[i]));
+					}
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			case 'k':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-k requires an argument\n";
+						return false;
+					}
+					std::stringstream ss(argv[i]);
+					ss >> std::dec >> opts.max_distance;
+					if (!ss || !ss.eof()) {
+						std::cerr << "Invalid distance " << argv[i] << '\n';
+						return false;
+					}
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			case 'm':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-m requires an argument\n";
+						return false;
+					}
+					std::stringstream ss(argv[i]);
+					ss >> std::dec >> opts.max_count;
+					if (!ss || !ss.eof()) {
+						std::cerr << "Invalid count " << argv[i] << '\n';
+						return false;
+					}
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			//
+			// Performance options
+			//
+			case 'R':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-R requires an argument\n";
+						return false;
+					}
+					opts.recurse_roots.emplace_back(argv[i]);
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			case 'j':
+				if (argv[i][2] == '\0') {
+					if (++i == argc) {
+						std::cerr << "-j requires an argument\n";
+						return false;
+					}
+					std::stringstream ss(argv[i]);
+					ss >> std::dec >> opts.threads;
+					if (!ss || !ss.eof()) {
+						std::cerr << "Invalid thread count " << argv[i] << '\n';
+						return false;
+					}
+					if (opts.threads == 0) {
+						opts.threads = std::max(1u, std::thread::hardware_concurrency());
+					}
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			//
+			// Long options
+			//
+			case '-':
+				if (strcmp(argv[i], "--engine") == 0) {
+					if (++i == argc) {
+						std::cerr << "--engine requires an argument\n";
+						return false;
+					}
+					if (!search_engine::parse_kind(argv[i], opts.engine)) {
+						std::cerr << "Unknown search engine " << argv[i] << '\n';
+						return false;
+					}
+				} else if (strcmp(argv[i], "--index") == 0) {
+					if (++i == argc) {
+						std::cerr << "--index requires an argument\n";
+						return false;
+					}
+					opts.index_path = argv[i];
+				} else if (strcmp(argv[i], "--align") == 0) {
+					if (++i == argc) {
+						std::cerr << "--align requires an argument\n";
+						return false;
+					}
+					if (!parse_size(argv[i], opts.align) || opts.align == 0 || (opts.align & (opts.align - 1)) != 0) {
+						std::cerr << "--align must be a power of two\n";
+						return false;
+					}
+				} else if (range_needle::parse_type(argv[i] + 2, range_type, range_big_endian)) {
+					if (++i == argc) {
+						std::cerr << argv[i - 1] << " requires an argument\n";
+						return false;
+					}
+					if (got_needle) {
+						std::cerr << "Only one search pattern can be specified\n";
+						return false;
+					}
+					opts.range_type = argv[i - 1] + 2;
+					opts.range_spec = argv[i];
+					got_needle = true;
+				} else if (strcmp(argv[i], "--dry-run") == 0) {
+					opts.dry_run = true;
+				} else if (strcmp(argv[i], "--no-decompress") == 0) {
+					opts.decompress = false;
+				} else if (strcmp(argv[i], "--io") == 0) {
+					if (++i == argc) {
+						std::cerr << "--io requires an argument\n";
+						return false;
+					}
+					const std::string mode = argv[i];
+					if (mode == "mmap") {
+						opts.io = IO_MMAP;
+					} else if (mode == "uring") {
+						opts.io = IO_URING;
+					} else if (mode == "direct") {
+						opts.io = IO_DIRECT;
+					} else if (mode == "pread") {
+						opts.io = IO_PREAD;
+					} else {
+						std::cerr << "Unknown --io mode " << mode << '\n';
+						return false;
+					}
+				} else if (strcmp(argv[i], "--stats") == 0) {
+					opts.stats = STATS_TEXT;
+				} else if (strcmp(argv[i], "--stats=json") == 0) {
+					opts.stats = STATS_JSON;
+				} else if (strcmp(argv[i], "--include") == 0 || strcmp(argv[i], "--exclude") == 0) {
+					const char* opt = argv[i];
+					if (++i == argc) {
+						std::cerr << opt << " requires an argument\n";
+						return false;
+					}
+					(opt[2] == 'i' ? opts.filter.include : opts.filter.exclude).push_back(argv[i]);
+				} else if (strcmp(argv[i], "--min-size") == 0 || strcmp(argv[i], "--max-size") == 0) {
+					const char* opt = argv[i];
+					if (++i == argc) {
+						std::cerr << opt << " requires an argument\n";
+						return false;
+					}
+					uint64_t& size = opt[3] == 'i' ? opts.filter.min_size : opts.filter.max_size;
+					if (!parse_size(argv[i], size)) {
+						std::cerr << "Invalid size " << argv[i] << '\n';
+						return false;
+					}
+				} else if (strcmp(argv[i], "--skip-symlinks") == 0) {
+					opts.filter.skip_symlinks = true;
+				} else if (strcmp(argv[i], "--skip-special") == 0) {
+					opts.filter.skip_special = true;
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
+			//
 			// Display options
 			//
+			case 'c':
+			case 'L':
+				if (argv[i][2] == '\0') { // -c, -L
+					opts.report = argv[i][1] == 'c' ? REPORT_COUNT : REPORT_FILES_WITHOUT;
+				} else {
+					std::cerr << "Unrecognized option " << argv[i] << '\n';
+					return false;
+				}
+			break;
 			case 'A':
 			case 'B':
 				if (argv[i][2] == '\0') { // -B, -A
@@ -200,127 +710,793 @@ bool get_opts(int argc, char** argv, options& opts)
 
 	if (!needle_bytes.empty()) {
 		opts.search_bytes = std::make_unique<arraybuf>(needle_bytes);
+		if (has_wildcards(needle_mask)) {
+			opts.search_mask = needle_mask;
+		}
 	} else if (!needle_string.empty()) {
 		opts.search_bytes = std::make_unique<strbuf>(needle_string);
 	}
 	return got_needle;
 }
 
-void print_match(const buffer& buf,
-                 uint32_t offset,
-                 uint32_t needle_len,
-                 int16_t context_before,
-                 int16_t context_after)
+/**
+ * With several patterns, says which one matched.
+ */
+const std::string& pattern_label(const options& opts, const needle_match& m)
 {
-	const char red_on[] = "\x1B[31m";
-	const char red_off[] = "\033[0m";
+	static const std::string none;
+	if (!opts.distance_labels.empty()) {
+		return opts.distance_labels[m.distance];
+	}
+	return opts.pattern_labels.empty() ? none : opts.pattern_labels[m.pattern];
+}
 
-	int16_t default_context_len = get_default_context_len(needle_len);
-	if (context_before < 0) {
-		context_before = default_context_len;
+/**
+ * The most matches worth finding in each file: -l and -L only need one.
+ */
+uint64_t match_limit(const options& opts)
+{
+	if (opts.report == REPORT_FILES_WITH || opts.report == REPORT_FILES_WITHOUT) {
+		return std::min<uint64_t>(opts.max_count, 1);
 	}
-	if (context_after < 0) {
-		context_after = default_context_len;
+	return opts.max_count;
+}
+
+/**
+ * For -c, -l and -L, write what a search of @name found once it's done.
+ * With @show_name, counts are labelled with the file they're for.
+ */
+void report_count(const options& opts, const std::string& name, bool show_name, uint64_t count, output_writer& out)
+{
+	// Every search ends up here, whatever's printed
+	if (search_stats* stats = search_stats::active()) {
+		stats->matches += count;
 	}
 
-	uint32_t len = context_before + context_after + needle_len;
-	uint32_t start = offset;
-	if (start > (uint16_t)context_before) {
-		start -= context_before;
-	} else {
-		start = 0;
+	const std::string& label = name == "-" ? "(standard input)" : name;
+	switch (opts.report) {
+	case REPORT_COUNT:
+		out.write((show_name ? label + ":" : "") + std::to_string(count) + "\n");
+		break;
+	case REPORT_FILES_WITH:
+		if (count > 0) {
+			out.write(label + "\n");
+		}
+		break;
+	case REPORT_FILES_WITHOUT:
+		if (count == 0) {
+			out.write(label + "\n");
+		}
+		break;
+	case REPORT_MATCHES:
+		break;
 	}
+}
 
-	// A line should look like:
-	// <offset>:  <context-before><match><context-after>    | ASCII........  |
-	std::cout << std::hex << std::setw(8) << std::setfill(' ') << start << ":  ";
-	for (uint32_t i = start; i < start + len; ++i) {
-		if (i >= buf.length()) {
-			break;
+/**
+ * A visitor that counts the matches in @buf into @count, printing them to
+ * @out if they're to be printed, and stops at the -m limit.
+ */
+match_visitor counting_visitor(const options& opts, const match_printer& printer, const buffer& buf,
+                               output_writer& out, uint64_t& count)
+{
+	const uint64_t limit = match_limit(opts);
+	return [&opts, &printer, &buf, &out, &count, limit](const needle_match& m) {
+		if (opts.report == REPORT_MATCHES) {
+			printer.print(out, buf, m.offset, m.length, 0, pattern_label(opts, m));
 		}
-		if (i == offset) {
-			std::cout << red_on;
+		return ++count < limit && !out.failed();
+	};
+}
+
+/**
+ * Read the first few bytes of @fd, enough for decoder::detect(). Regular
+ * files are read without moving the file offset; anything else can't be,
+ * so the bytes returned have been taken from the stream.
+ */
+std::vector<uint8_t> read_magic(int fd, bool regular)
+{
+	std::vector<uint8_t> header(decoder::magic_len);
+	uint64_t len = 0;
+	while (len < header.size()) {
+		ssize_t n = regular ? pread(fd, &header[len], header.size() - len, len)
+		                    : read(fd, &header[len], header.size() - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
-		std::cout << std::hex << std::setw(2) << std::setfill('0') << (int)buf[i] << ' ';
-		if (i == offset + needle_len - 1) {
-			std::cout << red_off;
+		if (n <= 0) {
+			break;
 		}
+		len += n;
 	}
+	header.resize(len);
+	return header;
+}
 
-	std::cout << "   | ";
+/**
+ * Whether the file at @path is compressed in a format gb can search inside.
+ */
+bool is_compressed(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	std::vector<uint8_t> header = read_magic(fd, true);
+	close(fd);
+	return decoder::supported(decoder::detect(header.data(), header.size()));
+}
 
-	// Now do it again to print the ASCII representation...
-	for (uint32_t i = start; i < start + len; ++i) {
-		if (i >= buf.length()) {
-			break;
+/**
+ * Say so if @filename is compressed in a @format this build can't
+ * decompress, since it's then searched as the bytes it's stored as.
+ */
+void warn_undecodable(const std::string& filename, compression format)
+{
+	if (format == COMPRESSION_NONE || decoder::supported(format)) {
+		return;
+	}
+	std::cerr << (filename == "-" ? "stdin" : filename)
+	          << " is zstd-compressed, but gb was built without zstd (make ZSTD=1); searching the compressed bytes\n";
+}
+
+/**
+ * Whether @path can be searched a second time, and give the same result.
+ * Stdin, pipes and devices can't.
+ */
+bool rereadable(const std::string& path)
+{
+	struct stat st;
+	return path != "-" && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * Why a regex whose matches can be any length can't search @what: it's read
+ * as a stream, and a match could reach back to the start of it, so all of it
+ * would have to be held in memory.
+ */
+std::string unbounded_stream_error(const options& opts, const std::string& what)
+{
+	return "Regex " + opts.search_regex + " can match any number of bytes, so it can't search " + what
+	       + " (read as a stream); bound its *, + and {n,} repeats with {n,m} instead";
+}
+
+/**
+ * Search one input file ("-" for stdin), writing the matches to @out if
+ * they're to be printed, and counting them into @count. The search stops
+ * as soon as the -m limit is reached, or at the first match for -l and -L.
+ *
+ * Returns 0 on success, or the exit code to stop with if the input couldn't
+ * be read.
+ */
+int search_input(const std::string& filename, const options& opts, thread_pool* pool, output_writer& out,
+                 uint64_t& count)
+{
+	match_printer printer(opts.context_before, opts.context_after);
+	const uint64_t limit = match_limit(opts);
+	count = 0;
+	if (limit == 0) {
+		return 0;
+	}
+
+	search_stats* stats = search_stats::active();
+	if (stats) {
+		++stats->files;
+	}
+
+	// Map regular files, unless --io says to read them in chunks
+	std::unique_ptr<mmapbuf> buf;
+	if (filename != "-" && opts.io == IO_MMAP) {
+		search_stats::timer timer(&search_stats::map_ns);
+		buf = std::make_unique<mmapbuf>(filename);
+	}
+	if (buf && buf->length() > 0 && opts.decompress) {
+		const compression format = decoder::detect(&(*buf)[0], buf->length());
+		if (decoder::supported(format)) {
+			// Compressed, so it has to be decompressed as a stream
+			buf.reset();
+		} else {
+			warn_undecodable(filename, format);
 		}
-		if (i == offset) {
-			std::cout << red_on;
+	}
+
+	if (!buf || buf->length() == 0) {
+		// Anything we can't map (stdin, pipes, devices, compressed files...)
+		// gets searched a chunk at a time as it's read
+		int fd = STDIN_FILENO;
+		if (filename != "-") {
+			fd = open(filename.c_str(), O_RDONLY);
 		}
-		if (isprint(buf[i])) {
-			std::cout << std::setw(0) << (char)buf[i];
-		} else {
-			std::cout << std::setw(0) << '.';
+		uint64_t total = UINT64_MAX;
+		uint64_t loaded = 0;
+		if (fd >= 0) {
+			search_stats::timer timer(&search_stats::search_ns);
+			stream_search search(*opts.search_needle, opts.context_before, opts.context_after);
+			auto report = [&](const buffer& window, uint64_t window_offset, const needle_match& m) {
+				if (opts.report == REPORT_MATCHES) {
+					printer.print(out, window, m.offset, m.length, window_offset, pattern_label(opts, m));
+				}
+				if (++count == limit || out.failed()) {
+					search.stop();
+				}
+			};
+
+			struct stat st;
+			const bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+			std::vector<uint8_t> header;
+			if (opts.decompress) {
+				header = read_magic(fd, regular);
+			}
+			const compression format = decoder::detect(header.data(), header.size());
+			warn_undecodable(filename, format);
+			if (opts.search_needle->length() == needle::unbounded && !(regular && read_magic(fd, true).empty())) {
+				// Only an empty file has nothing to hold on to
+				if (fd != STDIN_FILENO) {
+					close(fd);
+				}
+				out.flush();
+				std::cerr << unbounded_stream_error(opts, filename == "-" ? "stdin" : filename) << '\n';
+				return -2;
+			}
+
+			if (decoder::supported(format)) {
+				// Regular files were only peeked at, so start them again
+				decompressing_reader reader(fd, format, regular ? std::vector<uint8_t>() : header);
+				total = search.run(reader, report);
+				loaded = reader.compressed_bytes();
+			} else if (regular && opts.io != IO_MMAP) {
+				if (opts.io == IO_DIRECT) {
+					// Not every filesystem can do O_DIRECT, in which case this
+					// fails and the reads go through the page cache
+					fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+				}
+				chunk_reader reader(fd, opts.io != IO_PREAD);
+				total = loaded = search.run(reader, report);
+			} else {
+				if (!regular) {
+					search.feed(header.data(), header.size(), report);
+				}
+				total = search.run(fd, report);
+				if (total != UINT64_MAX && !regular) {
+					total += header.size();
+				}
+				loaded = total;
+			}
+			if (fd != STDIN_FILENO) {
+				close(fd);
+			}
 		}
-		if (i == offset + needle_len - 1) {
-			std::cout << red_off;
+		if (total == UINT64_MAX) {
+			return -2;
+		}
+		if (stats) {
+			stats->bytes_loaded += loaded;
+			stats->bytes_scanned += total;
+		}
+		return 0;
+	}
+
+	if (stats) {
+		// Page the file in before searching it, or the time spent reading it
+		// would be counted as scanning
+		search_stats::timer timer(&search_stats::map_ns);
+		buf->populate();
+	}
+
+	search_stats::timer timer(&search_stats::search_ns);
+	if (stats) {
+		stats->bytes_loaded += buf->length();
+		stats->bytes_scanned += buf->length();
+	}
+
+	if (pool && opts.report != REPORT_MATCHES) {
+		// Nothing to print, so there's no need to gather offsets
+		parallel_search search(*pool);
+		if (limit == 1) {
+			count = search.first_match(*opts.search_needle, *buf) != UINT64_MAX;
+		} else {
+			count = search.count(*opts.search_needle, *buf, limit);
 		}
+		return 0;
 	}
 
-	std::cout << " |" << std::endl;
+	// Search the file, printing each match with context as it's found
+	match_visitor visit = counting_visitor(opts, printer, *buf, out, count);
+	if (pool) {
+		parallel_search(*pool).for_each_match(*opts.search_needle, *buf, visit);
+	} else if (opts.report != REPORT_MATCHES) {
+		count = opts.search_needle->count(*buf, limit);
+	} else {
+		opts.search_needle->for_each_match(*buf, visit);
+	}
+	return 0;
 }
 
-int main(int argc, char** argv)
+/**
+ * Replace the matches in each input file (-r), printing them as they're
+ * replaced and a count for each file.
+ *
+ * Returns 0 on success, or the exit code to stop with.
+ */
+int replace_inputs(const options& opts, output_writer& out)
 {
-	/*
-	 * TODO:
-	 *  - Find and replace
-	 *  - More flexible search terms / options
-	 *  - Turn buffer code into a separate library
-	 */
-	options opts;
+	match_printer printer(opts.context_before, opts.context_after);
+	replacer rep(*opts.search_needle, *opts.replacement, opts.patterns.empty() && opts.search_regex.empty(),
+	             opts.max_count, opts.dry_run);
 
-	if (!get_opts(argc, argv, opts)) {
-		usage();
-		return -1;
+	for (const std::string& filename : opts.input_files) {
+		if (filename == "-") {
+			out.flush();
+			std::cerr << "-r needs files to change; it can't replace in stdin\n";
+			return -1;
+		}
+		if (opts.input_files.size() > 1) {
+			out.write(filename + ":\n");
+		}
+
+		std::string error;
+		uint64_t count = rep.run(filename, [&](const buffer& buf, const needle_match& m) {
+			printer.print(out, buf, m.offset, m.length, 0, pattern_label(opts, m));
+		}, &error);
+		if (count == UINT64_MAX) {
+			out.flush();
+			std::cerr << "Could not " << (opts.dry_run ? "read" : "patch") << " file " << filename
+			          << (error.empty() ? "" : ": " + error) << std::endl;
+			return -2;
+		}
+		out.write((opts.dry_run ? "Would replace " : "Replaced ") + std::to_string(count)
+		          + (count == 1 ? " match in " : " matches in ") + filename + "\n");
 	}
+	return 0;
+}
 
-	if (opts.input_files.empty()) {
-		// Read from stdin
-		opts.input_files.push_back("-");
+/**
+ * The outcome of searching one file in the background. Its matches go
+ * through an ordered_output.
+ */
+struct search_result
+{
+	uint64_t count = 0;
+	int status = 0;
+};
+
+/**
+ * Files searched concurrently are kept at most this many per thread ahead
+ * of the one being printed, since each one's output is held in memory until
+ * its turn.
+ */
+const uint32_t files_ahead_per_thread = 2;
+
+/**
+ * Whether output needs to say which file it's from.
+ */
+bool several_inputs(const options& opts)
+{
+	return opts.input_files.size() > 1 || !opts.recurse_roots.empty() || !opts.index_path.empty();
+}
+
+/**
+ * Search the files named on the command line, writing each one's matches to
+ * @out in order.
+ *
+ * Returns 0 on success, or the exit code to stop with.
+ */
+int search_files(const options& opts, thread_pool* pool, output_writer& out)
+{
+	if (pool && opts.input_files.size() > 1) {
+		// Search the files concurrently, but print the results in order
+		std::atomic<bool> cancelled(false);
+		ordered_output ordered(out);
+		std::deque<std::future<search_result>> results;
+		auto next = opts.input_files.begin();
+		uint64_t submitted = 0;
+		auto submit_more = [&] {
+			while (next != opts.input_files.end() && results.size() < pool->size() * files_ahead_per_thread) {
+				results.push_back(pool->submit([&opts, pool, &cancelled, &ordered, seq = submitted++,
+				                                savefile = *next++] {
+					search_result result;
+					if (!cancelled) {
+						std::unique_ptr<output_writer> file_out = ordered.writer(seq, {}, rereadable(savefile));
+						result.status = search_input(savefile, opts, pool, *file_out, result.count);
+					}
+					return result;
+				}));
+			}
+		};
+		submit_more();
+
+		int status = 0;
+		uint64_t seq = 0;
+		for (auto name = opts.input_files.begin(); !results.empty(); ++name, ++seq) {
+			if (status == 0 && opts.report == REPORT_MATCHES) {
+				out.write(*name + ":\n");
+			}
+			if (status == 0) {
+				ordered.start(seq);
+			}
+			// Once something's failed, just wait for the tasks still running
+			search_result result = pool->wait(results.front());
+			results.pop_front();
+			if (!ordered.end(seq) && status == 0) {
+				// It printed too much to hold while waiting its turn, so
+				// search it again now that its output can go straight out
+				ordered.start(seq);
+				result.status = search_input(*name, opts, pool, *ordered.writer(seq), result.count);
+				ordered.end(seq);
+			}
+			if (status == 0) {
+				if (opts.report != REPORT_MATCHES && result.status == 0) {
+					report_count(opts, *name, true, result.count, out);
+				}
+				if (result.status != 0) {
+					out.flush();
+					std::cerr << "Could not read file " << *name << std::endl;
+					cancelled = true;
+					status = result.status;
+				}
+			}
+			submit_more();
+		}
+		return status;
 	}
 
 	// Go through each input file
 	for (const std::string& savefile : opts.input_files) {
-		if (opts.input_files.size() > 1) {
-			std::cout << savefile << ':' << std::endl;
+		if (opts.report == REPORT_MATCHES && several_inputs(opts)) {
+			out.write(savefile + ":\n");
+		}
+
+		uint64_t count;
+		int status = search_input(savefile, opts, pool, out, count);
+		if (status != 0) {
+			out.flush();
+			std::cerr << "Could not read file " << savefile << std::endl;
+			return status;
+		}
+		report_count(opts, savefile, several_inputs(opts), count, out);
+	}
+
+	return 0;
+}
+
+/**
+ * Search every file under the -R directories. Only files with matches are
+ * named in the output. Directories and files that can't be read are
+ * reported and skipped.
+ *
+ * Returns 0 on success, or the exit code for the last error.
+ */
+int search_trees(const options& opts, thread_pool* pool, output_writer& out)
+{
+	directory_walker<search_result> walker(opts.filter, pool, files_ahead_per_thread);
+	int status = 0;
+
+	for (const std::string& root : opts.recurse_roots) {
+		// Only files with matches are named, so the name goes out with the
+		// first of them
+		ordered_output ordered(out);
+		walker.walk(root, [&](const std::filesystem::path& file, uint64_t seq) {
+			search_result result;
+			result.status = search_input(file.string(), opts, pool,
+			                             *ordered.writer(seq, file.string() + ":\n", rereadable(file)),
+			                             result.count);
+			return result;
+		}, [&](const std::filesystem::path& file, uint64_t seq, search_result& result) {
+			if (!ordered.end(seq)) {
+				// It printed too much to hold while waiting its turn, so
+				// search it again now that its output can go straight out
+				ordered.start(seq);
+				result.status = search_input(file.string(), opts, pool,
+				                             *ordered.writer(seq, file.string() + ":\n"), result.count);
+				ordered.end(seq);
+			}
+			if (result.status == 0) {
+				report_count(opts, file.string(), true, result.count, out);
+			} else {
+				out.flush();
+				std::cerr << "Could not read file " << file.string() << std::endl;
+				status = result.status;
+			}
+			return true;
+		}, [&](const std::filesystem::path& dir, const std::error_code& ec) {
+			out.flush();
+			std::cerr << "Could not read directory " << dir.string() << ": " << ec.message() << std::endl;
+			status = -2;
+		}, [&](const std::filesystem::path&, uint64_t seq) {
+			ordered.start(seq);
+		});
+	}
+	return status;
+}
+
+/**
+ * Search the files in the --index index. For a plain string of bytes, only
+ * the blocks the index says could hold a match are read. Files that have
+ * changed since the index was built are searched in full. Only files with
+ * matches are named in the output.
+ *
+ * Returns 0 on success, or the exit code for the last error.
+ */
+int search_index(const options& opts, thread_pool* pool, output_writer& out)
+{
+	std::unique_ptr<ngram_index> index = ngram_index::open(opts.index_path);
+	if (!index) {
+		std::cerr << "Could not read index " << opts.index_path << std::endl;
+		return -2;
+	}
+
+	// Wildcards, regexes, pattern files, -k and typed values can't be looked up, so they
+	// search everything
+	std::vector<uint64_t> blocks;
+	bool narrowed = false;
+	if (opts.patterns.empty() && opts.search_mask.empty() && opts.search_regex.empty() && opts.max_distance == 0
+	    && opts.range_type.empty()) {
+		std::span<const uint8_t> bytes = opts.search_bytes->span();
+		narrowed = index->candidates(bytes.data(), bytes.size(), blocks);
+	}
+
+	match_printer printer(opts.context_before, opts.context_after);
+	const std::vector<ngram_index::file_entry>& files = index->files();
+	int status = 0;
+	for (uint64_t f = 0; f < files.size(); ++f) {
+		const ngram_index::file_entry& entry = files[f];
+		struct stat st;
+		if (stat(entry.path.c_str(), &st) < 0) {
+			out.flush();
+			std::cerr << "Could not read file " << entry.path << std::endl;
+			status = -2;
+			continue;
 		}
+		const bool current = (uint64_t)st.st_size == entry.size && st.st_mtim.tv_sec == entry.mtime;
 
-		// Read the file
-		std::unique_ptr<buffer> buf;
+		output_writer file_out;
+		uint64_t count = 0;
+		// The index only knows the bytes compressed files are stored as
+		const bool whole = !narrowed || !current || (opts.decompress && is_compressed(entry.path));
+		if (whole) {
+			if (!current) {
+				out.flush();
+				std::cerr << entry.path << " has changed since the index was built; searching all of it\n";
+			}
+			if (search_input(entry.path, opts, pool, file_out, count) != 0) {
+				out.flush();
+				std::cerr << "Could not read file " << entry.path << std::endl;
+				status = -2;
+				continue;
+			}
+		} else {
+			// Don't even open files with nothing to check
+			const uint64_t next_file = f + 1 < files.size() ? files[f + 1].first_block : UINT64_MAX;
+			auto it = std::lower_bound(blocks.begin(), blocks.end(), entry.first_block);
+			if (it != blocks.end() && *it < next_file && match_limit(opts) > 0) {
+				search_stats::timer timer(&search_stats::search_ns);
+				mmapbuf buf(entry.path);
+				index->for_each_match(*opts.search_needle, f, buf, blocks,
+				                      counting_visitor(opts, printer, buf, file_out, count));
+			}
+		}
 
-		if (savefile == "-") {
-			buf = std::make_unique<arraybuf>(std::cin);
+		if (!file_out.contents().empty()) {
+			out.write(entry.path + ":\n");
+			out.write(file_out.contents());
+		}
+		report_count(opts, entry.path, true, count, out);
+	}
+	return status;
+}
+
+/**
+ * gb index build: index files, and the files under directories, for --index.
+ *
+ * Returns 0 on success, or the exit code to stop with.
+ */
+int build_index(int argc, char** argv)
+{
+	std::string index_path = "gb.idx";
+	uint64_t block_len = ngram_index::default_block_len;
+	std::vector<std::string> inputs;
+	for (int i = 3; i < argc; ++i) {
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			index_path = argv[++i];
+		} else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+			if (!parse_size(argv[++i], block_len) || block_len == 0) {
+				std::cerr << "Invalid size " << argv[i] << '\n';
+				return -1;
+			}
+		} else if (argv[i][0] == '-') {
+			std::cerr << "Unrecognized option " << argv[i] << '\n';
+			usage();
+			return -1;
 		} else {
-			buf = std::make_unique<arraybuf>(savefile);
+			inputs.emplace_back(argv[i]);
 		}
-		if (buf->length() == 0) {
-			std::cerr << "Could not read file " << savefile << std::endl;
-			return -2;
+	}
+	if (inputs.empty()) {
+		usage();
+		return -1;
+	}
+
+	// Files are indexed by absolute path, so the index can be used from
+	// anywhere
+	ngram_index::builder builder(block_len);
+	walk_filter filter;
+	filter.skip_special = true;
+	directory_walker<bool> walker(filter);
+	int status = 0;
+	for (const std::string& root : inputs) {
+		walker.walk(root, [](const std::filesystem::path&, uint64_t) {
+			return true;
+		}, [&](const std::filesystem::path& file, uint64_t, bool&) {
+			// Rebuilding an index in a tree it covers shouldn't index the
+			// old one
+			std::error_code ec;
+			if (std::filesystem::equivalent(file, index_path, ec)) {
+				return true;
+			}
+			if (!builder.add(std::filesystem::absolute(file).lexically_normal())) {
+				std::cerr << "Could not read file " << file.string() << std::endl;
+				status = -2;
+			}
+			return true;
+		}, [&](const std::filesystem::path& dir, const std::error_code& ec) {
+			std::cerr << "Could not read directory " << dir.string() << ": " << ec.message() << std::endl;
+			status = -2;
+		});
+	}
+
+	if (!builder.write(index_path)) {
+		std::cerr << "Could not write index " << index_path << std::endl;
+		return -2;
+	}
+	std::cout << "Indexed " << builder.file_count() << (builder.file_count() == 1 ? " file" : " files")
+	          << " into " << index_path << std::endl;
+	return status;
+}
+
+/**
+ * Run the search @opts describes.
+ *
+ * Returns the exit code.
+ */
+int search(options& opts)
+{
+	if (!opts.index_path.empty() && (!opts.input_files.empty() || !opts.recurse_roots.empty()
+	                                 || opts.replacement)) {
+		std::cerr << "--index searches the files in the index; it can't be used with other inputs or -r\n";
+		return -1;
+	}
+	if (opts.replacement && opts.report != REPORT_MATCHES) {
+		std::cerr << "-c, -l and -L can't be used with -r\n";
+		return -1;
+	}
+
+	if (opts.input_files.empty() && opts.recurse_roots.empty() && opts.index_path.empty()) {
+		// Read from stdin
+		opts.input_files.push_back("-");
+	}
+
+	if (opts.align != 1 && opts.range_type.empty()) {
+		std::cerr << "--align only works with a typed search such as --u32\n";
+		return -1;
+	}
+	if (opts.max_distance > 0 && (!opts.patterns.empty() || !opts.search_regex.empty()
+	                              || !opts.search_mask.empty() || !opts.range_type.empty())) {
+		std::cerr << "-k only works with a single string or run of bytes, without wildcards\n";
+		return -1;
+	}
+
+	if (!opts.patterns.empty()) {
+		opts.search_needle = std::make_unique<multi_needle>(opts.patterns);
+	} else if (!opts.search_regex.empty()) {
+		std::string error;
+		opts.search_needle = regex_needle::compile(opts.search_regex, error);
+		if (!opts.search_needle) {
+			std::cerr << "Invalid regex " << opts.search_regex << ": " << error << '\n';
+			return -1;
+		}
+	} else if (!opts.range_type.empty()) {
+		range_needle::value_type type;
+		bool big_endian;
+		range_needle::parse_type(opts.range_type, type, big_endian);
+		std::string error;
+		opts.search_needle = range_needle::create(type, big_endian, opts.range_spec, opts.align, error);
+		if (!opts.search_needle) {
+			std::cerr << "Invalid --" << opts.range_type << " range " << opts.range_spec << ": " << error << '\n';
+			return -1;
 		}
-		// Search the file
-		uint32_t needle_len = opts.search_bytes->length();
-		if (needle_len == 0) {
+	} else {
+		if (opts.search_bytes->length() == 0) {
 			std::cerr << "Null search string\n";
 			return -3;
 		}
-		std::list<uint32_t> offsets = buf->find_all(*opts.search_bytes);
+		if (!opts.search_mask.empty()) {
+			std::span<const uint8_t> bytes = opts.search_bytes->span();
+			opts.search_needle = std::make_unique<masked_needle>(
+				std::vector<uint8_t>(bytes.begin(), bytes.end()), opts.search_mask);
+		} else if (opts.max_distance > 0) {
+			std::span<const uint8_t> bytes = opts.search_bytes->span();
+			auto approx = std::make_unique<approx_needle>(std::vector<uint8_t>(bytes.begin(), bytes.end()),
+			                                              opts.max_distance);
+			for (uint32_t d = 0; d <= approx->max_distance(); ++d) {
+				opts.distance_labels.push_back("distance " + std::to_string(d));
+			}
+			opts.search_needle = std::move(approx);
+		} else {
+			opts.search_needle = std::make_unique<buffer_needle>(*opts.search_bytes, opts.engine);
+		}
+	}
+	uint64_t needle_len = opts.search_needle->length();
+
+	// Settle the context lengths once, since streamed input needs to know
+	// how much of the stream to hold on to
+	if (opts.context_before < 0) {
+		opts.context_before = get_default_context_len(needle_len);
+	}
+	if (opts.context_after < 0) {
+		opts.context_after = get_default_context_len(needle_len);
+	}
 
-		// Print each output with context
-		for (uint32_t offset : offsets) {
-			print_match(*buf, offset, needle_len, opts.context_before, opts.context_after);
+	if (opts.replacement) {
+		if (!opts.recurse_roots.empty()) {
+			std::cerr << "-r can't be used with -R\n";
+			return -1;
 		}
+		output_writer out(STDOUT_FILENO);
+		return replace_inputs(opts, out);
 	}
 
-	return 0;
+	if (needle_len == needle::unbounded) {
+		const bool from_stdin = std::find(opts.input_files.begin(), opts.input_files.end(), "-")
+		                        != opts.input_files.end();
+		if (from_stdin || opts.io != IO_MMAP) {
+			std::cerr << unbounded_stream_error(opts, from_stdin ? "stdin" : "files read with --io") << '\n';
+			return -1;
+		}
+	}
+
+	// Only spin up threads if we're going to use them
+	std::unique_ptr<thread_pool> pool;
+	if (opts.threads > 1) {
+		pool = std::make_unique<thread_pool>(opts.threads);
+	}
+
+	output_writer out(STDOUT_FILENO);
+
+	if (!opts.index_path.empty()) {
+		return search_index(opts, pool.get(), out);
+	}
+
+	int status = search_files(opts, pool.get(), out);
+	if (status != 0) {
+		return status;
+	}
+	return search_trees(opts, pool.get(), out);
+}
+
+int main(int argc, char** argv)
+{
+	/*
+	 * TODO:
+	 *  - Turn buffer code into a separate library
+	 */
+	if (argc >= 3 && strcmp(argv[1], "index") == 0 && strcmp(argv[2], "build") == 0) {
+		return build_index(argc, argv);
+	}
+
+	options opts;
+
+	if (!get_opts(argc, argv, opts)) {
+		usage();
+		return -1;
+	}
+	if (opts.stats != STATS_OFF) {
+		search_stats::enable();
+		const auto start = std::chrono::steady_clock::now();
+		int status = search(opts);
+		const auto wall = std::chrono::steady_clock::now() - start;
+		search_stats::active()->write(std::cerr, std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count(),
+		                              opts.stats == STATS_JSON);
+		return status;
+	}
+	return search(opts);
 }
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "buffer.h"
+#include "simd.h"
+
+/**
+ * A needle with wildcards: each byte comes with a mask saying which of its
+ * bits have to match, so whole bytes (??) or single nibbles (4?) can be
+ * left unknown.
+ *
+ * Candidates are found with the SIMD two-anchor filter, using the most
+ * specific bytes of the pattern as anchors, and checked by ANDing a vector
+ * of the haystack with the mask and comparing it to the pattern.
+ */
+class masked_needle : public needle
+{
+public:
+	/**
+	 * @bytes and @mask must be the same length. Bits of @bytes outside the
+	 * mask are ignored.
+	 */
+	masked_needle(const std::vector<uint8_t>& bytes, const std::vector<uint8_t>& mask) :
+		m_bytes(bytes),
+		m_mask(mask),
+		m_pattern(nullptr, nullptr, 0)
+	{
+		m_mask.resize(m_bytes.size(), 0xff);
+		for (uint64_t i = 0; i < m_bytes.size(); ++i) {
+			m_bytes[i] &= m_mask[i];
+		}
+		m_pattern = simd_search::masked_pattern(m_bytes.data(), m_mask.data(), m_bytes.size());
+	}
+
+	masked_needle(const masked_needle& other) = delete;
+	masked_needle& operator=(const masked_needle& rhs) = delete;
+
+	virtual uint64_t length() const override { return m_bytes.size(); }
+
+	const std::vector<uint8_t>& bytes() const { return m_bytes; }
+	const std::vector<uint8_t>& mask() const { return m_mask; }
+
+	virtual uint64_t first_match(const buffer& haystack, uint64_t start = 0) const override
+	{
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			return simd_search::find_masked(hay.data(), hay.size(), m_pattern, start);
+		}
+		return find_bytewise(haystack, start);
+	}
+
+	virtual bool for_each_match(const buffer& haystack, const match_visitor& visit, uint64_t start = 0) const override
+	{
+		auto report = [&](uint64_t offset) {
+			return visit({ offset, m_pattern.len, 0 });
+		};
+
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			return buffer::visit_each([&](uint64_t from) {
+				return simd_search::find_masked(hay.data(), hay.size(), m_pattern, from);
+			}, report, start);
+		}
+		return buffer::visit_each([&](uint64_t from) {
+			return find_bytewise(haystack, from);
+		}, report, start);
+	}
+
+private:
+	/**
+	 * For buffers that aren't contiguous.
+	 */
+	uint64_t find_bytewise(const buffer& haystack, uint64_t start) const
+	{
+		const uint64_t len = haystack.length();
+		const uint64_t needle_len = m_bytes.size();
+		if (needle_len == 0 || needle_len > len) {
+			return UINT64_MAX;
+		}
+
+		for (uint64_t i = start; i <= len - needle_len; ++i) {
+			uint64_t j = 0;
+			while (j < needle_len && (haystack[i + j] & m_mask[j]) == m_bytes[j]) {
+				++j;
+			}
+			if (j == needle_len) {
+				return i;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+	std::vector<uint8_t> m_bytes;
+	std::vector<uint8_t> m_mask;
+	simd_search::masked_pattern m_pattern;
+};
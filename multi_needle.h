@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <span>
+#include <vector>
+
+#include "buffer.h"
+
+/**
+ * A needle made of many patterns, all searched for in a single pass.
+ *
+ * The patterns are compiled into an Aho-Corasick automaton, stored as a
+ * dense transition table (so each haystack byte costs one table lookup no
+ * matter how many patterns there are). To keep the table small, bytes that
+ * behave identically -- in particular every byte that appears in no pattern
+ * -- share a column.
+ *
+ * Each match reports the index of the pattern that matched, in the order the
+ * patterns were added.
+ */
+class multi_needle : public needle
+{
+public:
+	/**
+	 * Compile the patterns into an automaton. Empty patterns never match.
+	 */
+	multi_needle(const std::vector<std::vector<uint8_t>>& patterns) :
+		m_patterns(patterns),
+		m_max_len(0)
+	{
+		for (const auto& p : m_patterns) {
+			m_max_len = std::max<uint64_t>(m_max_len, p.size());
+		}
+		build();
+	}
+
+	uint32_t pattern_count() const { return m_patterns.size(); }
+
+	const std::vector<uint8_t>& pattern(uint32_t idx) const { return m_patterns[idx]; }
+
+	virtual uint64_t length() const override { return m_max_len; }
+
+	virtual uint64_t first_match(const buffer& haystack, uint64_t start = 0) const override
+	{
+		uint64_t first = UINT64_MAX;
+		for_each_match(haystack, [&](const needle_match& m) {
+			first = m.offset;
+			return false;
+		}, start);
+		return first;
+	}
+
+	virtual bool for_each_match(const buffer& haystack, const match_visitor& visit, uint64_t start = 0) const override
+	{
+		// The automaton finds matches in order of where they end, so hold
+		// each one back until no match that starts earlier can turn up:
+		// once we're m_max_len - 1 bytes past its start, that's everything.
+		auto later = [](const needle_match& a, const needle_match& b) {
+			return a.offset != b.offset ? a.offset > b.offset : a.pattern > b.pattern;
+		};
+		std::vector<needle_match> pending;
+		bool stopped = false;
+
+		auto flush = [&](uint64_t upto) {
+			while (!pending.empty() && pending.front().offset <= upto) {
+				std::pop_heap(pending.begin(), pending.end(), later);
+				if (!visit(pending.back())) {
+					return false;
+				}
+				pending.pop_back();
+			}
+			return true;
+		};
+
+		auto report = [&](uint64_t i, uint32_t idx) {
+			pending.push_back({ i + 1 - m_patterns[idx].size(), m_patterns[idx].size(), idx });
+			std::push_heap(pending.begin(), pending.end(), later);
+		};
+		auto step = [&](uint64_t i) {
+			if (pending.empty() || pending.front().offset + m_max_len > i + 1) {
+				return true;
+			}
+			stopped = !flush(i + 1 - m_max_len);
+			return !stopped;
+		};
+
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			scan(hay.data(), hay.size(), start, report, step);
+		} else {
+			scan(haystack, haystack.length(), start, report, step);
+		}
+
+		return !stopped && flush(UINT64_MAX);
+	}
+
+private:
+	void build()
+	{
+		// Assign each byte value that appears in a pattern its own class;
+		// everything else shares class 0.
+		uint32_t num_classes = 1;
+		for (uint16_t& cls : m_class) {
+			cls = 0;
+		}
+		for (const auto& p : m_patterns) {
+			for (uint8_t c : p) {
+				if (m_class[c] == 0) {
+					m_class[c] = num_classes++;
+				}
+			}
+		}
+		m_num_classes = num_classes;
+
+		// Build the trie. State 0 is the root.
+		m_delta.assign(num_classes, 0);
+		m_outputs.assign(1, {});
+		for (uint32_t idx = 0; idx < m_patterns.size(); ++idx) {
+			const auto& p = m_patterns[idx];
+			if (p.empty()) {
+				continue;
+			}
+			uint32_t state = 0;
+			for (uint8_t c : p) {
+				uint32_t& next = m_delta[state * num_classes + m_class[c]];
+				if (next == 0) {
+					next = m_outputs.size();
+					m_outputs.emplace_back();
+					m_delta.resize(m_delta.size() + num_classes, 0);
+				}
+				state = m_delta[state * num_classes + m_class[c]];
+			}
+			m_outputs[state].push_back(idx);
+		}
+
+		// Breadth-first, fill in failure transitions so the trie becomes a
+		// DFA, and merge each state's outputs with its failure state's.
+		std::vector<uint32_t> fail(m_outputs.size(), 0);
+		std::queue<uint32_t> todo;
+		for (uint32_t cls = 0; cls < num_classes; ++cls) {
+			uint32_t next = m_delta[cls];
+			if (next != 0) {
+				todo.push(next);
+			}
+		}
+		while (!todo.empty()) {
+			uint32_t state = todo.front();
+			todo.pop();
+			const auto& fail_out = m_outputs[fail[state]];
+			m_outputs[state].insert(m_outputs[state].end(), fail_out.begin(), fail_out.end());
+
+			for (uint32_t cls = 0; cls < num_classes; ++cls) {
+				uint32_t& next = m_delta[state * num_classes + cls];
+				uint32_t fail_next = m_delta[fail[state] * num_classes + cls];
+				if (next != 0) {
+					fail[next] = fail_next;
+					todo.push(next);
+				} else {
+					next = fail_next;
+				}
+			}
+		}
+
+		// Bytes that can take us out of the root state. While we're at the
+		// root we can skip straight over everything else.
+		for (uint32_t c = 0; c < 256; ++c) {
+			m_starts[c] = m_delta[m_class[c]] != 0;
+		}
+	}
+
+	/**
+	 * Run the automaton over the first @len bytes of @hay (a pointer to
+	 * contiguous bytes, or a buffer that isn't) from @start, calling @report with
+	 * the end offset and pattern index of every match.
+	 *
+	 * @step is called with each offset the automaton steps over, after any
+	 * matches ending there are reported, and stops the scan by returning
+	 * false.
+	 */
+	template<typename H, typename R, typename S>
+	void scan(const H& hay, uint64_t len, uint64_t start, R&& report, S&& step) const
+	{
+		if (m_max_len == 0 || start >= len) {
+			return;
+		}
+
+		const uint32_t* delta = m_delta.data();
+		uint32_t state = 0;
+
+		for (uint64_t i = start; i < len; ++i) {
+			if (state == 0) {
+				while (i < len && !m_starts[hay[i]]) {
+					++i;
+				}
+				if (i == len) {
+					break;
+				}
+			}
+
+			state = delta[state * m_num_classes + m_class[hay[i]]];
+			for (uint32_t idx : m_outputs[state]) {
+				report(i, idx);
+			}
+			if (!step(i)) {
+				break;
+			}
+		}
+	}
+
+	std::vector<std::vector<uint8_t>> m_patterns;
+	uint64_t m_max_len;
+
+	uint16_t m_class[256];
+	uint32_t m_num_classes;
+	bool m_starts[256];
+	std::vector<uint32_t> m_delta;                // [state * m_num_classes + class]
+	std::vector<std::vector<uint32_t>> m_outputs; // Patterns ending at each state
+};
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include "buffer.h"
+#include "stats.h"
+
+/**
+ * Collects output in one large buffer and hands it to the kernel with a
+ * single write(2) per flush, instead of going through iostreams a few bytes
+ * at a time.
+ *
+ * A writer made without a file descriptor just keeps everything in memory,
+ * for output that has to be held back and written out later in order. One
+ * made with a sink hands each flush to it instead.
+ */
+class output_writer
+{
+public:
+	static const uint64_t default_capacity = 1024 * 1024;
+
+	/**
+	 * Write to @fd, flushing whenever @capacity bytes have built up.
+	 */
+	output_writer(int fd, uint64_t capacity = default_capacity) :
+		m_fd(fd),
+		m_capacity(capacity),
+		m_failed(false),
+		m_buf(capacity),
+		m_len(0),
+		m_used(0)
+	{}
+
+	/**
+	 * Keep the output in memory; see contents().
+	 */
+	output_writer() :
+		output_writer(-1, 0)
+	{}
+
+	/**
+	 * Called with each flush's worth of output. Returning false fails the
+	 * writer, as a failed write would.
+	 */
+	using sink = std::function<bool(std::string_view data)>;
+
+	/**
+	 * Hand the output to @to whenever @capacity bytes have built up.
+	 */
+	output_writer(sink to, uint64_t capacity = default_capacity) :
+		output_writer(-1, capacity)
+	{
+		m_sink = std::move(to);
+	}
+
+	~output_writer()
+	{
+		flush();
+	}
+
+	output_writer(const output_writer& other) = delete;
+	output_writer& operator=(const output_writer& rhs) = delete;
+
+	void write(const char* data, uint64_t len)
+	{
+		// Don't copy anything too big to buffer
+		if (flushes() && len >= m_capacity) {
+			flush();
+			write_all(data, len);
+			return;
+		}
+		memcpy(reserve(len), data, len);
+		commit(len);
+	}
+
+	void write(std::string_view str) { write(str.data(), str.size()); }
+
+	/**
+	 * Get room for at least @len more bytes. Fill in as many as are needed
+	 * and then commit() them.
+	 */
+	char* reserve(uint64_t len)
+	{
+		if (flushes() && m_len + len > m_capacity) {
+			flush();
+		}
+		if (m_len + len > m_buf.size()) {
+			m_buf.resize(std::max<uint64_t>(m_buf.size() * 2, m_len + len));
+		}
+		m_used = m_len;
+		return m_buf.data() + m_len;
+	}
+
+	void commit(uint64_t len)
+	{
+		m_len = m_used + len;
+	}
+
+	/**
+	 * Write out everything buffered so far.
+	 *
+	 * Returns false if the write failed (now or on an earlier flush).
+	 */
+	bool flush()
+	{
+		if (!flushes()) {
+			return true;
+		}
+
+		write_all(m_buf.data(), m_len);
+		m_len = 0;
+		return !m_failed;
+	}
+
+	/**
+	 * Whether a write has failed, so there's no point writing any more.
+	 */
+	bool failed() const { return m_failed; }
+
+	/**
+	 * Everything written to an in-memory writer.
+	 */
+	std::string_view contents() const { return { m_buf.data(), m_len }; }
+
+private:
+	bool flushes() const { return m_fd >= 0 || m_sink; }
+
+	void write_all(const char* p, uint64_t left)
+	{
+		if (m_sink) {
+			if (left > 0 && !m_failed && !m_sink({ p, left })) {
+				m_failed = true;
+			}
+			return;
+		}
+		while (left > 0 && !m_failed) {
+			ssize_t n = ::write(m_fd, p, left);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				m_failed = true;
+				break;
+			}
+			p += n;
+			left -= n;
+		}
+	}
+
+	const int m_fd;
+	const uint64_t m_capacity;
+	bool m_failed;
+	std::vector<char> m_buf;
+	uint64_t m_len;  // Bytes of m_buf in use
+	uint64_t m_used; // m_len as of the last reserve()
+	sink m_sink;
+};
+
+/**
+ * Puts the output of tasks running concurrently in order, numbered from 0.
+ *
+ * Each task writes through its own writer(). Output for the task whose turn
+ * it is goes straight through to the real writer as it's flushed; the
+ * others' is held in memory until their turn comes. A task that gets more
+ * than @held_limit bytes ahead has its output dropped and its writer
+ * failed, so it can stop; it has to be run again when its turn comes (see
+ * end()). Memory use is then bounded by the number of tasks running ahead,
+ * however much they print.
+ */
+class ordered_output
+{
+public:
+	static const uint64_t default_held_limit = 8 * 1024 * 1024;
+
+	ordered_output(output_writer& out, uint64_t held_limit = default_held_limit) :
+		m_out(out),
+		m_held_limit(held_limit)
+	{}
+
+	/**
+	 * A writer for task @seq. If it writes anything at all, @header is
+	 * written just ahead of it. The writer must be destroyed (or flushed)
+	 * before the task's turn is over.
+	 *
+	 * With @may_drop false, the output is held however large it gets, for
+	 * tasks that can't be redone.
+	 */
+	std::unique_ptr<output_writer> writer(uint64_t seq, std::string header = {}, bool may_drop = true)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			slot& s = m_slots[seq];
+			s.header = std::move(header);
+			s.may_drop = may_drop;
+		}
+		return std::make_unique<output_writer>([this, seq](std::string_view data) {
+			std::lock_guard<std::mutex> lock(m_lock);
+			slot& s = m_slots[seq];
+			if (s.dropped) {
+				return false;
+			}
+			if (seq != m_turn && s.may_drop && s.held.size() + s.header.size() + data.size() > m_held_limit) {
+				s.dropped = true;
+				s.held = std::string();
+				return false;
+			}
+			if (!s.wrote) {
+				s.wrote = true;
+				emit(seq, s, s.header);
+			}
+			emit(seq, s, data);
+			return true;
+		});
+	}
+
+	/**
+	 * Give task @seq its turn, writing out whatever it's held back so far.
+	 * Turns have to be given in order, and the real writer mustn't be
+	 * written to directly until end().
+	 */
+	void start(uint64_t seq)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_turn = seq;
+		slot& s = m_slots[seq];
+		m_out.write(s.held);
+		s.held = std::string();
+	}
+
+	/**
+	 * Finish task @seq's turn, once it's done.
+	 *
+	 * Returns false if its output was dropped for getting too far ahead, in
+	 * which case none of it has been written: start() its turn again and
+	 * redo it with a new writer, which then writes straight through.
+	 */
+	bool end(uint64_t seq)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_turn = UINT64_MAX;
+		auto it = m_slots.find(seq);
+		if (it == m_slots.end()) {
+			return true;
+		}
+		const bool dropped = it->second.dropped;
+		m_slots.erase(it);
+		return !dropped;
+	}
+
+private:
+	struct slot
+	{
+		std::string header;
+		std::string held;     // Written before its turn came
+		bool wrote = false;   // Anything at all, so the header's been written
+		bool may_drop = true;
+		bool dropped = false; // Got too far ahead; see end()
+	};
+
+	void emit(uint64_t seq, slot& s, std::string_view data)
+	{
+		if (seq == m_turn) {
+			m_out.write(data);
+		} else {
+			s.held.append(data);
+		}
+	}
+
+	output_writer& m_out;
+	const uint64_t m_held_limit;
+	std::mutex m_lock;
+	std::unordered_map<uint64_t, slot> m_slots;
+	uint64_t m_turn = UINT64_MAX;
+};
+
+/**
+ * Two hex digits, and the printable character (or '.'), for each byte value.
+ */
+struct byte_text
+{
+	static constexpr char hex_digits[] = "0123456789abcdef";
+
+	constexpr byte_text() : hex(), ascii()
+	{
+		for (int i = 0; i < 256; ++i) {
+			hex[i * 2] = hex_digits[i >> 4];
+			hex[i * 2 + 1] = hex_digits[i & 0xf];
+			ascii[i] = (i >= 0x20 && i < 0x7f) ? i : '.';
+		}
+	}
+
+	char hex[512];
+	char ascii[256];
+};
+
+inline constexpr byte_text byte_text_table;
+
+/**
+ * Renders matches as hex dump lines:
+ *
+ *   <offset>:  <context-before><match><context-after>    | ASCII........  |
+ *
+ * with the match highlighted. Bytes are turned into text by table lookup, and
+ * each line is built straight into the writer's buffer.
+ */
+class match_printer
+{
+public:
+	match_printer(uint64_t context_before, uint64_t context_after) :
+		m_context_before(context_before),
+		m_context_after(context_after)
+	{}
+
+	/**
+	 * Print the match of @needle_len bytes at @offset in @buf, along with
+	 * its context. @base_offset is added to the offsets shown, for buffers
+	 * that are a window onto a larger stream.
+	 */
+	void print(output_writer& out,
+	           const buffer& buf,
+	           uint64_t offset,
+	           uint64_t needle_len,
+	           uint64_t base_offset = 0,
+	           const std::string& label = "") const
+	{
+		search_stats::timer timer(&search_stats::print_ns);
+		const uint64_t buf_len = buf.length();
+		const uint64_t start = offset > m_context_before ? offset - m_context_before : 0;
+		const uint64_t end = std::min(start + m_context_before + needle_len + m_context_after, buf_len);
+		const uint64_t match_end = offset + needle_len;
+
+		// Pad offsets to 8 hex digits, or wide enough to keep the columns
+		// lined up when the buffer is larger than 4 GiB
+		int offset_width = 8;
+		for (uint64_t l = (base_offset + buf_len) >> 32; l > 0; l >>= 4) {
+			++offset_width;
+		}
+
+		const uint64_t bytes = end > start ? end - start : 0;
+		char* const line = out.reserve(offset_width + 16 + 4 * bytes + 4 * (sizeof(red_on) + sizeof(red_off))
+		                               + 8 + label.size());
+		char* p = line;
+
+		// Offset, right aligned
+		uint64_t shown = base_offset + start;
+		int digits = 1;
+		for (uint64_t v = shown >> 4; v > 0; v >>= 4) {
+			++digits;
+		}
+		for (int i = digits; i < offset_width; ++i) {
+			*p++ = ' ';
+		}
+		for (int i = digits - 1; i >= 0; --i) {
+			*p++ = byte_text::hex_digits[(shown >> (i * 4)) & 0xf];
+		}
+		*p++ = ':';
+		*p++ = ' ';
+		*p++ = ' ';
+
+		std::span<const uint8_t> span = buf.span();
+		const bool contiguous = span.size() == buf_len;
+
+		// Hex
+		for (uint64_t i = start; i < end; ++i) {
+			if (i == offset) {
+				p = append(p, red_on);
+			}
+			const char* hex = &byte_text_table.hex[(contiguous ? span[i] : buf[i]) * 2];
+			p[0] = hex[0];
+			p[1] = hex[1];
+			p[2] = ' ';
+			p += 3;
+			if (i + 1 == match_end) {
+				p = append(p, red_off);
+			}
+		}
+
+		p = append(p, "   | ");
+
+		// ASCII
+		for (uint64_t i = start; i < end; ++i) {
+			if (i == offset) {
+				p = append(p, red_on);
+			}
+			*p++ = byte_text_table.ascii[contiguous ? span[i] : buf[i]];
+			if (i + 1 == match_end) {
+				p = append(p, red_off);
+			}
+		}
+
+		p = append(p, " |");
+		if (!label.empty()) {
+			p = append(p, "  ");
+			memcpy(p, label.data(), label.size());
+			p += label.size();
+		}
+		*p++ = '\n';
+
+		out.commit(p - line);
+	}
+
+private:
+	static constexpr char red_on[] = "\x1B[31m";
+	static constexpr char red_off[] = "\033[0m";
+	template<size_t N>
+	static char* append(char* p, const char (&str)[N])
+	{
+		memcpy(p, str, N - 1);
+		return p + N - 1;
+	}
+
+	const uint64_t m_context_before;
+	const uint64_t m_context_after;
+};
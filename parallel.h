@@ -0,0 +1,477 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "buffer.h"
+
+/**
+ * A fixed set of worker threads with work stealing.
+ *
+ * Each worker has its own deque of tasks. Tasks submitted from a worker go
+ * on the back of that worker's deque, and the worker takes its own tasks
+ * from the back too, so related work stays on one thread. A worker that runs
+ * out takes tasks from the front of the other workers' deques. Tasks
+ * submitted from outside the pool are spread across the workers.
+ *
+ * Tasks may submit more tasks and wait for them with wait(); a waiting
+ * thread runs other tasks in the meantime instead of blocking, so nested
+ * parallelism can't deadlock the pool.
+ */
+class thread_pool
+{
+public:
+	thread_pool(uint32_t threads) :
+		m_pending(0),
+		m_next_queue(0),
+		m_stop(false)
+	{
+		threads = std::max(1u, threads);
+		for (uint32_t i = 0; i < threads; ++i) {
+			m_queues.push_back(std::make_unique<task_queue>());
+		}
+		for (uint32_t i = 0; i < threads; ++i) {
+			m_workers.emplace_back([this, i] { work(i); });
+		}
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_sleep_lock);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (auto& t : m_workers) {
+			t.join();
+		}
+	}
+
+	thread_pool(const thread_pool& other) = delete;
+	thread_pool& operator=(const thread_pool& rhs) = delete;
+
+	uint32_t size() const { return m_workers.size(); }
+
+	/**
+	 * Queue a task. The returned future becomes ready when it has run.
+	 */
+	template<typename F>
+	auto submit(F&& f) -> std::future<decltype(f())>
+	{
+		auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::forward<F>(f));
+		auto ret = task->get_future();
+
+		int self = worker_index();
+		uint32_t q = self >= 0 ? self : m_next_queue++ % m_queues.size();
+		{
+			// Count it before anyone can take it, since run_one() counts it
+			// back down as soon as it has
+			std::lock_guard<std::mutex> sleep_lock(m_sleep_lock);
+			++m_pending;
+			std::lock_guard<std::mutex> lock(m_queues[q]->lock);
+			m_queues[q]->tasks.emplace_back([task] { (*task)(); });
+		}
+		m_cv.notify_one();
+		return ret;
+	}
+
+	/**
+	 * Wait for a task's result, running other queued tasks while it isn't
+	 * ready yet.
+	 */
+	template<typename T>
+	T wait(std::future<T>& result)
+	{
+		while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+			if (!run_one(worker_index())) {
+				// Nothing to help with; whatever we're waiting on is running
+				result.wait_for(std::chrono::milliseconds(1));
+			}
+		}
+		return result.get();
+	}
+
+private:
+	struct task_queue
+	{
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	/**
+	 * The index of the calling thread in this pool, or -1 if it isn't one of
+	 * our workers.
+	 */
+	int worker_index() const
+	{
+		return t_pool == this ? t_index : -1;
+	}
+
+	/**
+	 * Run one task: our own newest if we're a worker and have one, otherwise
+	 * the oldest one we can steal. Returns false if there was nothing to run.
+	 */
+	bool run_one(int self)
+	{
+		std::function<void()> task;
+
+		if (self >= 0) {
+			task_queue& q = *m_queues[self];
+			std::lock_guard<std::mutex> lock(q.lock);
+			if (!q.tasks.empty()) {
+				task = std::move(q.tasks.back());
+				q.tasks.pop_back();
+			}
+		}
+
+		const uint32_t n = m_queues.size();
+		for (uint32_t i = 1; !task && i <= n; ++i) {
+			task_queue& q = *m_queues[(self + i) % n];
+			std::lock_guard<std::mutex> lock(q.lock);
+			if (!q.tasks.empty()) {
+				task = std::move(q.tasks.front());
+				q.tasks.pop_front();
+			}
+		}
+
+		if (!task) {
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_sleep_lock);
+			--m_pending;
+		}
+		task();
+		return true;
+	}
+
+	void work(uint32_t index)
+	{
+		t_pool = this;
+		t_index = index;
+
+		while (true) {
+			if (run_one(index)) {
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_sleep_lock);
+			m_cv.wait(lock, [this] { return m_stop || m_pending > 0; });
+			if (m_stop && m_pending == 0) {
+				return;
+			}
+		}
+	}
+
+	static inline thread_local const thread_pool* t_pool = nullptr;
+	static inline thread_local int t_index = -1;
+
+	std::vector<std::unique_ptr<task_queue>> m_queues;
+	std::vector<std::thread> m_workers;
+
+	std::mutex m_sleep_lock;
+	std::condition_variable m_cv;
+	uint64_t m_pending;                   // Queued but not yet started tasks
+	std::atomic<uint32_t> m_next_queue;   // For spreading outside submissions
+	bool m_stop;
+};
+
+/**
+ * Splits a single buffer into ranges and searches them concurrently.
+ *
+ * Each range is extended by needle length - 1 bytes into the next so that
+ * matches straddling a boundary are found, but only matches that start
+ * inside a range are kept from it. Concatenating the ranges' results in
+ * order gives exactly what a single-threaded search would. Ranges searched
+ * for needles with no longest match run to the end of the haystack, so a
+ * match that crosses several ranges is read by each of them.
+ */
+class parallel_search
+{
+public:
+	// Ranges smaller than this aren't worth handing to another thread
+	static const uint64_t min_range_len = 1024 * 1024;
+
+	// Split into a few more ranges than threads, to even out the load
+	static const uint32_t ranges_per_thread = 4;
+
+	// How many matches a range gathers before it has its turn to be visited
+	static const uint64_t max_held_matches = 64 * 1024;
+
+	parallel_search(thread_pool& pool) :
+		m_pool(pool)
+	{}
+
+	/**
+	 * Call @visit with every match in @haystack, in order, as each range's
+	 * results become available.
+	 *
+	 * A range only gathers the first max_held_matches or so of its matches
+	 * ahead of time; any more are found as it's visited, so dense matches
+	 * can't pile up in memory.
+	 *
+	 * Stops early if @visit returns false, in which case ranges that haven't
+	 * started yet are skipped. Returns false if it did.
+	 */
+	bool for_each_match(const needle& n, const buffer& haystack, const match_visitor& visit) const
+	{
+		const uint64_t len = haystack.length();
+		const uint64_t overlap = overlap_len(n, len);
+
+		// The ranges are views into the haystack's memory, so it has to be
+		// contiguous
+		uint64_t num_ranges = std::min<uint64_t>(m_pool.size() * ranges_per_thread,
+		                                         len / min_range_len);
+		if (num_ranges <= 1 || !haystack.contiguous()) {
+			return n.for_each_match(haystack, visit);
+		}
+		const uint64_t range_len = round_up((len + num_ranges - 1) / num_ranges, n.alignment());
+		uint8_t* data = const_cast<uint8_t*>(haystack.span().data());
+
+		struct range_matches
+		{
+			std::vector<needle_match> found;
+			uint64_t resume = UINT64_MAX; // Where to carry on from, if it stopped short
+		};
+
+		// Matches that belong to the next range are left to it, and the rest
+		// are made relative to the whole buffer
+		auto search_range = [&n, data, len, overlap](uint64_t start, uint64_t end, uint64_t from,
+		                                             const std::atomic<bool>& stop,
+		                                             const std::function<bool(const needle_match&)>& keep) {
+			arraybuf view(data + start, std::min(end + overlap, len) - start);
+			n.for_each_match(view, [&](const needle_match& m) {
+				if (m.offset >= end - start || stop) {
+					return false;
+				}
+				return keep({ m.offset + start, m.length, m.pattern, m.distance });
+			}, from);
+		};
+
+		std::atomic<bool> stop(false);
+		std::vector<std::future<range_matches>> results;
+		const bool disjoint = n.disjoint();
+		for (uint64_t start = 0; start < len; start += range_len) {
+			uint64_t end = std::min(start + range_len, len);
+			results.push_back(m_pool.submit([&search_range, &stop, disjoint, start, end] {
+				range_matches ret;
+				if (stop) {
+					return ret;
+				}
+				search_range(start, end, 0, stop, [&](const needle_match& m) {
+					// Don't split up matches at the same offset, since the
+					// search can only be picked up again at an offset
+					if (ret.found.size() >= max_held_matches && m.offset != ret.found.back().offset) {
+						const needle_match& last = ret.found.back();
+						ret.resume = (disjoint ? last.offset + last.length : m.offset) - start;
+						return false;
+					}
+					ret.found.push_back(m);
+					return true;
+				});
+				return ret;
+			}));
+		}
+
+		uint64_t next = 0; // Where the last match visited ends
+		auto emit = [&](const needle_match& m) {
+			if (stop || !visit(m)) {
+				stop = true;
+				return false;
+			}
+			next = m.offset + m.length;
+			return true;
+		};
+
+		// Every task has to finish before we return, since they refer to
+		// the needle and the haystack
+		uint64_t start = 0;
+		for (auto& result : results) {
+			range_matches matches = m_pool.wait(result);
+			const uint64_t end = std::min(start + range_len, len);
+			auto it = matches.found.begin();
+			uint64_t resume = matches.resume;
+			if (disjoint && next > start && !stop) {
+				// The last match runs into this range, so its search should
+				// have carried on from where that ends. Search again from
+				// there until a match comes back into step with the range's.
+				it = matches.found.end();
+				resume = UINT64_MAX;
+				search_range(start, end, next - start, stop, [&](const needle_match& m) {
+					if (!emit(m)) {
+						return false;
+					}
+					auto same = std::lower_bound(matches.found.begin(), matches.found.end(), m,
+					                             [](const needle_match& a, const needle_match& b) {
+						return a.offset < b.offset;
+					});
+					if (same != matches.found.end() && *same == m) {
+						it = same + 1;
+						resume = matches.resume;
+						return false;
+					}
+					return true;
+				});
+			}
+			while (it != matches.found.end() && emit(*it)) {
+				++it;
+			}
+			if (!stop && resume != UINT64_MAX) {
+				search_range(start, end, resume, stop, emit);
+			}
+			start += range_len;
+		}
+		return !stop;
+	}
+
+	/**
+	 * The offset of the first match in @haystack, or UINT64_MAX if there
+	 * isn't one. Ranges after the first one with a match are skipped if
+	 * they haven't started yet.
+	 */
+	uint64_t first_match(const needle& n, const buffer& haystack) const
+	{
+		uint64_t ret = UINT64_MAX;
+		each_range(n, haystack, [&n](const buffer& view, uint64_t end, const std::atomic<bool>&) {
+			uint64_t offset = n.first_match(view);
+			return offset < end ? offset : UINT64_MAX;
+		}, [&](uint64_t offset, uint64_t start) {
+			if (offset == UINT64_MAX) {
+				return true;
+			}
+			ret = offset + start;
+			return false;
+		}, [&] {
+			ret = n.first_match(haystack);
+		});
+		return ret;
+	}
+
+	/**
+	 * The number of matches in @haystack, counting no further than @limit.
+	 * No offsets are kept, however many matches there are, except for
+	 * disjoint needles, which go through for_each_match() so each range
+	 * picks up where the last match ends.
+	 */
+	uint64_t count(const needle& n, const buffer& haystack, uint64_t limit = UINT64_MAX) const
+	{
+		uint64_t ret = 0;
+		if (limit == 0) {
+			return ret;
+		}
+		if (n.disjoint()) {
+			for_each_match(n, haystack, [&](const needle_match&) {
+				return ++ret < limit;
+			});
+			return ret;
+		}
+		each_range(n, haystack, [&n, limit](const buffer& view, uint64_t end, const std::atomic<bool>& stop) {
+			uint64_t found = 0;
+			n.for_each_match(view, [&](const needle_match& m) {
+				if (m.offset >= end || stop) {
+					return false;
+				}
+				return ++found < limit;
+			});
+			return found;
+		}, [&](uint64_t found, uint64_t) {
+			ret = std::min(ret + found, limit);
+			return ret < limit;
+		}, [&] {
+			ret = n.count(haystack, limit);
+		});
+		return ret;
+	}
+
+	/**
+	 * All the matches in @haystack, in one batch.
+	 */
+	std::vector<needle_match> match_vector(const needle& n, const buffer& haystack) const
+	{
+		std::vector<needle_match> ret;
+		for_each_match(n, haystack, [&](const needle_match& m) {
+			ret.push_back(m);
+			return true;
+		});
+		return ret;
+	}
+
+private:
+	/**
+	 * Ranges start at multiples of the needle's alignment, so its matches
+	 * are aligned the same in each range as in the whole haystack.
+	 */
+	static uint64_t round_up(uint64_t len, uint64_t alignment)
+	{
+		return (len + alignment - 1) / alignment * alignment;
+	}
+
+	/**
+	 * How far past its end a range has to be searched to find all of every
+	 * match starting in it: with no longest match, that's all the way to
+	 * the end of the @len byte haystack.
+	 */
+	static uint64_t overlap_len(const needle& n, uint64_t len)
+	{
+		if (n.length() == needle::unbounded) {
+			return len;
+		}
+		return n.length() > 0 ? n.length() - 1 : 0;
+	}
+
+	/**
+	 * Run @search on a view of each range, which returns a result for
+	 * matches starting before @end in the view, and hand the results to
+	 * @consume in order along with the range's start. Once @consume returns
+	 * false, ranges that haven't started are skipped and the stop flag passed
+	 * to @search is set. Haystacks too small to split, or that aren't
+	 * contiguous, go to @serial instead.
+	 */
+	template<typename S, typename C, typename F>
+	void each_range(const needle& n, const buffer& haystack, S&& search, C&& consume, F&& serial) const
+	{
+		const uint64_t len = haystack.length();
+		const uint64_t overlap = overlap_len(n, len);
+		uint64_t num_ranges = std::min<uint64_t>(m_pool.size() * ranges_per_thread,
+		                                         len / min_range_len);
+		if (num_ranges <= 1 || !haystack.contiguous()) {
+			serial();
+			return;
+		}
+		const uint64_t range_len = round_up((len + num_ranges - 1) / num_ranges, n.alignment());
+		uint8_t* data = const_cast<uint8_t*>(haystack.span().data());
+
+		using result_t = decltype(search(haystack, len, std::declval<const std::atomic<bool>&>()));
+		std::atomic<bool> stop(false);
+		std::vector<std::pair<uint64_t, std::future<result_t>>> results;
+		for (uint64_t start = 0; start < len; start += range_len) {
+			uint64_t end = std::min(start + range_len, len);
+			results.emplace_back(start, m_pool.submit([&search, &stop, data, start, end, len, overlap] {
+				if (stop) {
+					return result_t();
+				}
+				arraybuf view(data + start, std::min(end + overlap, len) - start);
+				return search(view, end - start, stop);
+			}));
+		}
+
+		// Every task has to finish before we return, since they refer to
+		// the needle and the haystack
+		for (auto& [start, result] : results) {
+			result_t r = m_pool.wait(result);
+			if (!stop && !consume(r, start)) {
+				stop = true;
+			}
+		}
+	}
+
+	thread_pool& m_pool;
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <type_traits>
+
+#include "buffer.h"
+#include "simd.h"
+
+/**
+ * Matches wherever the bytes, read as a number of a given type, fall in a
+ * range: plausible pointers, timestamps or lengths in a memory dump, say.
+ * Each match is the bytes of one value.
+ *
+ * The types are 8 to 64 bit integers, signed or not, and 32 and 64 bit
+ * floats, stored little- or big-endian. Values can be required to be
+ * aligned, in which case only every alignment'th offset is tested.
+ */
+class range_needle : public needle
+{
+public:
+	enum value_type
+	{
+		U8,
+		I8,
+		U16,
+		I16,
+		U32,
+		I32,
+		U64,
+		I64,
+		F32,
+		F64,
+	};
+
+	/**
+	 * Parse a type as the option naming it is written, without the dashes:
+	 * u8, i16le, u32be, f64 and so on. Values are little-endian unless the
+	 * name ends in "be".
+	 *
+	 * Returns false if it isn't a type.
+	 */
+	static bool parse_type(std::string name, value_type& type, bool& big_endian)
+	{
+		big_endian = false;
+		if (name.ends_with("le") || name.ends_with("be")) {
+			big_endian = name.ends_with("be");
+			name.resize(name.size() - 2);
+		}
+
+		static const char* names[] = { "u8", "i8", "u16", "i16", "u32", "i32", "u64", "i64", "f32", "f64" };
+		for (uint32_t t = U8; t <= F64; ++t) {
+			if (name == names[t]) {
+				type = (value_type)t;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * A needle for values of @type from @range, which is written "lo..hi"
+	 * (inclusive; either end may be left off) or as a single value. Integers
+	 * may be decimal or 0x hex. @align must be a power of two.
+	 *
+	 * Returns nullptr, with a description of the problem in @error, if the
+	 * range isn't valid.
+	 */
+	static std::unique_ptr<range_needle> create(value_type type, bool big_endian, const std::string& range,
+	                                            uint64_t align, std::string& error)
+	{
+		switch (type) {
+		case U8: return create<uint8_t>(big_endian, range, align, error);
+		case I8: return create<int8_t>(big_endian, range, align, error);
+		case U16: return create<uint16_t>(big_endian, range, align, error);
+		case I16: return create<int16_t>(big_endian, range, align, error);
+		case U32: return create<uint32_t>(big_endian, range, align, error);
+		case I32: return create<int32_t>(big_endian, range, align, error);
+		case U64: return create<uint64_t>(big_endian, range, align, error);
+		case I64: return create<int64_t>(big_endian, range, align, error);
+		case F32: return create<float>(big_endian, range, align, error);
+		case F64: return create<double>(big_endian, range, align, error);
+		}
+		return nullptr;
+	}
+
+	virtual uint64_t alignment() const override { return m_align; }
+
+protected:
+	range_needle(uint64_t align) :
+		m_align(align)
+	{}
+
+	const uint64_t m_align;
+
+private:
+	template <class T>
+	static std::unique_ptr<range_needle> create(bool big_endian, const std::string& range,
+	                                            uint64_t align, std::string& error);
+
+	/**
+	 * Parse one end of a range into @value, leaving it alone if @str is
+	 * empty.
+	 */
+	template <class T>
+	static bool parse_bound(const std::string& str, T& value)
+	{
+		if (str.empty()) {
+			return true;
+		}
+
+		const char* begin = str.c_str();
+		char* end;
+		errno = 0;
+		if constexpr (std::is_floating_point_v<T>) {
+			value = strtod(begin, &end);
+		} else {
+			const bool negative = str[0] == '-';
+			const char* digits = begin + (negative || str[0] == '+');
+			const int base = digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X') ? 16 : 10;
+			if (std::is_signed_v<T>) {
+				long long v = strtoll(begin, &end, base);
+				if (v < std::numeric_limits<T>::min() || v > std::numeric_limits<T>::max()) {
+					return false;
+				}
+				value = v;
+			} else {
+				unsigned long long v = strtoull(begin, &end, base);
+				if (negative || v > std::numeric_limits<T>::max()) {
+					return false;
+				}
+				value = v;
+			}
+		}
+		return errno == 0 && end != begin && *end == '\0';
+	}
+};
+
+template <class T>
+class typed_range_needle : public range_needle
+{
+public:
+	typed_range_needle(const simd_search::value_range<T>& range) :
+		range_needle(range.align),
+		m_range(range)
+	{}
+
+	virtual uint64_t length() const override { return sizeof(T); }
+
+	virtual uint64_t first_match(const buffer& haystack, uint64_t start = 0) const override
+	{
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			return simd_search::find_range(hay.data(), hay.size(), m_range, start);
+		}
+		return find_bytewise(haystack, start);
+	}
+
+	virtual bool for_each_match(const buffer& haystack, const match_visitor& visit, uint64_t start = 0) const override
+	{
+		auto report = [&](uint64_t offset) {
+			return visit({ offset, sizeof(T), 0 });
+		};
+
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			return buffer::visit_each([&](uint64_t from) {
+				return simd_search::find_range(hay.data(), hay.size(), m_range, from);
+			}, report, start);
+		}
+		return buffer::visit_each([&](uint64_t from) {
+			return find_bytewise(haystack, from);
+		}, report, start);
+	}
+
+private:
+	/**
+	 * For buffers that aren't contiguous.
+	 */
+	uint64_t find_bytewise(const buffer& haystack, uint64_t start) const
+	{
+		const uint64_t len = haystack.length();
+		for (uint64_t i = (start + m_align - 1) / m_align * m_align; i + sizeof(T) <= len; i += m_align) {
+			uint8_t bytes[sizeof(T)];
+			for (uint64_t j = 0; j < sizeof(T); ++j) {
+				bytes[j] = haystack[i + j];
+			}
+			if (m_range.contains(m_range.load(bytes))) {
+				return i;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+	const simd_search::value_range<T> m_range;
+};
+
+template <class T>
+std::unique_ptr<range_needle> range_needle::create(bool big_endian, const std::string& range,
+                                                   uint64_t align, std::string& error)
+{
+	if (align == 0 || (align & (align - 1)) != 0) {
+		error = "the alignment has to be a power of two";
+		return nullptr;
+	}
+
+	simd_search::value_range<T> r = { std::numeric_limits<T>::lowest(), std::numeric_limits<T>::max(),
+	                                  big_endian, align };
+	const size_t dots = range.find("..");
+	const std::string lo = dots == std::string::npos ? range : range.substr(0, dots);
+	const std::string hi = dots == std::string::npos ? range : range.substr(dots + 2);
+	if (range.empty() || range == ".." || !parse_bound(lo, r.lo) || !parse_bound(hi, r.hi)) {
+		error = "expected a number or range of numbers like 0x1000..0x2000 that fits the type";
+		return nullptr;
+	}
+	if (r.lo > r.hi) {
+		error = "the low end is above the high end";
+		return nullptr;
+	}
+	return std::make_unique<typed_range_needle<T>>(r);
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/**
+ * A minimal io_uring: one submission and one completion ring, driven with
+ * the raw syscalls, for queueing reads.
+ */
+class uring
+{
+public:
+	/**
+	 * Set up a ring with room for @entries requests. Returns nullptr if the
+	 * kernel doesn't support io_uring, or won't let us use it.
+	 */
+	static std::unique_ptr<uring> create(uint32_t entries)
+	{
+		std::unique_ptr<uring> ret(new uring());
+		return ret->setup(entries) ? std::move(ret) : nullptr;
+	}
+
+	~uring()
+	{
+		if (m_sqes) munmap(m_sqes, m_sqes_len);
+		if (m_cq_ring && m_cq_ring != m_sq_ring) munmap(m_cq_ring, m_cq_ring_len);
+		if (m_sq_ring) munmap(m_sq_ring, m_sq_ring_len);
+		if (m_fd >= 0) close(m_fd);
+	}
+
+	/**
+	 * Queue a read of @iov from @fd at @offset, tagged with @tag. Returns
+	 * false if the submission ring is full.
+	 */
+	bool queue_read(int fd, const struct iovec* iov, uint64_t offset, uint64_t tag)
+	{
+		const uint32_t tail = *m_sq_tail;
+		if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+			return false;
+		}
+
+		const uint32_t index = tail & m_sq_mask;
+		struct io_uring_sqe* sqe = &m_sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)iov;
+		sqe->len = 1;
+		sqe->off = offset;
+		sqe->user_data = tag;
+		m_sq_array[index] = index;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++m_pending;
+		return true;
+	}
+
+	/**
+	 * Submit everything queued, then wait for a completion and return its
+	 * tag and result (bytes read, or -errno).
+	 *
+	 * Returns false if io_uring_enter itself fails.
+	 */
+	bool wait(uint64_t& tag, int32_t& res)
+	{
+		for (;;) {
+			const uint32_t head = *m_cq_head;
+			if (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+				const struct io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+				tag = cqe.user_data;
+				res = cqe.res;
+				__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+
+			// Whatever isn't submitted stays queued for the next go
+			long submitted = syscall(__NR_io_uring_enter, m_fd, m_pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (submitted < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			m_pending -= std::min<uint32_t>(submitted, m_pending);
+		}
+	}
+
+private:
+	uring() = default;
+
+	bool setup(uint32_t entries)
+	{
+		struct io_uring_params p = {};
+		m_fd = syscall(__NR_io_uring_setup, entries, &p);
+		if (m_fd < 0) {
+			return false;
+		}
+
+		m_sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+		m_cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+		if (single) {
+			m_sq_ring_len = m_cq_ring_len = std::max(m_sq_ring_len, m_cq_ring_len);
+		}
+
+		m_sq_ring = map(m_sq_ring_len, IORING_OFF_SQ_RING);
+		if (!m_sq_ring) {
+			return false;
+		}
+		m_cq_ring = single ? m_sq_ring : map(m_cq_ring_len, IORING_OFF_CQ_RING);
+		if (!m_cq_ring) {
+			return false;
+		}
+		m_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+		m_sqes = (struct io_uring_sqe*)map(m_sqes_len, IORING_OFF_SQES);
+		if (!m_sqes) {
+			return false;
+		}
+
+		uint8_t* sq = (uint8_t*)m_sq_ring;
+		m_sq_head = (uint32_t*)(sq + p.sq_off.head);
+		m_sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+		m_sq_mask = *(uint32_t*)(sq + p.sq_off.ring_mask);
+		m_sq_entries = p.sq_entries;
+		m_sq_array = (uint32_t*)(sq + p.sq_off.array);
+
+		uint8_t* cq = (uint8_t*)m_cq_ring;
+		m_cq_head = (uint32_t*)(cq + p.cq_off.head);
+		m_cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+		m_cq_mask = *(uint32_t*)(cq + p.cq_off.ring_mask);
+		m_cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+		return true;
+	}
+
+	void* map(uint64_t len, uint64_t offset)
+	{
+		void* addr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+		return addr == MAP_FAILED ? nullptr : addr;
+	}
+
+	int m_fd = -1;
+	uint32_t m_pending = 0; // Queued but not yet submitted
+
+	void* m_sq_ring = nullptr;
+	uint64_t m_sq_ring_len = 0;
+	uint32_t* m_sq_head = nullptr;
+	uint32_t* m_sq_tail = nullptr;
+	uint32_t m_sq_mask = 0;
+	uint32_t m_sq_entries = 0;
+	uint32_t* m_sq_array = nullptr;
+	struct io_uring_sqe* m_sqes = nullptr;
+	uint64_t m_sqes_len = 0;
+
+	void* m_cq_ring = nullptr;
+	uint64_t m_cq_ring_len = 0;
+	uint32_t* m_cq_head = nullptr;
+	uint32_t* m_cq_tail = nullptr;
+	uint32_t m_cq_mask = 0;
+	struct io_uring_cqe* m_cqes = nullptr;
+};
+
+/**
+ * Reads a regular file front to back in large chunks, keeping the next few
+ * chunks' reads in flight while the caller works on the one that's done, so
+ * the disk and the search run at the same time.
+ *
+ * Reads go through io_uring where the kernel allows it, and otherwise
+ * through plain pread on a thread of its own, which reads ahead into the
+ * chunks the caller isn't using. Buffers and
+ * chunk lengths are page-aligned, so the file may be opened with O_DIRECT to
+ * bypass the page cache entirely.
+ */
+class chunk_reader
+{
+public:
+	static const uint64_t default_chunk_len = 4 * 1024 * 1024;
+	static const uint32_t default_depth = 4;
+	static const uint64_t alignment = 4096;
+
+	/**
+	 * Called with each chunk, in order. Returning false stops the reading.
+	 */
+	using chunk_callback = std::function<bool(const uint8_t* data, uint64_t len)>;
+
+	/**
+	 * Read @fd, a regular file, @depth chunks at a time. With @use_uring
+	 * false, only pread is used.
+	 */
+	chunk_reader(int fd, bool use_uring = true,
+	             uint64_t chunk_len = default_chunk_len, uint32_t depth = default_depth) :
+		m_fd(fd),
+		m_chunk_len(round_up(chunk_len)),
+		m_depth(std::max<uint32_t>(depth, 2)),
+		m_slots(m_depth)
+	{
+		if (use_uring) {
+			m_ring = uring::create(m_depth);
+		}
+	}
+
+	~chunk_reader()
+	{
+		for (slot& s : m_slots) {
+			free(s.data);
+		}
+	}
+
+	/**
+	 * Whether reads are going through io_uring rather than pread.
+	 */
+	bool using_uring() const { return m_ring != nullptr; }
+
+	/**
+	 * Read the whole file, passing each chunk to @consume.
+	 *
+	 * Returns the number of bytes read, or UINT64_MAX on a read error.
+	 */
+	uint64_t run(const chunk_callback& consume)
+	{
+		struct stat st;
+		if (fstat(m_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			return UINT64_MAX;
+		}
+		m_size = st.st_size;
+		posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		for (slot& s : m_slots) {
+			if (!s.data && posix_memalign((void**)&s.data, alignment, m_chunk_len) != 0) {
+				return UINT64_MAX;
+			}
+		}
+		return m_ring ? run_uring(consume) : run_pread(consume);
+	}
+
+private:
+	struct slot
+	{
+		uint8_t* data = nullptr;
+		uint64_t offset = 0;
+		uint64_t len = 0;  // Bytes read so far
+		bool done = false; // Read finished, and not yet consumed
+		struct iovec iov;
+	};
+
+	uint64_t chunk_count() const { return (m_size + m_chunk_len - 1) / m_chunk_len; }
+
+	uint64_t want(uint64_t chunk) const { return std::min(m_chunk_len, m_size - chunk * m_chunk_len); }
+
+	/**
+	 * O_DIRECT reads have to be whole blocks, even the last one; the read
+	 * just comes up short at the end of the file.
+	 */
+	static uint64_t round_up(uint64_t len) { return (len + alignment - 1) / alignment * alignment; }
+
+	/**
+	 * Queue the read of @chunk into its slot, or of the rest of it after a
+	 * short read.
+	 */
+	bool queue(uint64_t chunk)
+	{
+		slot& s = m_slots[chunk % m_depth];
+		s.iov.iov_base = s.data + s.len;
+		s.iov.iov_len = round_up(want(chunk)) - s.len;
+		return m_ring->queue_read(m_fd, &s.iov, s.offset + s.len, chunk);
+	}
+
+	uint64_t run_uring(const chunk_callback& consume)
+	{
+		const uint64_t chunks = chunk_count();
+		uint64_t next_queue = 0;
+		auto start = [&](uint64_t chunk) {
+			slot& s = m_slots[chunk % m_depth];
+			s.offset = chunk * m_chunk_len;
+			s.len = 0;
+			s.done = false;
+			return queue(chunk);
+		};
+		while (next_queue < chunks && next_queue < m_depth) {
+			if (!start(next_queue++)) {
+				return UINT64_MAX;
+			}
+		}
+
+		uint64_t in_flight = next_queue;
+		uint64_t total = 0;
+		for (uint64_t next = 0; next < chunks; ++next) {
+			slot& s = m_slots[next % m_depth];
+			while (!s.done) {
+				uint64_t tag;
+				int32_t res;
+				bool ok;
+				{
+					search_stats::timer timer(&search_stats::read_ns);
+					ok = m_ring->wait(tag, res);
+				}
+				if (!ok || res < 0) {
+					drain(in_flight);
+					return UINT64_MAX;
+				}
+				--in_flight;
+
+				slot& got = m_slots[tag % m_depth];
+				got.len += res;
+				if (got.len >= want(tag)) {
+					got.done = true;
+				} else if (res == 0 || !queue(tag)) {
+					// The file shrank, or the ring is somehow full
+					drain(in_flight);
+					return UINT64_MAX;
+				} else {
+					++in_flight;
+				}
+			}
+
+			total += s.len;
+			if (!consume(s.data, s.len)) {
+				drain(in_flight);
+				return total;
+			}
+			if (next_queue < chunks) {
+				if (!start(next_queue++)) {
+					drain(in_flight);
+					return UINT64_MAX;
+				}
+				++in_flight;
+			}
+		}
+		return total;
+	}
+
+	/**
+	 * Wait out the reads still in flight, so none of them lands in a buffer
+	 * after it's been freed.
+	 */
+	void drain(uint64_t in_flight)
+	{
+		for (; in_flight > 0; --in_flight) {
+			uint64_t tag;
+			int32_t res;
+			if (!m_ring->wait(tag, res)) {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * pread all of @chunk into its slot.
+	 */
+	bool read_chunk(uint64_t chunk)
+	{
+		slot& s = m_slots[chunk % m_depth];
+		s.offset = chunk * m_chunk_len;
+		s.len = 0;
+		const uint64_t len = want(chunk);
+		while (s.len < len) {
+			ssize_t n = pread(m_fd, s.data + s.len, round_up(len) - s.len, s.offset + s.len);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				return false;
+			}
+			s.len += n;
+		}
+		return true;
+	}
+
+	uint64_t run_pread(const chunk_callback& consume)
+	{
+		const uint64_t chunks = chunk_count();
+		std::mutex lock;
+		std::condition_variable changed;
+		uint64_t read = 0;     // Chunks read so far
+		uint64_t consumed = 0; // Chunks whose slots are free again
+		bool stop = false;     // Set by the consumer
+		bool failed = false;   // Set by the reader
+
+		std::thread reader([&] {
+			for (uint64_t chunk = 0; chunk < chunks; ++chunk) {
+				{
+					std::unique_lock<std::mutex> l(lock);
+					changed.wait(l, [&] { return chunk - consumed < m_depth || stop; });
+					if (stop) {
+						return;
+					}
+				}
+				const bool ok = read_chunk(chunk);
+
+				std::lock_guard<std::mutex> l(lock);
+				if (ok) {
+					++read;
+				} else {
+					failed = true;
+				}
+				changed.notify_all();
+				if (!ok) {
+					return;
+				}
+			}
+		});
+
+		uint64_t total = 0;
+		bool stopped = false;
+		for (uint64_t next = 0; next < chunks && !stopped; ++next) {
+			{
+				search_stats::timer timer(&search_stats::read_ns);
+				std::unique_lock<std::mutex> l(lock);
+				changed.wait(l, [&] { return read > next || failed; });
+				if (read <= next) {
+					break;
+				}
+			}
+
+			slot& s = m_slots[next % m_depth];
+			total += s.len;
+			stopped = !consume(s.data, s.len);
+
+			std::lock_guard<std::mutex> l(lock);
+			++consumed;
+			stop = stopped;
+			changed.notify_all();
+		}
+		reader.join();
+
+		return failed && !stopped ? UINT64_MAX : total;
+	}
+
+	const int m_fd;
+	const uint64_t m_chunk_len;
+	const uint32_t m_depth;
+	std::vector<slot> m_slots;
+	std::unique_ptr<uring> m_ring;
+	uint64_t m_size = 0;
+};
@@ -0,0 +1,1151 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer.h"
+#include "engine.h"
+
+/**
+ * A parsed byte regular expression.
+ */
+struct regex_node
+{
+	enum kind
+	{
+		BYTES,     // One byte from a set
+		CONCAT,    // Each child in turn
+		ALTERNATE, // Any one child
+		REPEAT,    // The child, min to max times
+	};
+
+	kind type;
+	std::bitset<256> bytes;
+	std::vector<regex_node> children;
+	uint32_t min = 1;
+	uint32_t max = 1;  // Or unbounded
+
+	static const uint32_t unbounded = UINT32_MAX;
+};
+
+/**
+ * Parses the byte regex syntax:
+ *
+ *   abc          literal bytes; \xHH for any byte, \n \r \t \0, \ before
+ *                punctuation for the punctuation itself
+ *   .            any byte at all (including newline)
+ *   [a-z\x00]    a set of bytes, [^...] for the bytes not in it
+ *   \d \w \s     digits, word characters, whitespace (\D \W \S: not)
+ *   (...)        grouping
+ *   a|b          alternation
+ *   * + ?        repetition
+ *   {n} {n,m}    counted repetition; {n,} for n or more
+ */
+class regex_parser
+{
+public:
+	static const uint32_t max_count = 65535;
+
+	regex_parser(const std::string& pattern) :
+		m_pattern(pattern),
+		m_pos(0)
+	{}
+
+	/**
+	 * Returns false, with a description of the problem in @error, if the
+	 * pattern isn't valid.
+	 */
+	bool parse(regex_node& out, std::string& error)
+	{
+		if (!alternation(out)) {
+			error = m_error;
+			return false;
+		}
+		if (m_pos < m_pattern.size()) {
+			error = "unmatched ) at offset " + std::to_string(m_pos);
+			return false;
+		}
+		return true;
+	}
+
+private:
+	bool fail(const std::string& what)
+	{
+		m_error = what + " at offset " + std::to_string(m_pos);
+		return false;
+	}
+
+	bool at_end() const { return m_pos >= m_pattern.size(); }
+	char peek() const { return m_pattern[m_pos]; }
+
+	bool alternation(regex_node& out)
+	{
+		out.type = regex_node::ALTERNATE;
+		while (true) {
+			out.children.emplace_back();
+			if (!concatenation(out.children.back())) {
+				return false;
+			}
+			if (at_end() || peek() != '|') {
+				break;
+			}
+			++m_pos;
+		}
+
+		if (out.children.size() == 1) {
+			regex_node only = std::move(out.children[0]);
+			out = std::move(only);
+		}
+		return true;
+	}
+
+	bool concatenation(regex_node& out)
+	{
+		out.type = regex_node::CONCAT;
+		while (!at_end() && peek() != '|' && peek() != ')') {
+			out.children.emplace_back();
+			if (!repetition(out.children.back())) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool repetition(regex_node& out)
+	{
+		if (!atom(out)) {
+			return false;
+		}
+
+		while (!at_end()) {
+			uint32_t min, max;
+			char c = peek();
+			if (c == '*') {
+				min = 0;
+				max = regex_node::unbounded;
+				++m_pos;
+			} else if (c == '+') {
+				min = 1;
+				max = regex_node::unbounded;
+				++m_pos;
+			} else if (c == '?') {
+				min = 0;
+				max = 1;
+				++m_pos;
+			} else if (c == '{') {
+				if (!bounds(min, max)) {
+					return false;
+				}
+			} else {
+				break;
+			}
+
+			regex_node rep;
+			rep.type = regex_node::REPEAT;
+			rep.min = min;
+			rep.max = max;
+			rep.children.push_back(std::move(out));
+			out = std::move(rep);
+		}
+		return true;
+	}
+
+	/**
+	 * {n}, {n,} or {n,m}
+	 */
+	bool bounds(uint32_t& min, uint32_t& max)
+	{
+		++m_pos;
+		if (!number(min)) {
+			return fail("expected a repeat count");
+		}
+		max = min;
+		if (!at_end() && peek() == ',') {
+			++m_pos;
+			if (!at_end() && peek() == '}') {
+				max = regex_node::unbounded;
+			} else if (!number(max) || max < min) {
+				return fail("invalid repeat bound");
+			}
+		}
+		if (at_end() || peek() != '}') {
+			return fail("expected }");
+		}
+		++m_pos;
+		return true;
+	}
+
+	bool number(uint32_t& n)
+	{
+		const uint64_t start = m_pos;
+		uint64_t value = 0;
+		while (!at_end() && isdigit((unsigned char)peek()) && value <= max_count) {
+			value = value * 10 + (peek() - '0');
+			++m_pos;
+		}
+		n = value;
+		return m_pos > start && value <= max_count;
+	}
+
+	bool atom(regex_node& out)
+	{
+		out.type = regex_node::BYTES;
+		char c = peek();
+		switch (c) {
+		case '(':
+			++m_pos;
+			if (!alternation(out)) {
+				return false;
+			}
+			if (at_end() || peek() != ')') {
+				return fail("expected )");
+			}
+			++m_pos;
+			return true;
+		case '[':
+			++m_pos;
+			return byte_class(out.bytes);
+		case '.':
+			++m_pos;
+			out.bytes.set();
+			return true;
+		case '\\':
+			++m_pos;
+			return escape(out.bytes);
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			return fail("nothing to repeat");
+		case ']':
+		case '}':
+			return fail(std::string("unescaped ") + c);
+		default:
+			++m_pos;
+			out.bytes.set((uint8_t)c);
+			return true;
+		}
+	}
+
+	/**
+	 * The rest of a [...] set, after the [.
+	 */
+	bool byte_class(std::bitset<256>& bytes)
+	{
+		bool negate = false;
+		if (!at_end() && peek() == '^') {
+			negate = true;
+			++m_pos;
+		}
+
+		bool first = true;
+		while (!at_end() && (peek() != ']' || first)) {
+			first = false;
+			std::bitset<256> lo_set;
+			if (!class_member(lo_set)) {
+				return false;
+			}
+
+			// A range, unless the - is the last thing in the set
+			if (m_pos + 1 < m_pattern.size() && peek() == '-' && m_pattern[m_pos + 1] != ']') {
+				++m_pos;
+				std::bitset<256> hi_set;
+				if (!class_member(hi_set)) {
+					return false;
+				}
+				if (lo_set.count() != 1 || hi_set.count() != 1) {
+					return fail("invalid range");
+				}
+				uint32_t lo = first_byte(lo_set);
+				uint32_t hi = first_byte(hi_set);
+				if (lo > hi) {
+					return fail("invalid range");
+				}
+				for (uint32_t b = lo; b <= hi; ++b) {
+					bytes.set(b);
+				}
+			} else {
+				bytes |= lo_set;
+			}
+		}
+		if (at_end()) {
+			return fail("expected ]");
+		}
+		++m_pos;
+
+		if (negate) {
+			bytes.flip();
+		}
+		if (bytes.none()) {
+			return fail("empty byte set");
+		}
+		return true;
+	}
+
+	bool class_member(std::bitset<256>& bytes)
+	{
+		char c = peek();
+		++m_pos;
+		if (c == '\\') {
+			return escape(bytes);
+		}
+		bytes.set((uint8_t)c);
+		return true;
+	}
+
+	/**
+	 * What follows a backslash.
+	 */
+	bool escape(std::bitset<256>& bytes)
+	{
+		if (at_end()) {
+			return fail("trailing \\");
+		}
+		char c = peek();
+		++m_pos;
+
+		auto add_if = [&](auto pred, bool negate) {
+			for (uint32_t b = 0; b < 256; ++b) {
+				if ((pred(b) != 0) != negate) {
+					bytes.set(b);
+				}
+			}
+			return true;
+		};
+
+		switch (c) {
+		case 'x': {
+			std::vector<uint8_t> byte, mask;
+			if (m_pos + 2 > m_pattern.size()
+			    || !buffer_conversion::hex_string_to_masked(m_pattern.substr(m_pos, 2), byte, mask)
+			    || mask[0] != 0xff) {
+				return fail("expected two hex digits after \\x");
+			}
+			m_pos += 2;
+			bytes.set(byte[0]);
+			return true;
+		}
+		case 'n': bytes.set('\n'); return true;
+		case 'r': bytes.set('\r'); return true;
+		case 't': bytes.set('\t'); return true;
+		case '0': bytes.set(0); return true;
+		case 'd': return add_if(is_digit, false);
+		case 'D': return add_if(is_digit, true);
+		case 'w': return add_if(is_word, false);
+		case 'W': return add_if(is_word, true);
+		case 's': return add_if(is_space, false);
+		case 'S': return add_if(is_space, true);
+		default:
+			if (isalnum((unsigned char)c)) {
+				--m_pos;
+				return fail(std::string("unknown escape \\") + c);
+			}
+			bytes.set((uint8_t)c);
+			return true;
+		}
+	}
+
+	static bool is_digit(uint32_t b) { return b >= '0' && b <= '9'; }
+	static bool is_word(uint32_t b) { return isalnum(b) || b == '_'; }
+	static bool is_space(uint32_t b) { return isspace(b); }
+
+	static uint32_t first_byte(const std::bitset<256>& bytes)
+	{
+		uint32_t b = 0;
+		while (!bytes[b]) {
+			++b;
+		}
+		return b;
+	}
+
+	const std::string& m_pattern;
+	uint64_t m_pos;
+	std::string m_error;
+};
+
+/**
+ * A Thompson NFA, built from a regex_node back to front.
+ */
+struct regex_nfa
+{
+	enum op
+	{
+		BYTE_SET, // Consume a byte in sets[set], go to out
+		SPLIT,    // Go to out and out1 without consuming anything
+		ACCEPT,
+	};
+
+	struct state
+	{
+		op type;
+		uint32_t set;
+		uint32_t out;
+		uint32_t out1;
+	};
+
+	// Patterns needing more states than this are refused
+	static const uint32_t max_states = 100000;
+
+	std::vector<state> states;
+	std::vector<std::bitset<256>> sets;
+	uint32_t start = 0;
+
+	// Bytes no state tells apart share a class, which keeps DFA tables small
+	uint8_t classes[256] = {};
+	uint32_t num_classes = 1;
+
+	/**
+	 * Build the NFA for @node, or for its reverse (matching the same
+	 * strings backwards). Returns false if it would be too big.
+	 */
+	bool build(const regex_node& node, bool reverse)
+	{
+		m_reverse = reverse;
+		uint32_t accept = add({ ACCEPT, 0, 0, 0 });
+		start = compile(node, accept);
+		if (states.size() > max_states) {
+			return false;
+		}
+		split_classes();
+		return true;
+	}
+
+private:
+	uint32_t add(state s)
+	{
+		// Stop growing once over the limit; build() then fails
+		if (states.size() <= max_states) {
+			states.push_back(s);
+		}
+		return states.size() - 1;
+	}
+
+	uint32_t compile(const regex_node& node, uint32_t next)
+	{
+		if (states.size() > max_states) {
+			return next;
+		}
+
+		switch (node.type) {
+		case regex_node::BYTES: {
+			auto it = m_set_ids.find(node.bytes);
+			if (it == m_set_ids.end()) {
+				it = m_set_ids.emplace(node.bytes, sets.size()).first;
+				sets.push_back(node.bytes);
+			}
+			return add({ BYTE_SET, it->second, next, 0 });
+		}
+		case regex_node::CONCAT:
+			if (m_reverse) {
+				for (const regex_node& child : node.children) {
+					next = compile(child, next);
+				}
+			} else {
+				for (auto it = node.children.rbegin(); it != node.children.rend(); ++it) {
+					next = compile(*it, next);
+				}
+			}
+			return next;
+		case regex_node::ALTERNATE: {
+			uint32_t entry = compile(node.children.back(), next);
+			for (auto it = node.children.rbegin() + 1; it != node.children.rend(); ++it) {
+				entry = add({ SPLIT, 0, compile(*it, next), entry });
+			}
+			return entry;
+		}
+		case regex_node::REPEAT: {
+			// x{2,4} is xx(x(x)?)?, and x{2,} is xxx*
+			uint32_t entry = next;
+			if (node.max == regex_node::unbounded) {
+				// A loop, so the child is compiled after the split it goes
+				// back to
+				entry = add({ SPLIT, 0, 0, next });
+				if (states.size() > max_states) {
+					return next;
+				}
+				uint32_t body = compile(node.children[0], entry);
+				states[entry].out = body;
+			} else {
+				for (uint32_t i = node.min; i < node.max; ++i) {
+					entry = add({ SPLIT, 0, compile(node.children[0], entry), next });
+				}
+			}
+			for (uint32_t i = 0; i < node.min; ++i) {
+				entry = compile(node.children[0], entry);
+			}
+			return entry;
+		}
+		}
+		return next;
+	}
+
+	void split_classes()
+	{
+		num_classes = 1;
+		for (const std::bitset<256>& set : sets) {
+			std::map<std::pair<uint8_t, bool>, uint8_t> split;
+			uint8_t remapped[256];
+			for (uint32_t b = 0; b < 256; ++b) {
+				auto key = std::make_pair(classes[b], (bool)set[b]);
+				auto it = split.emplace(key, split.size()).first;
+				remapped[b] = it->second;
+			}
+			memcpy(classes, remapped, sizeof(classes));
+			num_classes = split.size();
+		}
+	}
+
+	bool m_reverse = false;
+	std::unordered_map<std::bitset<256>, uint32_t> m_set_ids;
+};
+
+/**
+ * A DFA built lazily from an NFA: each state is a set of NFA states, and a
+ * transition is worked out the first time it's taken. If the DFA grows past
+ * max_states, it's thrown away and started again, so memory stays bounded
+ * however many states the pattern can produce.
+ *
+ * An anchored DFA finds matches starting where it starts. A leftmost DFA
+ * finds matches starting anywhere, but only follows the leftmost of them:
+ * its states keep the NFA states of each possible start apart, earliest
+ * first, and once one of those accepts, the later ones are dropped and no
+ * new ones are started. So the last place it accepts before it dies is
+ * where the leftmost-longest match ends.
+ */
+class regex_dfa
+{
+public:
+	static const uint32_t dead = 0;
+	static const uint32_t accept_flag = 0x80000000;
+	static const uint32_t max_states = 4096;
+
+	enum mode
+	{
+		ANCHORED,
+		LEFTMOST,
+	};
+
+	regex_dfa(const regex_nfa& nfa, mode m) :
+		m_nfa(nfa),
+		m_mode(m),
+		m_marks(nfa.states.size(), 0),
+		m_generation(0)
+	{
+		if (m_mode == LEFTMOST) {
+			m_start_set.push_back(start_mark);
+		}
+		closure(m_nfa.start, m_start_set);
+		if (m_mode == ANCHORED) {
+			std::sort(m_start_set.begin(), m_start_set.end());
+		}
+		reset();
+	}
+
+	uint32_t start() const { return m_start; }
+
+	/**
+	 * The state after @s reads @b, with accept_flag set if it accepts (a
+	 * match ends after @b).
+	 */
+	uint32_t step(uint32_t s, uint8_t b)
+	{
+		uint32_t t = m_table[s + m_nfa.classes[b]];
+		return t != unknown ? t : compute(s, b);
+	}
+
+private:
+	static const uint32_t unknown = UINT32_MAX;
+
+	// In a leftmost DFA's states, start_mark comes before the NFA states of
+	// each start, and matched_mark comes last once a match has been found
+	static constexpr uint32_t start_mark = UINT32_MAX;
+	static constexpr uint32_t matched_mark = UINT32_MAX - 1;
+
+	void reset()
+	{
+		m_table.clear();
+		m_sets.clear();
+		m_ids.clear();
+		intern({});
+		m_start = intern(std::vector<uint32_t>(m_start_set)) & ~accept_flag;
+	}
+
+	void closure(uint32_t s, std::vector<uint32_t>& set)
+	{
+		std::vector<uint32_t> todo = { s };
+		while (!todo.empty()) {
+			uint32_t i = todo.back();
+			todo.pop_back();
+			if (m_marks[i] == m_generation + 1) {
+				continue;
+			}
+			m_marks[i] = m_generation + 1;
+
+			const regex_nfa::state& st = m_nfa.states[i];
+			if (st.type == regex_nfa::SPLIT) {
+				todo.push_back(st.out1);
+				todo.push_back(st.out);
+			} else {
+				set.push_back(i);
+			}
+		}
+	}
+
+	bool accepts(uint32_t i) const
+	{
+		return i < m_nfa.states.size() && m_nfa.states[i].type == regex_nfa::ACCEPT;
+	}
+
+	uint32_t intern(std::vector<uint32_t>&& set)
+	{
+		auto it = m_ids.find(set);
+		if (it != m_ids.end()) {
+			return it->second;
+		}
+
+		bool accepting = std::any_of(set.begin(), set.end(), [&](uint32_t i) { return accepts(i); });
+		// States are numbered by where their row of the table starts, which
+		// saves a multiply on every step
+		uint32_t id = (m_sets.size() * m_nfa.num_classes) | (accepting ? accept_flag : 0);
+		m_sets.push_back(set);
+		m_ids.emplace(std::move(set), id);
+		m_table.resize(m_sets.size() * m_nfa.num_classes, (uint32_t)unknown);
+		return id;
+	}
+
+	uint32_t compute(uint32_t s, uint8_t b)
+	{
+		++m_generation;
+		std::vector<uint32_t> next = m_mode == LEFTMOST ? step_leftmost(m_sets[s / m_nfa.num_classes], b)
+		                                                : step_anchored(m_sets[s / m_nfa.num_classes], b);
+
+		if (m_sets.size() >= max_states && m_ids.find(next) == m_ids.end()) {
+			// Start again; @s is gone, so its transition can't be saved
+			reset();
+			return intern(std::move(next));
+		}
+		uint32_t t = intern(std::move(next));
+		m_table[s + m_nfa.classes[b]] = t;
+		return t;
+	}
+
+	std::vector<uint32_t> step_anchored(const std::vector<uint32_t>& from, uint8_t b)
+	{
+		std::vector<uint32_t> next;
+		for (uint32_t i : from) {
+			const regex_nfa::state& st = m_nfa.states[i];
+			if (st.type == regex_nfa::BYTE_SET && m_nfa.sets[st.set][b]) {
+				closure(st.out, next);
+			}
+		}
+		std::sort(next.begin(), next.end());
+		return next;
+	}
+
+	std::vector<uint32_t> step_leftmost(const std::vector<uint32_t>& from, uint8_t b)
+	{
+		std::vector<uint32_t> next;
+		bool matched = !from.empty() && from.back() == matched_mark;
+		bool accepted = false;
+
+		// Each start's NFA states go after a start_mark. An NFA state reached
+		// from an earlier start is already in, so the later one is dropped:
+		// whatever it leads to, the earlier start gets there first.
+		uint64_t open = UINT64_MAX;
+		auto finish = [&]() {
+			if (open == UINT64_MAX) {
+				return;
+			}
+			if (next.size() == open + 1) {
+				next.pop_back();
+			} else if (std::any_of(next.begin() + open + 1, next.end(), [&](uint32_t i) { return accepts(i); })) {
+				accepted = true;
+			}
+			open = UINT64_MAX;
+		};
+
+		for (uint32_t i : from) {
+			if (i == start_mark) {
+				finish();
+				if (accepted) {
+					// Starts after one that's matched can't be leftmost
+					break;
+				}
+				open = next.size();
+				next.push_back(start_mark);
+			} else if (i != matched_mark) {
+				const regex_nfa::state& st = m_nfa.states[i];
+				if (st.type == regex_nfa::BYTE_SET && m_nfa.sets[st.set][b]) {
+					closure(st.out, next);
+				}
+			}
+		}
+		finish();
+
+		if (!matched && !accepted) {
+			open = next.size();
+			next.push_back(start_mark);
+			closure(m_nfa.start, next);
+			finish();
+		}
+		if (!next.empty() && (matched || accepted)) {
+			next.push_back(matched_mark);
+		}
+		return next;
+	}
+
+	const regex_nfa& m_nfa;
+	const mode m_mode;
+
+	std::vector<uint32_t> m_table;
+	std::vector<std::vector<uint32_t>> m_sets;
+	std::map<std::vector<uint32_t>, uint32_t> m_ids;
+	std::vector<uint32_t> m_start_set;
+	uint32_t m_start;
+
+	std::vector<uint32_t> m_marks;
+	uint32_t m_generation;
+};
+
+/**
+ * A needle that matches a byte regular expression (see regex_parser for the
+ * syntax).
+ *
+ * Matches are leftmost-longest and don't overlap, like grep's: each search
+ * reports the match that starts first, for as long as it goes, then carries
+ * on from where it ends. Each match takes two passes, both linear in the
+ * bytes they read:
+ *
+ *  - a leftmost DFA (see regex_dfa) reads forward until it dies or the
+ *    haystack ends, to find where the match ends;
+ *  - a DFA for the reversed pattern reads back from there to find where it
+ *    starts.
+ *
+ * Fixed-length patterns skip the second pass, and counting skips it too.
+ * The longest literal string every match has to contain, and roughly
+ * where, is worked out from the pattern, and until a match is under way
+ * the fast literal search skips ahead to each occurrence of it.
+ */
+class regex_needle : public needle
+{
+public:
+	/**
+	 * Compile @pattern. Returns nullptr, with a description of the problem
+	 * in @error, if it isn't valid.
+	 */
+	static std::unique_ptr<regex_needle> compile(const std::string& pattern, std::string& error)
+	{
+		regex_node root;
+		regex_parser parser(pattern);
+		if (!parser.parse(root, error)) {
+			return nullptr;
+		}
+
+		auto ret = std::unique_ptr<regex_needle>(new regex_needle());
+		literal_info info = analyze(root);
+		if (info.min_len == 0) {
+			error = "pattern can match nothing at all";
+			return nullptr;
+		}
+		if (!ret->m_forward.build(root, false) || !ret->m_reverse.build(root, true)) {
+			error = "pattern is too big";
+			return nullptr;
+		}
+
+		ret->m_min_len = info.min_len;
+		ret->m_max_len = info.max_len;
+		ret->m_exact = info.exact;
+		ret->m_factor = info.exact ? info.literal : info.factor;
+		ret->m_factor_min = info.exact ? 0 : info.factor_min;
+		ret->m_factor_max = info.exact ? 0 : info.factor_max;
+		if (!ret->m_factor.empty()) {
+			ret->m_prefilter = search_engine::create(ret->m_factor.data(), ret->m_factor.size());
+		}
+		ret->m_cache = std::make_unique<dfas>(ret->m_forward, ret->m_reverse);
+		return ret;
+	}
+
+	regex_needle(const regex_needle& other) = delete;
+	regex_needle& operator=(const regex_needle& rhs) = delete;
+
+	/**
+	 * The longest a match can be, which is unbounded if the pattern has *,
+	 * + or {n,}.
+	 */
+	virtual uint64_t length() const override { return m_max_len; }
+
+	uint64_t min_length() const { return m_min_len; }
+
+	/**
+	 * The literal bytes every match contains, if any.
+	 */
+	const std::vector<uint8_t>& required() const { return m_factor; }
+
+	virtual bool disjoint() const override { return true; }
+
+	virtual uint64_t first_match(const buffer& haystack, uint64_t start = 0) const override
+	{
+		return with_dfas<uint64_t>([&](dfas& d) {
+			uint64_t match_len;
+			return find(haystack, start, d, match_len);
+		});
+	}
+
+	virtual bool for_each_match(const buffer& haystack, const match_visitor& visit, uint64_t start = 0) const override
+	{
+		return with_dfas<bool>([&](dfas& d) {
+			uint64_t match_len;
+			for (uint64_t i = find(haystack, start, d, match_len); i != UINT64_MAX;
+			     i = find(haystack, i + match_len, d, match_len)) {
+				if (!visit({ i, match_len, 0 })) {
+					return false;
+				}
+			}
+			return true;
+		});
+	}
+
+	/**
+	 * Only the forward pass is needed to count, and for the last match
+	 * counted, only as far as where it could first end.
+	 */
+	virtual uint64_t count(const buffer& haystack, uint64_t limit, uint64_t start = 0) const override
+	{
+		return with_dfas<uint64_t>([&](dfas& d) {
+			uint64_t ret = 0;
+			for (uint64_t i = start; ret < limit; ++ret) {
+				i = match_end(haystack, i, d, ret + 1 == limit);
+				if (i == UINT64_MAX) {
+					break;
+				}
+			}
+			return ret;
+		});
+	}
+
+private:
+	struct dfas
+	{
+		dfas(const regex_nfa& forward, const regex_nfa& reverse) :
+			forward(forward, regex_dfa::LEFTMOST),
+			reverse(reverse, regex_dfa::ANCHORED)
+		{}
+
+		regex_dfa forward;
+		regex_dfa reverse;
+	};
+
+	/**
+	 * What every string the pattern matches has in common.
+	 */
+	struct literal_info
+	{
+		uint64_t min_len = 0;
+		uint64_t max_len = 0;
+		bool exact = true;            // Only matches @literal
+		std::vector<uint8_t> literal;
+		std::vector<uint8_t> prefix;  // Every match starts with this...
+		std::vector<uint8_t> suffix;  // ...ends with this...
+		std::vector<uint8_t> factor;  // ...and contains this,
+		uint64_t factor_min = 0;      // this many bytes or more from the start
+		uint64_t factor_max = 0;      // and no more than this
+	};
+
+	regex_needle() = default;
+
+	static literal_info analyze(const regex_node& node)
+	{
+		literal_info ret;
+		switch (node.type) {
+		case regex_node::BYTES:
+			ret.min_len = ret.max_len = 1;
+			if (node.bytes.count() == 1) {
+				uint8_t b = 0;
+				while (!node.bytes[b]) ++b;
+				ret.literal = ret.prefix = ret.suffix = ret.factor = { b };
+			} else {
+				ret.exact = false;
+			}
+			return ret;
+		case regex_node::CONCAT:
+			for (const regex_node& child : node.children) {
+				ret = concat(ret, analyze(child));
+			}
+			return ret;
+		case regex_node::ALTERNATE: {
+			ret = analyze(node.children[0]);
+			for (auto it = node.children.begin() + 1; it != node.children.end(); ++it) {
+				literal_info other = analyze(*it);
+				ret.exact = ret.exact && other.exact && ret.literal == other.literal;
+				ret.min_len = std::min(ret.min_len, other.min_len);
+				ret.max_len = std::max(ret.max_len, other.max_len);
+				auto p = std::mismatch(ret.prefix.begin(), ret.prefix.end(), other.prefix.begin(), other.prefix.end());
+				ret.prefix.erase(p.first, ret.prefix.end());
+				auto s = std::mismatch(ret.suffix.rbegin(), ret.suffix.rend(), other.suffix.rbegin(), other.suffix.rend());
+				ret.suffix.erase(ret.suffix.begin(), s.first.base());
+			}
+			if (!ret.exact) {
+				ret.literal.clear();
+			}
+			// Only what the branches have in common is certain
+			ret.factor = ret.prefix;
+			ret.factor_min = ret.factor_max = 0;
+			if (ret.suffix.size() > ret.factor.size()) {
+				ret.factor = ret.suffix;
+				ret.factor_min = ret.min_len - ret.suffix.size();
+				ret.factor_max = minus_len(ret.max_len, ret.suffix.size());
+			}
+			return ret;
+		}
+		case regex_node::REPEAT: {
+			literal_info child = analyze(node.children[0]);
+			ret.min_len = child.min_len * node.min;
+			ret.max_len = node.max == regex_node::unbounded && child.max_len > 0
+			                  ? unbounded : times_len(child.max_len, node.max);
+			if (node.min == 0) {
+				ret.exact = node.max == 0;
+				return ret;
+			}
+			ret.exact = child.exact && node.min == node.max;
+			if (ret.exact) {
+				for (uint32_t i = 0; i < node.min; ++i) {
+					ret.literal.insert(ret.literal.end(), child.literal.begin(), child.literal.end());
+				}
+				ret.prefix = ret.suffix = ret.factor = ret.literal;
+				return ret;
+			}
+			ret.prefix = child.prefix;
+			ret.suffix = child.suffix;
+			ret.factor = child.factor;
+			ret.factor_min = child.factor_min;
+			ret.factor_max = child.factor_max;
+			return ret;
+		}
+		}
+		return ret;
+	}
+
+	/**
+	 * What's known about @a followed by @b.
+	 */
+	static literal_info concat(const literal_info& a, const literal_info& b)
+	{
+		literal_info ret;
+		ret.min_len = a.min_len + b.min_len;
+		ret.max_len = plus_len(a.max_len, b.max_len);
+		ret.exact = a.exact && b.exact;
+		if (ret.exact) {
+			ret.literal = a.literal;
+			ret.literal.insert(ret.literal.end(), b.literal.begin(), b.literal.end());
+			ret.prefix = ret.suffix = ret.factor = ret.literal;
+			return ret;
+		}
+
+		ret.prefix = a.prefix;
+		if (a.exact) {
+			ret.prefix.insert(ret.prefix.end(), b.prefix.begin(), b.prefix.end());
+		}
+		ret.suffix = b.suffix;
+		if (b.exact) {
+			ret.suffix.insert(ret.suffix.begin(), a.suffix.begin(), a.suffix.end());
+		}
+
+		// The longest of a's factor, b's factor, and where they meet
+		ret.factor = a.factor;
+		ret.factor_min = a.factor_min;
+		ret.factor_max = a.factor_max;
+		if (b.factor.size() > ret.factor.size()) {
+			ret.factor = b.factor;
+			ret.factor_min = a.min_len + b.factor_min;
+			ret.factor_max = plus_len(a.max_len, b.factor_max);
+		}
+		if (a.suffix.size() + b.prefix.size() > ret.factor.size()) {
+			ret.factor = a.suffix;
+			ret.factor.insert(ret.factor.end(), b.prefix.begin(), b.prefix.end());
+			ret.factor_min = a.min_len - a.suffix.size();
+			ret.factor_max = minus_len(a.max_len, a.suffix.size());
+		}
+		return ret;
+	}
+
+	/**
+	 * Arithmetic on match lengths, where anything involving an unbounded
+	 * length is unbounded.
+	 */
+	static uint64_t plus_len(uint64_t a, uint64_t b) { return a > unbounded - b ? unbounded : a + b; }
+	static uint64_t minus_len(uint64_t a, uint64_t b) { return a == unbounded ? unbounded : a - b; }
+	static uint64_t times_len(uint64_t a, uint64_t n) { return n > 0 && a > unbounded / n ? unbounded : a * n; }
+
+	/**
+	 * Run @f with the shared DFAs, or with fresh ones if another thread is
+	 * using them.
+	 */
+	template<typename R, typename F>
+	R with_dfas(F&& f) const
+	{
+		std::unique_lock<std::mutex> lock(m_lock, std::try_to_lock);
+		if (lock.owns_lock()) {
+			return f(*m_cache);
+		}
+		dfas local(m_forward, m_reverse);
+		return f(local);
+	}
+
+	/**
+	 * Run @f with the haystack's memory if it's contiguous, which is quicker
+	 * to read and is needed for the literal prefilter, or with the buffer
+	 * itself if not.
+	 */
+	template<typename F>
+	static uint64_t with_haystack(const buffer& haystack, F&& f)
+	{
+		std::span<const uint8_t> hay = haystack.span();
+		if (hay.size() == haystack.length()) {
+			return f(hay.data(), hay.data(), hay.size());
+		}
+		return f(haystack, (const uint8_t*)nullptr, haystack.length());
+	}
+
+	/**
+	 * The leftmost-longest match starting at or after @start, with its
+	 * length in @match_len.
+	 */
+	uint64_t find(const buffer& haystack, uint64_t start, dfas& d, uint64_t& match_len) const
+	{
+		return with_haystack(haystack, [&](const auto& hay, const uint8_t* raw, uint64_t len) {
+			uint64_t end = match_end(hay, raw, len, start, d, false);
+			if (end == UINT64_MAX) {
+				return UINT64_MAX;
+			}
+			uint64_t first = match_start(hay, start, end, d);
+			match_len = end - first;
+			return first;
+		});
+	}
+
+	uint64_t match_end(const buffer& haystack, uint64_t start, dfas& d, bool any) const
+	{
+		return with_haystack(haystack, [&](const auto& hay, const uint8_t* raw, uint64_t len) {
+			return match_end(hay, raw, len, start, d, any);
+		});
+	}
+
+	/**
+	 * Where the leftmost-longest match starting at or after @start ends, or
+	 * with @any, where the first match to end does: that's enough to know
+	 * there is one.
+	 */
+	template<typename H>
+	uint64_t match_end(const H& hay, const uint8_t* raw, uint64_t len, uint64_t start, dfas& d, bool any) const
+	{
+		if (start >= len || len - start < m_min_len) {
+			return UINT64_MAX;
+		}
+
+		const bool prefilter = raw && m_prefilter;
+		if (prefilter && m_exact) {
+			uint64_t i = m_prefilter->find(raw, len, start);
+			return i == UINT64_MAX ? i : i + m_factor.size();
+		}
+
+		// Run the DFA until a match ends; it can't die before then, since it
+		// starts a match at every byte. Every match contains an occurrence
+		// of the factor, so with the prefilter, while no match is under way,
+		// skip to the first place a match containing the next one could start.
+		uint64_t occurrence = 0;
+		const uint32_t initial = d.forward.start();
+		uint32_t s = initial;
+		uint64_t i = start;
+		if (!prefilter) {
+			// Kept apart, since checking for the prefilter slows every byte
+			for (; i < len; ++i) {
+				s = d.forward.step(s, hay[i]);
+				if (s & regex_dfa::accept_flag) {
+					break;
+				}
+			}
+		} else {
+			for (; i < len; ++i) {
+				if (s == initial) {
+					if (occurrence < i + m_factor_min) {
+						occurrence = m_prefilter->find(raw, len, i + m_factor_min);
+						if (occurrence == UINT64_MAX) {
+							return UINT64_MAX;
+						}
+					}
+					if (m_factor_max != unbounded && occurrence > i + m_factor_max) {
+						i = occurrence - m_factor_max;
+					}
+				}
+				s = d.forward.step(s, hay[i]);
+				if (s & regex_dfa::accept_flag) {
+					break;
+				}
+			}
+		}
+		if (i == len) {
+			return UINT64_MAX;
+		}
+
+		// The first end of a fixed-length match is the only one; otherwise
+		// the match goes on for as long as the DFA accepts before it dies
+		uint64_t end = ++i;
+		if (any || m_min_len == m_max_len) {
+			return end;
+		}
+		for (s &= ~regex_dfa::accept_flag; i < len && s != regex_dfa::dead; ++i) {
+			s = d.forward.step(s, hay[i]);
+			if (s & regex_dfa::accept_flag) {
+				end = i + 1;
+				s &= ~regex_dfa::accept_flag;
+			}
+		}
+		return end;
+	}
+
+	/**
+	 * Where the leftmost match ending at @end starts, no earlier than @start.
+	 */
+	template<typename H>
+	uint64_t match_start(const H& hay, uint64_t start, uint64_t end, dfas& d) const
+	{
+		if (m_min_len == m_max_len) {
+			return end - m_max_len;
+		}
+
+		uint64_t ret = end;
+		uint32_t s = d.reverse.start();
+		for (uint64_t i = end; i > start; --i) {
+			uint32_t t = d.reverse.step(s, hay[i - 1]);
+			if (t & regex_dfa::accept_flag) {
+				ret = i - 1;
+			}
+			s = t & ~regex_dfa::accept_flag;
+			if (s == regex_dfa::dead) {
+				break;
+			}
+		}
+		return ret;
+	}
+
+	regex_nfa m_forward;
+	regex_nfa m_reverse;
+	uint64_t m_min_len = 0;
+	uint64_t m_max_len = 0;
+	bool m_exact = false;
+	std::vector<uint8_t> m_factor;
+	uint64_t m_factor_min = 0;
+	uint64_t m_factor_max = 0;
+	std::unique_ptr<search_engine> m_prefilter;
+
+	mutable std::mutex m_lock;
+	mutable std::unique_ptr<dfas> m_cache;
+};
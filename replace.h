@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "output.h"
+
+/**
+ * Replaces the matches of a needle in files.
+ *
+ * Matches are replaced from the start of the file and never overlap: a match
+ * that starts inside one already replaced is skipped.
+ *
+ * When every match is as long as the replacement, the file is patched in
+ * place through a shared mapping, so only the pages holding a match are
+ * written back no matter how big the file is. Otherwise the file is
+ * rewritten: the unchanged stretches and the replacements are streamed into
+ * a temporary file next to it, which is then renamed over the original.
+ * Symlinks are followed, so it's the file they point to that's replaced,
+ * with its mode and owner kept. Files with other hard links aren't
+ * rewritten, since the other links would keep the old contents.
+ */
+class replacer
+{
+public:
+	/**
+	 * Called with each match before it's replaced. @buf holds the file.
+	 */
+	using match_callback = std::function<void(const buffer& buf, const needle_match& match)>;
+
+	/**
+	 * @fixed_len says every match of @n is needle.length() bytes long (as
+	 * opposed to a needle with several patterns of different lengths).
+	 * At most @limit matches are replaced in each file. With @dry_run, the
+	 * matches are found and counted but nothing is written.
+	 */
+	replacer(const needle& n, const std::vector<uint8_t>& replacement, bool fixed_len,
+	         uint64_t limit = UINT64_MAX, bool dry_run = false) :
+		m_needle(n),
+		m_replacement(replacement),
+		m_in_place(fixed_len && n.length() == replacement.size()),
+		m_limit(limit),
+		m_dry_run(dry_run)
+	{}
+
+	/**
+	 * Whether files are patched in place rather than rewritten.
+	 */
+	bool in_place() const { return m_in_place; }
+
+	/**
+	 * Replace the matches in @path.
+	 *
+	 * Returns the number of matches replaced (or that would be, for a dry
+	 * run), or UINT64_MAX if the file couldn't be read or written. For some
+	 * failures, @error (if given) is set to say why.
+	 */
+	uint64_t run(const std::filesystem::path& path, const match_callback& cb = nullptr,
+	             std::string* error = nullptr) const
+	{
+		std::error_code ec;
+		if (!std::filesystem::is_regular_file(path, ec)) {
+			return UINT64_MAX;
+		}
+		if (std::filesystem::file_size(path, ec) == 0) {
+			return ec ? UINT64_MAX : 0;
+		}
+
+		if (m_dry_run) {
+			mmapbuf buf(path);
+			if (buf.length() == 0) {
+				return UINT64_MAX;
+			}
+			return each_match(buf, [&](const needle_match& m) {
+				if (cb) cb(buf, m);
+			});
+		}
+
+		return m_in_place ? patch(path, cb) : rewrite(path, cb, error);
+	}
+
+private:
+	/**
+	 * Call @f with each match that's to be replaced, returning how many
+	 * there were.
+	 */
+	template<typename F>
+	uint64_t each_match(const buffer& buf, F&& f) const
+	{
+		uint64_t count = 0;
+		uint64_t next = 0;
+		m_needle.for_each_match(buf, [&](const needle_match& m) {
+			if (m.offset < next) {
+				return true;
+			}
+			if (count == m_limit) {
+				return false;
+			}
+			f(m);
+			++count;
+			next = m.offset + m.length;
+			return true;
+		});
+		return count;
+	}
+
+	uint64_t patch(const std::filesystem::path& path, const match_callback& cb) const
+	{
+		mmapbuf buf(path, true);
+		if (buf.length() == 0) {
+			return UINT64_MAX;
+		}
+
+		// Later matches never reach back into a replaced one, so patching
+		// as we go doesn't change what's found
+		uint8_t* data = const_cast<uint8_t*>(buf.span().data());
+		return each_match(buf, [&](const needle_match& m) {
+			if (cb) cb(buf, m);
+			memcpy(data + m.offset, m_replacement.data(), m_replacement.size());
+		});
+	}
+
+	uint64_t rewrite(const std::filesystem::path& link, const match_callback& cb, std::string* error) const
+	{
+		// Write the new file next to the one any symlinks lead to, and rename
+		// it over that one, so the links still lead to it
+		std::error_code ec;
+		const std::filesystem::path path = std::filesystem::canonical(link, ec);
+		if (ec) {
+			return UINT64_MAX;
+		}
+
+		mmapbuf buf(path);
+		if (buf.length() == 0) {
+			return UINT64_MAX;
+		}
+		if (m_limit == 0 || m_needle.first_match(buf) == UINT64_MAX) {
+			return 0;
+		}
+
+		struct stat st;
+		if (stat(path.c_str(), &st) < 0) {
+			return UINT64_MAX;
+		}
+		if (st.st_nlink > 1) {
+			if (error) {
+				*error = "it has other hard links, which would keep the old contents";
+			}
+			return UINT64_MAX;
+		}
+
+		std::string tmp_path = path.string() + ".XXXXXX";
+		int fd = mkstemp(tmp_path.data());
+		if (fd < 0) {
+			return UINT64_MAX;
+		}
+
+		const char* data = (const char*)buf.span().data();
+		const char* replacement = (const char*)m_replacement.data();
+		uint64_t written = 0;
+		uint64_t count;
+		bool ok;
+		{
+			output_writer out(fd);
+			count = each_match(buf, [&](const needle_match& m) {
+				if (cb) cb(buf, m);
+				out.write(data + written, m.offset - written);
+				out.write(replacement, m_replacement.size());
+				written = m.offset + m.length;
+			});
+			out.write(data + written, buf.length() - written);
+			ok = out.flush();
+		}
+
+		// The owner goes first, since changing it can clear setuid bits
+		if (ok && fchown(fd, st.st_uid, st.st_gid) < 0) {
+			if (error) {
+				*error = "its owner and group couldn't be kept";
+			}
+			ok = false;
+		}
+		ok = ok && fchmod(fd, st.st_mode & 07777) == 0 && fsync(fd) == 0;
+		ok = close(fd) == 0 && ok;
+		if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+			unlink(tmp_path.c_str());
+			return UINT64_MAX;
+		}
+		return count;
+	}
+
+	const needle& m_needle;
+	const std::vector<uint8_t> m_replacement;
+	const bool m_in_place;
+	const uint64_t m_limit;
+	const bool m_dry_run;
+};
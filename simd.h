@@ -0,0 +1,1039 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GB_SIMD_X86 1
+#endif
+
+/**
+ * Vectorized substring search over contiguous memory.
+ *
+ * Each block of the haystack is compared against the first and the last
+ * byte of the needle at once, and the two results are ANDed into a bitmask.
+ * Only the offsets whose bit survives are verified with memcmp, so on data
+ * where the first byte alone is common (text, zero-filled images) very few
+ * full comparisons are made.
+ *
+ * The widest instruction set the CPU supports is picked at runtime.
+ */
+class simd_search
+{
+public:
+	enum level
+	{
+		SCALAR,
+		SSE2,
+		AVX2,
+		AVX512,
+	};
+
+	/**
+	 * The widest level the running CPU supports.
+	 */
+	static level best_level()
+	{
+#ifdef GB_SIMD_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512bw")) return AVX512;
+		if (__builtin_cpu_supports("avx2")) return AVX2;
+		return SSE2;
+#else
+		return SCALAR;
+#endif
+	}
+
+	static bool supported(level l) { return l <= best_level(); }
+
+	static const char* level_name(level l)
+	{
+		switch (l) {
+		case SCALAR: return "scalar";
+		case SSE2: return "sse2";
+		case AVX2: return "avx2";
+		case AVX512: return "avx512";
+		}
+		return "unknown";
+	}
+
+	/**
+	 * Find the first occurrence of @needle in @haystack at or after @start.
+	 *
+	 * Returns the offset, or UINT64_MAX if not found.
+	 */
+	static uint64_t find(const uint8_t* haystack, uint64_t len,
+	                     const uint8_t* needle, uint64_t needle_len,
+	                     uint64_t start = 0)
+	{
+		static const level l = best_level();
+		return find(l, haystack, len, needle, needle_len, start);
+	}
+
+	/**
+	 * As above, but using a specific instruction set (which must be
+	 * supported). Mostly useful for benchmarks and tests.
+	 */
+	static uint64_t find(level l,
+	                     const uint8_t* haystack, uint64_t len,
+	                     const uint8_t* needle, uint64_t needle_len,
+	                     uint64_t start = 0)
+	{
+		if (needle_len == 0 || needle_len > len || start > len - needle_len) {
+			return UINT64_MAX;
+		}
+
+		return find_with(l, haystack, len, needle[0], needle[needle_len - 1], needle_len, start,
+		                 [=](const uint8_t* pos) { return verify(pos, needle, needle_len); });
+	}
+
+	/**
+	 * A needle of N to 2N - 1 bytes, for N = 2, 4, 8 or 16, kept as its first
+	 * and last N bytes. A candidate is checked with one unaligned load and
+	 * compare of each, rather than a call to memcmp of a runtime length.
+	 */
+	template <uint64_t N>
+	struct short_pattern
+	{
+		static_assert(N == 2 || N == 4 || N == 8 || N == 16);
+
+		static bool fits(uint64_t len) { return len >= N && len < 2 * N; }
+
+		short_pattern(const uint8_t* needle, uint64_t len) :
+			len(len)
+		{
+			memcpy(head, needle, N);
+			memcpy(tail, needle + len - N, N);
+		}
+
+		bool operator()(const uint8_t* pos) const
+		{
+			return equal(pos, head) && equal(pos + len - N, tail);
+		}
+
+		uint64_t len;
+		alignas(N) uint8_t head[N];
+		alignas(N) uint8_t tail[N];
+
+	private:
+		static bool equal(const uint8_t* a, const uint8_t* b)
+		{
+			if constexpr (N == 16) {
+#ifdef GB_SIMD_X86
+				__m128i x = _mm_loadu_si128((const __m128i*)a);
+				__m128i y = _mm_load_si128((const __m128i*)b);
+				return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xffff;
+#else
+				uint64_t x[2], y[2];
+				memcpy(x, a, N);
+				memcpy(y, b, N);
+				return ((x[0] ^ y[0]) | (x[1] ^ y[1])) == 0;
+#endif
+			} else {
+				using word = std::conditional_t<N == 2, uint16_t,
+				             std::conditional_t<N == 4, uint32_t, uint64_t>>;
+				word x, y;
+				memcpy(&x, a, N);
+				memcpy(&y, b, N);
+				return x == y;
+			}
+		}
+	};
+
+	/**
+	 * Find the first occurrence of a short needle in @haystack at or after
+	 * @start, using the same first/last byte filter as find().
+	 *
+	 * Returns the offset, or UINT64_MAX if not found.
+	 */
+	template <uint64_t N>
+	static uint64_t find_short(const uint8_t* haystack, uint64_t len,
+	                           const short_pattern<N>& needle, uint64_t start = 0)
+	{
+		static const level l = best_level();
+		return find_short(l, haystack, len, needle, start);
+	}
+
+	template <uint64_t N>
+	static uint64_t find_short(level l, const uint8_t* haystack, uint64_t len,
+	                           const short_pattern<N>& needle, uint64_t start = 0)
+	{
+		if (needle.len > len || start > len - needle.len) {
+			return UINT64_MAX;
+		}
+		return find_with(l, haystack, len, needle.head[0], needle.tail[N - 1], needle.len, start, needle);
+	}
+
+	/**
+	 * A needle where only some bits of each byte have to match:
+	 * (haystack[i] & mask[i]) == bytes[i]. The bytes must already be masked.
+	 *
+	 * Candidates are found by comparing two anchor bytes, like the first and
+	 * last bytes of a plain needle; anchors() picks the most specific ones.
+	 */
+	struct masked_pattern
+	{
+		const uint8_t* bytes;
+		const uint8_t* mask;
+		uint64_t len;
+		uint64_t first; // Anchor positions
+		uint64_t last;
+
+		masked_pattern(const uint8_t* bytes, const uint8_t* mask, uint64_t len) :
+			bytes(bytes),
+			mask(mask),
+			len(len),
+			first(0),
+			last(0)
+		{
+			anchors();
+		}
+
+	private:
+		/**
+		 * Use the first and last of the bytes with the most mask bits set, so
+		 * a fully known byte is always preferred to a partly known one.
+		 */
+		void anchors()
+		{
+			int best = -1;
+			for (uint64_t i = 0; i < len; ++i) {
+				int bits = __builtin_popcount(mask[i]);
+				if (bits > best) {
+					best = bits;
+					first = last = i;
+				} else if (bits == best) {
+					last = i;
+				}
+			}
+		}
+	};
+
+	/**
+	 * Find the first match of a masked needle in @haystack at or after
+	 * @start.
+	 *
+	 * Returns the offset, or UINT64_MAX if not found.
+	 */
+	static uint64_t find_masked(const uint8_t* haystack, uint64_t len,
+	                            const masked_pattern& needle, uint64_t start = 0)
+	{
+		static const level l = best_level();
+		return find_masked(l, haystack, len, needle, start);
+	}
+
+	static uint64_t find_masked(level l, const uint8_t* haystack, uint64_t len,
+	                            const masked_pattern& needle, uint64_t start = 0)
+	{
+		if (needle.len == 0 || needle.len > len || start > len - needle.len) {
+			return UINT64_MAX;
+		}
+
+		switch (l) {
+#ifdef GB_SIMD_X86
+		case AVX512: return find_masked_avx512(haystack, len, needle, start);
+		case AVX2: return find_masked_avx2(haystack, len, needle, start);
+		case SSE2: return find_masked_sse2(haystack, len, needle, start);
+#endif
+		default: return find_masked_scalar(haystack, len, needle, start);
+		}
+	}
+
+	/**
+	 * Find the first offset at or after @start where @haystack differs from
+	 * @needle in at most @max_distance bytes, and set @distance to how many
+	 * it differs in (the Hamming distance).
+	 *
+	 * With a budget of mismatches to spend there's no byte that a candidate
+	 * must have, so every offset is tested: a vector of consecutive offsets
+	 * at a time, comparing each needle byte against all of them at once and
+	 * taking one from each offset's budget when it differs (with saturation).
+	 * The vector is given up on as soon as every budget has run out, which
+	 * on most data is within the first few needle bytes.
+	 *
+	 * Returns the offset, or UINT64_MAX if not found.
+	 */
+	static uint64_t find_approx(const uint8_t* haystack, uint64_t len,
+	                            const uint8_t* needle, uint64_t needle_len,
+	                            uint32_t max_distance, uint32_t& distance, uint64_t start = 0)
+	{
+		static const level l = best_level();
+		return find_approx(l, haystack, len, needle, needle_len, max_distance, distance, start);
+	}
+
+	static uint64_t find_approx(level l, const uint8_t* haystack, uint64_t len,
+	                            const uint8_t* needle, uint64_t needle_len,
+	                            uint32_t max_distance, uint32_t& distance, uint64_t start = 0)
+	{
+		if (needle_len == 0 || needle_len > len || start > len - needle_len) {
+			return UINT64_MAX;
+		}
+
+		// The budgets are bytes, so bigger ones have to be counted one by one
+		if (max_distance < 255) {
+			switch (l) {
+#ifdef GB_SIMD_X86
+			case AVX512: return find_approx_avx512(haystack, len, needle, needle_len, max_distance, distance, start);
+			case AVX2: return find_approx_avx2(haystack, len, needle, needle_len, max_distance, distance, start);
+			case SSE2: return find_approx_sse2(haystack, len, needle, needle_len, max_distance, distance, start);
+#endif
+			default: break;
+			}
+		}
+		return find_approx_scalar(haystack, len, needle, needle_len, max_distance, distance, start);
+	}
+
+	/**
+	 * Numbers of type T (an 8 to 64 bit integer, float or double) from lo
+	 * to hi inclusive, stored little- or big-endian at offsets that are a
+	 * multiple of align, which must be a power of two.
+	 */
+	template <class T>
+	struct value_range
+	{
+		static_assert(std::is_arithmetic_v<T> && (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8));
+
+		T lo;
+		T hi;
+		bool big_endian;
+		uint64_t align;
+
+		bool contains(T value) const { return value >= lo && value <= hi; }
+
+		/**
+		 * The value stored at @pos.
+		 */
+		T load(const uint8_t* pos) const
+		{
+			using bits = std::conditional_t<sizeof(T) == 1, uint8_t,
+			             std::conditional_t<sizeof(T) == 2, uint16_t,
+			             std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>>>;
+			bits b;
+			memcpy(&b, pos, sizeof(T));
+			if (big_endian) {
+				if constexpr (sizeof(T) == 2) b = __builtin_bswap16(b);
+				if constexpr (sizeof(T) == 4) b = __builtin_bswap32(b);
+				if constexpr (sizeof(T) == 8) b = __builtin_bswap64(b);
+			}
+			T value;
+			memcpy(&value, &b, sizeof(T));
+			return value;
+		}
+	};
+
+	/**
+	 * Find the first offset at or after @start, and a multiple of the
+	 * range's alignment, where the value stored falls in @range.
+	 *
+	 * A vector of values is loaded and range-checked at once. Values that
+	 * can start at any offset take one vector per byte of the type, each
+	 * shifted by a byte, to cover every offset in the block.
+	 *
+	 * Returns the offset, or UINT64_MAX if not found.
+	 */
+	template <class T>
+	static uint64_t find_range(const uint8_t* haystack, uint64_t len, const value_range<T>& range, uint64_t start = 0)
+	{
+		static const level l = best_level();
+		return find_range(l, haystack, len, range, start);
+	}
+
+	template <class T>
+	static uint64_t find_range(level l, const uint8_t* haystack, uint64_t len,
+	                           const value_range<T>& range, uint64_t start = 0)
+	{
+		start = (start + range.align - 1) & ~(range.align - 1);
+		if (sizeof(T) > len || start > len - sizeof(T)) {
+			return UINT64_MAX;
+		}
+
+		// SSE2 has no byte shuffles or 64-bit compares, so it's left to the
+		// scalar loop
+		switch (l) {
+#ifdef GB_SIMD_X86
+		case AVX512: return find_range_avx512(haystack, len, range, start);
+		case AVX2: return find_range_avx2(haystack, len, range, start);
+#endif
+		default: return find_range_scalar(haystack, len, range, start);
+		}
+	}
+
+private:
+	/**
+	 * Run the first/last byte filter at level @l, checking each candidate
+	 * with @verify, and counting the candidates if --stats wants them.
+	 */
+	template <class Verify>
+	static uint64_t find_with(level l, const uint8_t* haystack, uint64_t len,
+	                          uint8_t first, uint8_t last, uint64_t needle_len,
+	                          uint64_t start, const Verify& verify)
+	{
+		if (search_stats* stats = search_stats::active()) [[unlikely]] {
+			// Count into locals, and only touch the shared counters once
+			uint64_t candidates = 0;
+			uint64_t verified = 0;
+			uint64_t found = dispatch(l, haystack, len, first, last, needle_len, start,
+			                          [&](const uint8_t* pos) {
+				++candidates;
+				bool ok = verify(pos);
+				verified += ok;
+				return ok;
+			});
+			stats->candidates += candidates;
+			stats->verified += verified;
+			return found;
+		}
+		return dispatch(l, haystack, len, first, last, needle_len, start, verify);
+	}
+
+	template <class Verify>
+	static uint64_t dispatch(level l, const uint8_t* haystack, uint64_t len,
+	                         uint8_t first, uint8_t last, uint64_t needle_len,
+	                         uint64_t start, const Verify& verify)
+	{
+		switch (l) {
+#ifdef GB_SIMD_X86
+		case AVX512: return find_avx512(haystack, len, first, last, needle_len, start, verify);
+		case AVX2: return find_avx2(haystack, len, first, last, needle_len, start, verify);
+		case SSE2: return find_sse2(haystack, len, first, last, needle_len, start, verify);
+#endif
+		default: return find_scalar(haystack, len, first, last, needle_len, start, verify);
+		}
+	}
+
+	/**
+	 * Check a candidate whose first and last bytes are already known to match.
+	 */
+	static bool verify(const uint8_t* pos, const uint8_t* needle, uint64_t needle_len)
+	{
+		return needle_len <= 2 || memcmp(pos + 1, needle + 1, needle_len - 2) == 0;
+	}
+
+	template <class Verify>
+	static uint64_t find_scalar(const uint8_t* haystack, uint64_t len,
+	                            uint8_t first, uint8_t last, uint64_t needle_len,
+	                            uint64_t i, const Verify& verify)
+	{
+		const uint64_t upto = len - needle_len;
+
+		while (i <= upto) {
+			const uint8_t* p = (const uint8_t*)memchr(haystack + i, first, upto - i + 1);
+			if (!p) break;
+			i = p - haystack;
+			if (p[needle_len - 1] == last && verify(p)) {
+				return i;
+			}
+			++i;
+		}
+		return UINT64_MAX;
+	}
+
+	static bool verify_masked_scalar(const uint8_t* pos, const masked_pattern& needle, uint64_t i = 0)
+	{
+		for (; i < needle.len; ++i) {
+			if ((pos[i] & needle.mask[i]) != needle.bytes[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static uint64_t find_masked_scalar(const uint8_t* haystack, uint64_t len,
+	                                   const masked_pattern& needle, uint64_t i)
+	{
+		const uint64_t upto = len - needle.len;
+		const uint8_t first = needle.bytes[needle.first];
+		const uint8_t first_mask = needle.mask[needle.first];
+
+		for (; i <= upto; ++i) {
+			if ((haystack[i + needle.first] & first_mask) == first
+			    && verify_masked_scalar(haystack + i, needle)) {
+				return i;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+	template <class T>
+	static uint64_t find_range_scalar(const uint8_t* haystack, uint64_t len, const value_range<T>& range, uint64_t i)
+	{
+		for (; i + sizeof(T) <= len; i += range.align) {
+			if (range.contains(range.load(haystack + i))) {
+				return i;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+	static uint64_t find_approx_scalar(const uint8_t* haystack, uint64_t len,
+	                                   const uint8_t* needle, uint64_t needle_len,
+	                                   uint32_t max_distance, uint32_t& distance, uint64_t i)
+	{
+		const uint64_t upto = len - needle_len;
+
+		for (; i <= upto; ++i) {
+			uint64_t mismatches = 0;
+			for (uint64_t j = 0; j < needle_len && mismatches <= max_distance; ++j) {
+				mismatches += haystack[i + j] != needle[j];
+			}
+			if (mismatches <= max_distance) {
+				distance = mismatches;
+				return i;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+#ifdef GB_SIMD_X86
+	template <class Verify>
+	__attribute__((target("sse2")))
+	static uint64_t find_sse2(const uint8_t* haystack, uint64_t len,
+	                          uint8_t first_byte, uint8_t last_byte, uint64_t needle_len,
+	                          uint64_t i, const Verify& verify)
+	{
+		const __m128i first = _mm_set1_epi8(first_byte);
+		const __m128i last = _mm_set1_epi8(last_byte);
+		const uint64_t positions = len - needle_len + 1;
+
+		for (; i + 16 <= positions; i += 16) {
+			__m128i block_first = _mm_loadu_si128((const __m128i*)(haystack + i));
+			__m128i block_last = _mm_loadu_si128((const __m128i*)(haystack + i + needle_len - 1));
+			uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+			                                                _mm_cmpeq_epi8(block_last, last)));
+			while (mask) {
+				uint64_t pos = i + __builtin_ctz(mask);
+				if (verify(haystack + pos)) {
+					return pos;
+				}
+				mask &= mask - 1;
+			}
+		}
+		return find_scalar(haystack, len, first_byte, last_byte, needle_len, i, verify);
+	}
+
+	template <class Verify>
+	__attribute__((target("avx2")))
+	static uint64_t find_avx2(const uint8_t* haystack, uint64_t len,
+	                          uint8_t first_byte, uint8_t last_byte, uint64_t needle_len,
+	                          uint64_t i, const Verify& verify)
+	{
+		const __m256i first = _mm256_set1_epi8(first_byte);
+		const __m256i last = _mm256_set1_epi8(last_byte);
+		const uint64_t positions = len - needle_len + 1;
+
+		for (; i + 32 <= positions; i += 32) {
+			__m256i block_first = _mm256_loadu_si256((const __m256i*)(haystack + i));
+			__m256i block_last = _mm256_loadu_si256((const __m256i*)(haystack + i + needle_len - 1));
+			uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+			                                                      _mm256_cmpeq_epi8(block_last, last)));
+			while (mask) {
+				uint64_t pos = i + __builtin_ctz(mask);
+				if (verify(haystack + pos)) {
+					return pos;
+				}
+				mask &= mask - 1;
+			}
+		}
+		return find_sse2(haystack, len, first_byte, last_byte, needle_len, i, verify);
+	}
+
+	template <class Verify>
+	__attribute__((target("avx512f,avx512bw")))
+	static uint64_t find_avx512(const uint8_t* haystack, uint64_t len,
+	                            uint8_t first_byte, uint8_t last_byte, uint64_t needle_len,
+	                            uint64_t i, const Verify& verify)
+	{
+		const __m512i first = _mm512_set1_epi8(first_byte);
+		const __m512i last = _mm512_set1_epi8(last_byte);
+		const uint64_t positions = len - needle_len + 1;
+
+		for (; i + 64 <= positions; i += 64) {
+			__m512i block_first = _mm512_loadu_si512((const void*)(haystack + i));
+			__m512i block_last = _mm512_loadu_si512((const void*)(haystack + i + needle_len - 1));
+			uint64_t mask = _mm512_cmpeq_epi8_mask(block_first, first)
+			              & _mm512_cmpeq_epi8_mask(block_last, last);
+			while (mask) {
+				uint64_t pos = i + __builtin_ctzll(mask);
+				if (verify(haystack + pos)) {
+					return pos;
+				}
+				mask &= mask - 1;
+			}
+		}
+		return find_avx2(haystack, len, first_byte, last_byte, needle_len, i, verify);
+	}
+
+	/*
+	 * The masked kernels: AND each anchor block with its mask before the
+	 * compare, then verify candidates a vector at a time the same way.
+	 */
+	__attribute__((target("sse2")))
+	static bool verify_masked_sse2(const uint8_t* pos, const masked_pattern& needle)
+	{
+		uint64_t i = 0;
+		for (; i + 16 <= needle.len; i += 16) {
+			__m128i hay = _mm_loadu_si128((const __m128i*)(pos + i));
+			__m128i mask = _mm_loadu_si128((const __m128i*)(needle.mask + i));
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(needle.bytes + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(hay, mask), bytes)) != 0xffff) {
+				return false;
+			}
+		}
+		return verify_masked_scalar(pos, needle, i);
+	}
+
+	__attribute__((target("sse2")))
+	static uint64_t find_masked_sse2(const uint8_t* haystack, uint64_t len,
+	                                 const masked_pattern& needle, uint64_t i)
+	{
+		const __m128i first = _mm_set1_epi8(needle.bytes[needle.first]);
+		const __m128i first_mask = _mm_set1_epi8(needle.mask[needle.first]);
+		const __m128i last = _mm_set1_epi8(needle.bytes[needle.last]);
+		const __m128i last_mask = _mm_set1_epi8(needle.mask[needle.last]);
+		const uint64_t positions = len - needle.len + 1;
+
+		for (; i + 16 <= positions; i += 16) {
+			__m128i block_first = _mm_loadu_si128((const __m128i*)(haystack + i + needle.first));
+			__m128i block_last = _mm_loadu_si128((const __m128i*)(haystack + i + needle.last));
+			uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(_mm_and_si128(block_first, first_mask), first),
+				_mm_cmpeq_epi8(_mm_and_si128(block_last, last_mask), last)));
+			while (mask) {
+				uint64_t pos = i + __builtin_ctz(mask);
+				if (verify_masked_sse2(haystack + pos, needle)) {
+					return pos;
+				}
+				mask &= mask - 1;
+			}
+		}
+		return find_masked_scalar(haystack, len, needle, i);
+	}
+
+	__attribute__((target("avx2")))
+	static bool verify_masked_avx2(const uint8_t* pos, const masked_pattern& needle)
+	{
+		uint64_t i = 0;
+		for (; i + 32 <= needle.len; i += 32) {
+			__m256i hay = _mm256_loadu_si256((const __m256i*)(pos + i));
+			__m256i mask = _mm256_loadu_si256((const __m256i*)(needle.mask + i));
+			__m256i bytes = _mm256_loadu_si256((const __m256i*)(needle.bytes + i));
+			if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(hay, mask), bytes)) != 0xffffffff) {
+				return false;
+			}
+		}
+		return verify_masked_scalar(pos, needle, i);
+	}
+
+	__attribute__((target("avx2")))
+	static uint64_t find_masked_avx2(const uint8_t* haystack, uint64_t len,
+	                                 const masked_pattern& needle, uint64_t i)
+	{
+		const __m256i first = _mm256_set1_epi8(needle.bytes[needle.first]);
+		const __m256i first_mask = _mm256_set1_epi8(needle.mask[needle.first]);
+		const __m256i last = _mm256_set1_epi8(needle.bytes[needle.last]);
+		const __m256i last_mask = _mm256_set1_epi8(needle.mask[needle.last]);
+		const uint64_t positions = len - needle.len + 1;
+
+		for (; i + 32 <= positions; i += 32) {
+			__m256i block_first = _mm256_loadu_si256((const __m256i*)(haystack + i + needle.first));
+			__m256i block_last = _mm256_loadu_si256((const __m256i*)(haystack + i + needle.last));
+			uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(_mm256_and_si256(block_first, first_mask), first),
+				_mm256_cmpeq_epi8(_mm256_and_si256(block_last, last_mask), last)));
+			while (mask) {
+				uint64_t pos = i + __builtin_ctz(mask);
+				if (verify_masked_avx2(haystack + pos, needle)) {
+					return pos;
+				}
+				mask &= mask - 1;
+			}
+		}
+		return find_masked_sse2(haystack, len, needle, i);
+	}
+
+	/**
+	 * With AVX-512 the tail of the needle is loaded with a byte mask, so
+	 * verifying never falls back to a byte loop.
+	 */
+	__attribute__((target("avx512f,avx512bw")))
+	static bool verify_masked_avx512(const uint8_t* pos, const masked_pattern& needle)
+	{
+		for (uint64_t i = 0; i < needle.len; i += 64) {
+			uint64_t left = needle.len - i;
+			__mmask64 k = left >= 64 ? ~0ull : (1ull << left) - 1;
+			__m512i hay = _mm512_maskz_loadu_epi8(k, pos + i);
+			__m512i mask = _mm512_maskz_loadu_epi8(k, needle.mask + i);
+			__m512i bytes = _mm512_maskz_loadu_epi8(k, needle.bytes + i);
+			if (_mm512_cmpeq_epi8_mask(_mm512_and_si512(hay, mask), bytes) != (uint64_t)~0ull) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	__attribute__((target("avx512f,avx512bw")))
+	static uint64_t find_masked_avx512(const uint8_t* haystack, uint64_t len,
+	                                   const masked_pattern& needle, uint64_t i)
+	{
+		const __m512i first = _mm512_set1_epi8(needle.bytes[needle.first]);
+		const __m512i first_mask = _mm512_set1_epi8(needle.mask[needle.first]);
+		const __m512i last = _mm512_set1_epi8(needle.bytes[needle.last]);
+		const __m512i last_mask = _mm512_set1_epi8(needle.mask[needle.last]);
+		const uint64_t positions = len - needle.len + 1;
+
+		for (; i + 64 <= positions; i += 64) {
+			__m512i block_first = _mm512_loadu_si512((const void*)(haystack + i + needle.first));
+			__m512i block_last = _mm512_loadu_si512((const void*)(haystack + i + needle.last));
+			uint64_t mask = _mm512_cmpeq_epi8_mask(_mm512_and_si512(block_first, first_mask), first)
+			              & _mm512_cmpeq_epi8_mask(_mm512_and_si512(block_last, last_mask), last);
+			while (mask) {
+				uint64_t pos = i + __builtin_ctzll(mask);
+				if (verify_masked_avx512(haystack + pos, needle)) {
+					return pos;
+				}
+				mask &= mask - 1;
+			}
+		}
+		return find_masked_avx2(haystack, len, needle, i);
+	}
+
+	/*
+	 * The approximate kernels. Each lane of @left is one offset's budget of
+	 * mismatches plus one, so a lane that reaches zero has too many.
+	 */
+	__attribute__((target("sse2")))
+	static uint64_t find_approx_sse2(const uint8_t* haystack, uint64_t len,
+	                                 const uint8_t* needle, uint64_t needle_len,
+	                                 uint32_t max_distance, uint32_t& distance, uint64_t i)
+	{
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i budget = _mm_set1_epi8(max_distance + 1);
+		const uint64_t positions = len - needle_len + 1;
+
+		for (; i + 16 <= positions; i += 16) {
+			__m128i left = budget;
+			for (uint64_t j = 0; j < needle_len; ++j) {
+				__m128i block = _mm_loadu_si128((const __m128i*)(haystack + i + j));
+				__m128i equal = _mm_cmpeq_epi8(block, _mm_set1_epi8(needle[j]));
+				left = _mm_subs_epu8(left, _mm_andnot_si128(equal, one));
+				if ((j & 7) == 7 && _mm_movemask_epi8(_mm_cmpeq_epi8(left, zero)) == 0xffff) {
+					break;
+				}
+			}
+			uint32_t alive = ~_mm_movemask_epi8(_mm_cmpeq_epi8(left, zero)) & 0xffff;
+			if (alive) {
+				alignas(16) uint8_t lanes[16];
+				_mm_store_si128((__m128i*)lanes, left);
+				uint32_t lane = __builtin_ctz(alive);
+				distance = max_distance + 1 - lanes[lane];
+				return i + lane;
+			}
+		}
+		return find_approx_scalar(haystack, len, needle, needle_len, max_distance, distance, i);
+	}
+
+	__attribute__((target("avx2")))
+	static uint64_t find_approx_avx2(const uint8_t* haystack, uint64_t len,
+	                                 const uint8_t* needle, uint64_t needle_len,
+	                                 uint32_t max_distance, uint32_t& distance, uint64_t i)
+	{
+		const __m256i one = _mm256_set1_epi8(1);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i budget = _mm256_set1_epi8(max_distance + 1);
+		const uint64_t positions = len - needle_len + 1;
+
+		for (; i + 32 <= positions; i += 32) {
+			__m256i left = budget;
+			for (uint64_t j = 0; j < needle_len; ++j) {
+				__m256i block = _mm256_loadu_si256((const __m256i*)(haystack + i + j));
+				__m256i equal = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(needle[j]));
+				left = _mm256_subs_epu8(left, _mm256_andnot_si256(equal, one));
+				if ((j & 7) == 7 && (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(left, zero)) == 0xffffffff) {
+					break;
+				}
+			}
+			uint32_t alive = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(left, zero));
+			if (alive) {
+				alignas(32) uint8_t lanes[32];
+				_mm256_store_si256((__m256i*)lanes, left);
+				uint32_t lane = __builtin_ctz(alive);
+				distance = max_distance + 1 - lanes[lane];
+				return i + lane;
+			}
+		}
+		return find_approx_sse2(haystack, len, needle, needle_len, max_distance, distance, i);
+	}
+
+	__attribute__((target("avx512f,avx512bw")))
+	static uint64_t find_approx_avx512(const uint8_t* haystack, uint64_t len,
+	                                   const uint8_t* needle, uint64_t needle_len,
+	                                   uint32_t max_distance, uint32_t& distance, uint64_t i)
+	{
+		const __m512i one = _mm512_set1_epi8(1);
+		const __m512i budget = _mm512_set1_epi8(max_distance + 1);
+		const uint64_t positions = len - needle_len + 1;
+
+		for (; i + 64 <= positions; i += 64) {
+			__m512i left = budget;
+			for (uint64_t j = 0; j < needle_len; ++j) {
+				__m512i block = _mm512_loadu_si512((const void*)(haystack + i + j));
+				__mmask64 differ = _mm512_cmpneq_epi8_mask(block, _mm512_set1_epi8(needle[j]));
+				left = _mm512_mask_subs_epu8(left, differ, left, one);
+				if ((j & 7) == 7 && _mm512_test_epi8_mask(left, left) == 0) {
+					break;
+				}
+			}
+			uint64_t alive = _mm512_test_epi8_mask(left, left);
+			if (alive) {
+				alignas(64) uint8_t lanes[64];
+				_mm512_store_si512((void*)lanes, left);
+				uint32_t lane = __builtin_ctzll(alive);
+				distance = max_distance + 1 - lanes[lane];
+				return i + lane;
+			}
+		}
+		return find_approx_avx2(haystack, len, needle, needle_len, max_distance, distance, i);
+	}
+
+	/*
+	 * The range kernels. A block of V bytes is covered by loading a vector
+	 * at each of the first sizeof(T) offsets that can hold a value (one, if
+	 * values are aligned to their size or more), and the first offset whose
+	 * value is in range is the smallest across those loads.
+	 */
+
+	/**
+	 * The bits of a T in an integer of the same size.
+	 */
+	template <class T>
+	static auto raw_bits(T value)
+	{
+		using bits = std::conditional_t<sizeof(T) == 1, int8_t,
+		             std::conditional_t<sizeof(T) == 2, int16_t,
+		             std::conditional_t<sizeof(T) == 4, int32_t, int64_t>>>;
+		bits b;
+		memcpy(&b, &value, sizeof(T));
+		return b;
+	}
+
+	/**
+	 * A shuffle that reverses the bytes of each T, for big-endian values.
+	 */
+	template <uint64_t W>
+	__attribute__((target("avx2")))
+	static __m256i byte_reverse_avx2()
+	{
+		alignas(32) uint8_t order[32];
+		for (uint32_t i = 0; i < 32; ++i) {
+			order[i] = (i % 16) / W * W + (W - 1 - i % W);
+		}
+		return _mm256_load_si256((const __m256i*)order);
+	}
+
+	template <class T>
+	__attribute__((target("avx2")))
+	static __m256i broadcast_avx2(T value)
+	{
+		auto b = raw_bits(value);
+		if constexpr (sizeof(T) == 1) return _mm256_set1_epi8(b);
+		if constexpr (sizeof(T) == 2) return _mm256_set1_epi16(b);
+		if constexpr (sizeof(T) == 4) return _mm256_set1_epi32(b);
+		if constexpr (sizeof(T) == 8) return _mm256_set1_epi64x(b);
+	}
+
+	template <uint64_t W>
+	__attribute__((target("avx2")))
+	static __m256i greater_avx2(__m256i a, __m256i b)
+	{
+		if constexpr (W == 1) return _mm256_cmpgt_epi8(a, b);
+		if constexpr (W == 2) return _mm256_cmpgt_epi16(a, b);
+		if constexpr (W == 4) return _mm256_cmpgt_epi32(a, b);
+		if constexpr (W == 8) return _mm256_cmpgt_epi64(a, b);
+	}
+
+	/**
+	 * A bit for each byte of @v that's part of a value from @lo to @hi.
+	 * AVX2 only compares signed integers, so unsigned ones (and their bounds)
+	 * have their top bits flipped by @flip first, which keeps their order.
+	 */
+	template <class T>
+	__attribute__((target("avx2")))
+	static uint32_t in_range_avx2(__m256i v, __m256i lo, __m256i hi, __m256i flip)
+	{
+		if constexpr (std::is_same_v<T, float>) {
+			__m256 x = _mm256_castsi256_ps(v);
+			__m256 in = _mm256_and_ps(_mm256_cmp_ps(x, _mm256_castsi256_ps(lo), _CMP_GE_OQ),
+			                          _mm256_cmp_ps(x, _mm256_castsi256_ps(hi), _CMP_LE_OQ));
+			return _mm256_movemask_epi8(_mm256_castps_si256(in));
+		} else if constexpr (std::is_same_v<T, double>) {
+			__m256d x = _mm256_castsi256_pd(v);
+			__m256d in = _mm256_and_pd(_mm256_cmp_pd(x, _mm256_castsi256_pd(lo), _CMP_GE_OQ),
+			                           _mm256_cmp_pd(x, _mm256_castsi256_pd(hi), _CMP_LE_OQ));
+			return _mm256_movemask_epi8(_mm256_castpd_si256(in));
+		} else {
+			v = _mm256_xor_si256(v, flip);
+			__m256i out = _mm256_or_si256(greater_avx2<sizeof(T)>(lo, v), greater_avx2<sizeof(T)>(v, hi));
+			return ~(uint32_t)_mm256_movemask_epi8(out);
+		}
+	}
+
+	template <class T>
+	__attribute__((target("avx2")))
+	static uint64_t find_range_avx2(const uint8_t* haystack, uint64_t len, const value_range<T>& range, uint64_t i)
+	{
+		constexpr uint64_t W = sizeof(T);
+		if (range.align >= 32) {
+			return find_range_scalar(haystack, len, range, i);
+		}
+
+		// Unsigned integers are compared as signed, after flipping their top bits
+		T top = 0;
+		if constexpr (std::is_integral_v<T> && std::is_unsigned_v<T>) {
+			top = (T)1 << (8 * W - 1);
+		}
+		T lo_bits = range.lo;
+		T hi_bits = range.hi;
+		if constexpr (std::is_integral_v<T>) {
+			lo_bits ^= top;
+			hi_bits ^= top;
+		}
+		const __m256i flip = broadcast_avx2<T>(top);
+		const __m256i lo = broadcast_avx2<T>(lo_bits);
+		const __m256i hi = broadcast_avx2<T>(hi_bits);
+		const __m256i reverse = byte_reverse_avx2<W>();
+		const bool swap = W > 1 && range.big_endian;
+
+		// Loads a step apart cover every allowed offset; with alignments
+		// above the size, only some of the values in each load are allowed
+		const uint64_t step = std::min<uint64_t>(range.align, W);
+		uint32_t allowed = ~0u;
+		if (range.align > W) {
+			allowed = 0;
+			for (uint64_t b = 0; b < 32; b += range.align) {
+				allowed |= (uint32_t)((1ull << W) - 1) << b;
+			}
+		}
+
+		for (; i + 32 + W - 1 <= len; i += 32) {
+			uint64_t first = UINT64_MAX;
+			for (uint64_t s = 0; s < W; s += step) {
+				__m256i v = _mm256_loadu_si256((const __m256i*)(haystack + i + s));
+				if (swap) {
+					v = _mm256_shuffle_epi8(v, reverse);
+				}
+				uint32_t mask = in_range_avx2<T>(v, lo, hi, flip) & allowed;
+				if (mask) {
+					first = std::min<uint64_t>(first, s + __builtin_ctz(mask));
+				}
+			}
+			if (first != UINT64_MAX) {
+				return i + first;
+			}
+		}
+		return find_range_scalar(haystack, len, range, i);
+	}
+
+	/**
+	 * A bit for each T in @v that's from @lo to @hi. AVX-512 compares
+	 * unsigned integers and floats directly.
+	 */
+	template <class T>
+	__attribute__((target("avx512f,avx512bw")))
+	static uint64_t in_range_avx512(__m512i v, __m512i lo, __m512i hi)
+	{
+		constexpr bool sign = std::is_signed_v<T>;
+		if constexpr (std::is_same_v<T, float>) {
+			__m512 x = _mm512_castsi512_ps(v);
+			return _mm512_cmp_ps_mask(x, _mm512_castsi512_ps(lo), _CMP_GE_OQ)
+			     & _mm512_cmp_ps_mask(x, _mm512_castsi512_ps(hi), _CMP_LE_OQ);
+		} else if constexpr (std::is_same_v<T, double>) {
+			__m512d x = _mm512_castsi512_pd(v);
+			return _mm512_cmp_pd_mask(x, _mm512_castsi512_pd(lo), _CMP_GE_OQ)
+			     & _mm512_cmp_pd_mask(x, _mm512_castsi512_pd(hi), _CMP_LE_OQ);
+		} else if constexpr (sizeof(T) == 1) {
+			return sign ? _mm512_cmpge_epi8_mask(v, lo) & _mm512_cmple_epi8_mask(v, hi)
+			            : _mm512_cmpge_epu8_mask(v, lo) & _mm512_cmple_epu8_mask(v, hi);
+		} else if constexpr (sizeof(T) == 2) {
+			return sign ? _mm512_cmpge_epi16_mask(v, lo) & _mm512_cmple_epi16_mask(v, hi)
+			            : _mm512_cmpge_epu16_mask(v, lo) & _mm512_cmple_epu16_mask(v, hi);
+		} else if constexpr (sizeof(T) == 4) {
+			return sign ? _mm512_cmpge_epi32_mask(v, lo) & _mm512_cmple_epi32_mask(v, hi)
+			            : _mm512_cmpge_epu32_mask(v, lo) & _mm512_cmple_epu32_mask(v, hi);
+		} else {
+			return sign ? _mm512_cmpge_epi64_mask(v, lo) & _mm512_cmple_epi64_mask(v, hi)
+			            : _mm512_cmpge_epu64_mask(v, lo) & _mm512_cmple_epu64_mask(v, hi);
+		}
+	}
+
+	template <uint64_t W>
+	__attribute__((target("avx512f,avx512bw")))
+	static __m512i byte_reverse_avx512()
+	{
+		alignas(64) uint8_t order[64];
+		for (uint32_t i = 0; i < 64; ++i) {
+			order[i] = (i % 16) / W * W + (W - 1 - i % W);
+		}
+		return _mm512_load_si512((const void*)order);
+	}
+
+	template <class T>
+	__attribute__((target("avx512f,avx512bw")))
+	static __m512i broadcast_avx512(T value)
+	{
+		auto b = raw_bits(value);
+		if constexpr (sizeof(T) == 1) return _mm512_set1_epi8(b);
+		if constexpr (sizeof(T) == 2) return _mm512_set1_epi16(b);
+		if constexpr (sizeof(T) == 4) return _mm512_set1_epi32(b);
+		if constexpr (sizeof(T) == 8) return _mm512_set1_epi64(b);
+	}
+
+	template <class T>
+	__attribute__((target("avx512f,avx512bw")))
+	static uint64_t find_range_avx512(const uint8_t* haystack, uint64_t len, const value_range<T>& range, uint64_t i)
+	{
+		constexpr uint64_t W = sizeof(T);
+		if (range.align >= 64) {
+			return find_range_scalar(haystack, len, range, i);
+		}
+
+		const __m512i lo = broadcast_avx512<T>(range.lo);
+		const __m512i hi = broadcast_avx512<T>(range.hi);
+		const __m512i reverse = byte_reverse_avx512<W>();
+		const bool swap = W > 1 && range.big_endian;
+
+		// As for AVX2, but the masks have a bit per value rather than per byte
+		const uint64_t step = std::min<uint64_t>(range.align, W);
+		uint64_t allowed = ~0ull;
+		if (range.align > W) {
+			allowed = 0;
+			for (uint64_t lane = 0; lane < 64 / W; lane += range.align / W) {
+				allowed |= 1ull << lane;
+			}
+		}
+
+		for (; i + 64 + W - 1 <= len; i += 64) {
+			uint64_t first = UINT64_MAX;
+			for (uint64_t s = 0; s < W; s += step) {
+				__m512i v = _mm512_loadu_si512((const void*)(haystack + i + s));
+				if (swap) {
+					v = _mm512_shuffle_epi8(v, reverse);
+				}
+				uint64_t mask = in_range_avx512<T>(v, lo, hi) & allowed;
+				if (mask) {
+					first = std::min<uint64_t>(first, s + W * __builtin_ctzll(mask));
+				}
+			}
+			if (first != UINT64_MAX) {
+				return i + first;
+			}
+		}
+		return find_range_avx2(haystack, len, range, i);
+	}
+#endif
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include <sys/resource.h>
+
+/**
+ * Counters for where a search spends its time and how well the candidate
+ * filters work, for gb --stats.
+ *
+ * Nothing is collected until enable() is called. Until then active() is
+ * null, and every place that counts tests it once per call, never once per
+ * byte, so an ordinary search pays nothing measurable. Counters are atomic
+ * since searches run on several threads, and the times are summed across
+ * threads.
+ */
+struct search_stats
+{
+	std::atomic<uint64_t> files{ 0 };
+	std::atomic<uint64_t> bytes_loaded{ 0 };  // Mapped, or read from streams
+	std::atomic<uint64_t> bytes_scanned{ 0 }; // Handed to the needle to search
+	std::atomic<uint64_t> candidates{ 0 };    // Passed the SIMD first/last byte filter
+	std::atomic<uint64_t> verified{ 0 };      // ...and then matched in full
+	std::atomic<uint64_t> matches{ 0 };
+	std::atomic<uint64_t> allocations{ 0 };
+
+	std::atomic<uint64_t> map_ns{ 0 };    // Opening, mapping and paging in files
+	std::atomic<uint64_t> read_ns{ 0 };   // read() on streams, within search_ns
+	std::atomic<uint64_t> search_ns{ 0 }; // Searching, including printing
+	std::atomic<uint64_t> print_ns{ 0 };  // Formatting and writing matches
+
+	/**
+	 * The counters being collected into, or null if stats are off.
+	 */
+	static search_stats* active() { return s_active; }
+
+	/**
+	 * Start collecting. Call before any searching starts, since the pointer
+	 * isn't synchronized with other threads.
+	 */
+	static void enable()
+	{
+		static search_stats stats;
+		s_active = &stats;
+	}
+
+	/**
+	 * Adds the time from its construction to its destruction to a counter
+	 * of the active stats, or does nothing at all if there are none.
+	 */
+	class timer
+	{
+	public:
+		explicit timer(std::atomic<uint64_t> search_stats::*counter) :
+			m_stats(active()),
+			m_counter(counter)
+		{
+			if (m_stats) {
+				m_start = std::chrono::steady_clock::now();
+			}
+		}
+
+		~timer()
+		{
+			if (m_stats) {
+				auto elapsed = std::chrono::steady_clock::now() - m_start;
+				(m_stats->*m_counter) += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+			}
+		}
+
+	private:
+		search_stats* const m_stats;
+		std::atomic<uint64_t> search_stats::* const m_counter;
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	/**
+	 * Peak resident set size of the process so far, in KiB.
+	 */
+	static uint64_t peak_rss_kb()
+	{
+		struct rusage usage;
+		return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+	}
+
+	/**
+	 * Write the counters for a run that took @wall_ns, either as text for
+	 * people or as a single JSON object.
+	 */
+	void write(std::ostream& out, uint64_t wall_ns, bool json) const
+	{
+		const uint64_t load = map_ns + read_ns;
+		const uint64_t print = print_ns;
+		const uint64_t search = search_ns;
+		// Stream reads and printing both happen inside the search calls
+		const uint64_t scan = search > read_ns + print ? search - read_ns - print : 0;
+
+		if (json) {
+			out << "{\"files\": " << files << ", \"bytes_loaded\": " << bytes_loaded
+			    << ", \"bytes_scanned\": " << bytes_scanned << ", \"candidates\": " << candidates
+			    << ", \"verified\": " << verified << ", \"matches\": " << matches
+			    << ", \"allocations\": " << allocations << ", \"peak_rss_kb\": " << peak_rss_kb()
+			    << ", \"wall_ns\": " << wall_ns << ", \"load_ns\": " << load
+			    << ", \"scan_ns\": " << scan << ", \"print_ns\": " << print
+			    << ", \"load_gbps\": " << gbps(bytes_loaded, load)
+			    << ", \"scan_gbps\": " << gbps(bytes_scanned, scan) << "}\n";
+			return;
+		}
+
+		out << "files:         " << files << '\n'
+		    << "bytes loaded:  " << bytes_loaded << '\n'
+		    << "bytes scanned: " << bytes_scanned << '\n'
+		    << "candidates:    " << candidates << " (" << verified << " verified)\n"
+		    << "matches:       " << matches << '\n'
+		    << "allocations:   " << allocations << '\n'
+		    << "peak RSS:      " << peak_rss_kb() << " KiB\n"
+		    << "wall time:     " << ms(wall_ns) << " ms\n"
+		    << "  load:        " << ms(load) << " ms, " << gbps(bytes_loaded, load) << " GB/s\n"
+		    << "  scan:        " << ms(scan) << " ms, " << gbps(bytes_scanned, scan) << " GB/s\n"
+		    << "  print:       " << ms(print) << " ms\n";
+	}
+
+private:
+	static double ms(uint64_t ns) { return ns / 1e6; }
+
+	static double gbps(uint64_t bytes, uint64_t ns) { return ns ? (double)bytes / ns : 0; }
+
+	static inline search_stats* s_active = nullptr;
+};
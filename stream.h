@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cerrno>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <unistd.h>
+
+#include "buffer.h"
+#include "decompress.h"
+#include "reader.h"
+#include "stats.h"
+
+/**
+ * Searches a stream of unknown length in fixed-size chunks.
+ *
+ * Only a small window of the stream is kept in memory: enough bytes to find
+ * matches that straddle a chunk boundary (needle length - 1), plus the
+ * context requested before and after each match. Matches are reported as
+ * soon as their trailing context has arrived, so memory use is constant no
+ * matter how long the stream is.
+ *
+ * The needle has to have a longest match, since an unbounded needle's
+ * matches could reach back to the start of the stream.
+ */
+class stream_search
+{
+public:
+	/**
+	 * Called once per match.
+	 *
+	 * @window holds the retained bytes of the stream, the first of which is at
+	 * stream offset @window_offset. @match's offset is relative to the start
+	 * of @window.
+	 */
+	using match_callback = std::function<void(const buffer& window,
+	                                          uint64_t window_offset,
+	                                          const needle_match& match)>;
+
+	static const uint64_t default_chunk_len = 1024 * 1024;
+
+	stream_search(const needle& needle,
+	              uint64_t context_before,
+	              uint64_t context_after,
+	              uint64_t chunk_len = default_chunk_len) :
+		m_needle(needle),
+		m_context_before(context_before),
+		m_context_after(context_after),
+		m_chunk_len(chunk_len),
+		m_window_offset(0),
+		m_next(0),
+		m_stopped(false)
+	{
+		m_window.reserve(chunk_len + context_before + needle.length() + context_after);
+	}
+
+	/**
+	 * Append the next piece of the stream and report any matches that are
+	 * now complete.
+	 */
+	void feed(const uint8_t* data, uint64_t len, const match_callback& cb)
+	{
+		m_window.insert(m_window.end(), data, data + len);
+		scan(false, cb);
+	}
+
+	/**
+	 * Signal the end of the stream and report any remaining matches.
+	 */
+	void finish(const match_callback& cb)
+	{
+		scan(true, cb);
+	}
+
+	/**
+	 * Report no more matches. Called from the callback, this makes run()
+	 * return without reading the rest of the stream.
+	 */
+	void stop() { m_stopped = true; }
+
+	/**
+	 * Read the file descriptor until EOF, reporting matches as they are found.
+	 *
+	 * Returns the number of bytes read, or UINT64_MAX on a read error.
+	 */
+	uint64_t run(int fd, const match_callback& cb)
+	{
+		std::vector<uint8_t> chunk(m_chunk_len);
+		uint64_t total = 0;
+
+		while (!m_stopped) {
+			ssize_t n;
+			{
+				search_stats::timer timer(&search_stats::read_ns);
+				n = read(fd, chunk.data(), chunk.size());
+			}
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return UINT64_MAX;
+			}
+			if (n == 0) break;
+			total += n;
+			feed(chunk.data(), n, cb);
+		}
+		finish(cb);
+
+		return total;
+	}
+
+	/**
+	 * As above, but for the chunks @reader hands over: a chunk_reader, which
+	 * keeps the next reads of a regular file going while this one's
+	 * searched, or a decompressing_reader, in which case offsets are in the
+	 * decompressed data.
+	 */
+	template<typename R>
+	uint64_t run(R& reader, const match_callback& cb)
+	{
+		uint64_t total = reader.run([&](const uint8_t* data, uint64_t len) {
+			feed(data, len, cb);
+			return !m_stopped;
+		});
+		if (total != UINT64_MAX) {
+			finish(cb);
+		}
+		return total;
+	}
+
+	/**
+	 * Total number of stream bytes seen so far.
+	 */
+	uint64_t bytes_seen() const { return m_window_offset + m_window.size(); }
+
+private:
+	void scan(bool at_eof, const match_callback& cb)
+	{
+		const uint64_t needle_len = m_needle.length();
+		const uint64_t end = bytes_seen();
+
+		if (needle_len == 0 || end == 0 || m_stopped) {
+			return;
+		}
+
+		// Work out the last match position we can report. Until we hit EOF
+		// a match also needs its trailing context in the window.
+		uint64_t limit = end - 1;
+		if (!at_eof) {
+			uint64_t needed = needle_len + m_context_after;
+			if (end < needed) {
+				return;
+			}
+			limit = end - needed;
+		}
+		if (limit < m_next) {
+			return;
+		}
+
+		// Search only the part of the window that can hold a reportable match.
+		// Needles with patterns shorter than length() can still turn up
+		// matches past the limit; those get reported next time round. The
+		// next search for a disjoint needle carries on from where the last
+		// match ends.
+		arraybuf window(m_window.data(), m_window.size());
+		arraybuf view(m_window.data(), std::min(limit - m_window_offset + needle_len, (uint64_t)m_window.size()));
+		uint64_t next = limit + 1;
+		m_needle.for_each_match(view, [&](const needle_match& m) {
+			if (m.offset + m_window_offset > limit) {
+				return false;
+			}
+			cb(window, m_window_offset, m);
+			if (m_needle.disjoint()) {
+				next = std::max(next, m_window_offset + m.offset + m.length);
+			}
+			return !m_stopped;
+		}, m_next - m_window_offset);
+		m_next = next;
+
+		// Drop everything that's no longer needed as leading context, keeping
+		// the window aligned for the needle
+		uint64_t keep_from = m_next > m_context_before ? m_next - m_context_before : 0;
+		keep_from -= keep_from % m_needle.alignment();
+		if (keep_from > m_window_offset) {
+			m_window.erase(m_window.begin(), m_window.begin() + (keep_from - m_window_offset));
+			m_window_offset = keep_from;
+		}
+	}
+
+	const needle& m_needle;
+	const uint64_t m_context_before;
+	const uint64_t m_context_after;
+	const uint64_t m_chunk_len;
+
+	std::vector<uint8_t> m_window;
+	uint64_t m_window_offset; // Stream offset of m_window[0]
+	uint64_t m_next;          // Stream offset of the next position to test
+	bool m_stopped;
+};
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fnmatch.h>
+
+#include "parallel.h"
+
+/**
+ * Which files a directory walk picks up.
+ */
+struct walk_filter
+{
+	std::vector<std::string> include; // Globs a file's name must match one of, if any are given
+	std::vector<std::string> exclude; // Globs for file and directory names to leave out
+	uint64_t min_size = 0;
+	uint64_t max_size = UINT64_MAX;
+	bool skip_symlinks = false;       // Leave out symlinks to files
+	bool skip_special = false;        // Leave out FIFOs, devices and sockets
+
+	bool excluded(const std::string& name) const
+	{
+		return std::any_of(exclude.begin(), exclude.end(), [&](const std::string& glob) {
+			return fnmatch(glob.c_str(), name.c_str(), 0) == 0;
+		});
+	}
+
+	bool included(const std::string& name) const
+	{
+		return include.empty() || std::any_of(include.begin(), include.end(), [&](const std::string& glob) {
+			return fnmatch(glob.c_str(), name.c_str(), 0) == 0;
+		});
+	}
+};
+
+/**
+ * Walks directory trees, handing each file that passes the filter to a
+ * processing function, and the results to a consumer in a fixed order:
+ * entries sorted by name, depth first. Files are numbered in that order
+ * from 0. The result type must be default constructible; files skipped
+ * after the walk is stopped get a default one.
+ *
+ * With a thread pool, every directory is listed in a task of its own, and
+ * files are processed in tasks of their own a few per thread ahead of the
+ * one being consumed, so listing and processing overlap without every
+ * file's result piling up waiting for its turn. The consumer still runs on
+ * the calling thread, in order, as soon as each result it's waiting for is
+ * ready.
+ *
+ * Symlinks to directories are never followed, so the walk can't loop.
+ */
+template<typename T>
+class directory_walker
+{
+public:
+	/**
+	 * Runs on any thread, once per file.
+	 */
+	using process_fn = std::function<T(const std::filesystem::path& file, uint64_t seq)>;
+
+	/**
+	 * Runs on the calling thread with each result, in order. Return false
+	 * to stop the walk.
+	 */
+	using consume_fn = std::function<bool(const std::filesystem::path& file, uint64_t seq, T& result)>;
+
+	/**
+	 * Runs on the calling thread for each directory that couldn't be read.
+	 */
+	using error_fn = std::function<void(const std::filesystem::path& dir, const std::error_code& ec)>;
+
+	/**
+	 * Runs on the calling thread when each file's turn comes, before its
+	 * result is waited for.
+	 */
+	using turn_fn = std::function<void(const std::filesystem::path& file, uint64_t seq)>;
+
+	/**
+	 * With @pool, up to @ahead_per_thread files per thread are processed
+	 * ahead of the one being consumed.
+	 */
+	directory_walker(const walk_filter& filter, thread_pool* pool = nullptr, uint32_t ahead_per_thread = 2) :
+		m_filter(filter),
+		m_pool(pool),
+		m_ahead(pool ? std::max(1u, pool->size() * ahead_per_thread) : 1)
+	{}
+
+	/**
+	 * Walk the tree under @root (or just process it, if it isn't a
+	 * directory). Returns false if @consume stopped it.
+	 */
+	bool walk(const std::filesystem::path& root, const process_fn& process,
+	          const consume_fn& consume, const error_fn& error, const turn_fn& turn = nullptr) const
+	{
+		std::error_code ec;
+		if (!std::filesystem::is_directory(root, ec)) {
+			// Just a file
+			if (turn) turn(root, 0);
+			T result = process(root, 0);
+			return consume(root, 0, result);
+		}
+
+		std::atomic<bool> stop(false);
+		std::unique_ptr<dir_node> node = list(root, stop);
+		return drain(std::move(node), process, consume, error, turn, stop);
+	}
+
+private:
+	struct dir_node;
+
+	struct entry
+	{
+		std::filesystem::path path;
+		std::future<std::unique_ptr<dir_node>> dir; // For subdirectories; files don't have one
+	};
+
+	struct dir_node
+	{
+		std::filesystem::path path;
+		std::error_code error;
+		std::vector<entry> entries;
+	};
+
+	/**
+	 * Read a directory and start listing its subdirectories.
+	 */
+	std::unique_ptr<dir_node> list(const std::filesystem::path& dir, std::atomic<bool>& stop) const
+	{
+		auto node = std::make_unique<dir_node>();
+		node->path = dir;
+
+		std::vector<std::filesystem::directory_entry> found;
+		std::filesystem::directory_iterator it(dir, node->error);
+		for (; !node->error && it != std::filesystem::directory_iterator(); it.increment(node->error)) {
+			found.push_back(*it);
+		}
+		std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) {
+			return a.path().filename() < b.path().filename();
+		});
+
+		for (const auto& de : found) {
+			if (stop) {
+				break;
+			}
+			const std::string name = de.path().filename().string();
+			if (m_filter.excluded(name)) {
+				continue;
+			}
+
+			std::error_code ec;
+			const bool is_link = de.is_symlink(ec);
+			if (!is_link && de.is_directory(ec)) {
+				entry e{ de.path(), {} };
+				e.dir = start([this, path = de.path(), &stop] {
+					return list(path, stop);
+				});
+				node->entries.push_back(std::move(e));
+				continue;
+			}
+			if (wanted(de, is_link, name)) {
+				node->entries.push_back({ de.path(), {} });
+			}
+		}
+		return node;
+	}
+
+	/**
+	 * Whether a non-directory entry passes the filter.
+	 */
+	bool wanted(const std::filesystem::directory_entry& de, bool is_link, const std::string& name) const
+	{
+		if (is_link && m_filter.skip_symlinks) {
+			return false;
+		}
+
+		// Look through symlinks from here on
+		std::error_code ec;
+		std::filesystem::file_status st = de.status(ec);
+		if (ec || std::filesystem::is_directory(st)) {
+			return false;
+		}
+		if (!std::filesystem::is_regular_file(st)) {
+			return !m_filter.skip_special && m_filter.included(name);
+		}
+		if (!m_filter.included(name)) {
+			return false;
+		}
+
+		uint64_t size = de.file_size(ec);
+		return !ec && size >= m_filter.min_size && size <= m_filter.max_size;
+	}
+
+	/**
+	 * Run @f on the pool, or, if there isn't one, when its result is
+	 * wanted; a single-threaded walk then goes one file at a time.
+	 */
+	template<typename F>
+	auto start(F&& f) const -> std::future<decltype(f())>
+	{
+		if (m_pool) {
+			return m_pool->submit(std::forward<F>(f));
+		}
+		return std::async(std::launch::deferred, std::forward<F>(f));
+	}
+
+	template<typename R>
+	R wait(std::future<R>& f) const
+	{
+		return m_pool ? m_pool->wait(f) : f.get();
+	}
+
+	/**
+	 * Start processing files in order, and hand their results to the
+	 * consumer, keeping m_ahead files started ahead of the one it's waiting
+	 * for. Directory errors are reported in the same order.
+	 *
+	 * Once stopped, no more files are started, and this keeps going only to
+	 * wait for the tasks already started, since they refer to the walk's
+	 * state.
+	 */
+	bool drain(std::unique_ptr<dir_node> root, const process_fn& process, const consume_fn& consume,
+	           const error_fn& error, const turn_fn& turn, std::atomic<bool>& stop) const
+	{
+		struct pending
+		{
+			std::filesystem::path path;
+			uint64_t seq = 0;
+			std::future<T> result;   // Unless it's a directory error
+			std::error_code error;
+		};
+		std::deque<pending> ahead;
+		uint64_t files_ahead = 0;
+		uint64_t next_seq = 0;
+
+		// Where we are in each directory on the way down to the current one
+		std::vector<std::pair<std::unique_ptr<dir_node>, uint64_t>> stack;
+		auto enter = [&](std::unique_ptr<dir_node> node) {
+			if (node->error) {
+				ahead.push_back({ node->path, 0, {}, node->error });
+			}
+			stack.emplace_back(std::move(node), 0);
+		};
+		auto start_more = [&] {
+			while (!stop && !stack.empty() && files_ahead < m_ahead) {
+				dir_node& node = *stack.back().first;
+				uint64_t& next = stack.back().second;
+				if (next == node.entries.size()) {
+					stack.pop_back();
+					continue;
+				}
+				entry& e = node.entries[next++];
+				if (e.dir.valid()) {
+					enter(wait(e.dir));
+					continue;
+				}
+				const uint64_t seq = next_seq++;
+				ahead.push_back({ e.path, seq, start([&process, &stop, path = e.path, seq] {
+					return stop ? T() : process(path, seq);
+				}), {} });
+				++files_ahead;
+			}
+		};
+
+		enter(std::move(root));
+		start_more();
+		while (!ahead.empty()) {
+			pending p = std::move(ahead.front());
+			ahead.pop_front();
+			if (!p.result.valid()) {
+				if (!stop) {
+					error(p.path, p.error);
+				}
+			} else {
+				if (turn && !stop) {
+					turn(p.path, p.seq);
+				}
+				T result = wait(p.result);
+				--files_ahead;
+				if (!stop && !consume(p.path, p.seq, result)) {
+					stop = true;
+				}
+			}
+			start_more();
+		}
+
+		// Listings still running refer to the walk too
+		for (auto& [node, next] : stack) {
+			finish_listing(*node);
+		}
+		return !stop;
+	}
+
+	/**
+	 * Wait for every listing under @node, once stopped.
+	 */
+	void finish_listing(dir_node& node) const
+	{
+		for (entry& e : node.entries) {
+			if (e.dir.valid()) {
+				finish_listing(*wait(e.dir));
+			}
+		}
+	}
+
+	const walk_filter m_filter;
+	thread_pool* m_pool;
+	const uint64_t m_ahead; // Files started ahead of the one being consumed
+};